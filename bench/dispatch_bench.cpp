@@ -0,0 +1,108 @@
+//
+//  dispatch_bench.cpp
+//  proxy
+//
+//  What it costs io_queue to hand one event to its handler, with many
+//  descriptors registered. Redelivered events never leave the queue: they
+//  time the handler table and the batch loop alone. Events of descriptors
+//  the kernel keeps reporting ready add the wait to that.
+//
+//  usage: dispatch_bench [descriptors [events]]
+//
+
+#include <sys/resource.h>
+#include <unistd.h>
+#include <stdlib.h>
+#include <algorithm>
+#include <chrono>
+#include <iostream>
+#include <vector>
+
+#include "kqueue.hpp"
+
+namespace
+{
+    enum class source { redelivered, kernel };
+
+    // pipes with nothing written never get ready, with a byte they stay
+    // ready: the handlers don't read it
+    struct pipes
+    {
+        pipes(size_t count, bool ready)
+        {
+            for (size_t i = 0; i < count; i++) {
+                int fds[2];
+                if (pipe(fds) == -1) {
+                    std::cout << "pipe() failed after " << i << " descriptors\n";
+                    exit(1);
+                }
+                if (ready && write(fds[1], "x", 1) != 1)
+                    exit(1);
+                read_ends.push_back(fds[0]);
+                write_ends.push_back(fds[1]);
+            }
+        }
+
+        ~pipes()
+        {
+            for (int fd : read_ends)
+                close(fd);
+            for (int fd : write_ends)
+                close(fd);
+        }
+
+        std::vector<int> read_ends;
+        std::vector<int> write_ends;
+    };
+
+    double ns_per_event(source from, size_t descriptors, size_t events)
+    {
+        pipes fds(descriptors, from == source::kernel);
+        io_queue queue;
+        size_t dispatched = 0;
+        for (int fd : fds.read_ends) {
+            queue.add_event_handler(fd, EVFILT_READ, [&queue, &dispatched, events, from](struct kevent event) {
+                if (++dispatched == events)
+                    queue.hard_stop();
+                else if (from == source::redelivered)
+                    queue.redeliver(event.ident, EVFILT_READ);
+            });
+            if (from == source::redelivered)
+                queue.redeliver(fd, EVFILT_READ);
+        }
+
+        auto start = std::chrono::steady_clock::now();
+        queue.watch_loop();
+        std::chrono::duration<double, std::nano> spent = std::chrono::steady_clock::now() - start;
+        for (int fd : fds.read_ends)
+            queue.delete_event_handler(fd, EVFILT_READ);
+        return spent.count() / dispatched;
+    }
+
+    // two per pipe, and a few for the queue itself
+    size_t raise_descriptor_limit(size_t descriptors)
+    {
+        struct rlimit limit;
+        if (getrlimit(RLIMIT_NOFILE, &limit) == -1)
+            return descriptors;
+        rlim_t wanted = 2 * descriptors + 64;
+        if (limit.rlim_cur < wanted) {
+            limit.rlim_cur = std::min(wanted, limit.rlim_max);
+            setrlimit(RLIMIT_NOFILE, &limit);
+            getrlimit(RLIMIT_NOFILE, &limit);
+        }
+        return std::min<size_t>(descriptors, (limit.rlim_cur - 64) / 2);
+    }
+}
+
+int main(int argc, char* argv[])
+{
+    size_t descriptors = argc > 1 ? strtoul(argv[1], nullptr, 10) : 8192;
+    size_t events = argc > 2 ? strtoul(argv[2], nullptr, 10) : 20000000;
+    descriptors = raise_descriptor_limit(descriptors);
+
+    std::cout << descriptors << " descriptors, " << events << " events\n";
+    std::cout << "redelivered: " << ns_per_event(source::redelivered, descriptors, events) << " ns per event\n";
+    std::cout << "kernel:      " << ns_per_event(source::kernel, descriptors, events) << " ns per event\n";
+    return 0;
+}
@@ -0,0 +1,218 @@
+//
+//  harness.hpp
+//  proxy
+//
+//  What the benchmarks that go through the proxy share: the proxy on an
+//  event loop of its own, an origin on this host and a blocking client.
+//
+
+#ifndef harness_hpp
+#define harness_hpp
+
+#include <arpa/inet.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+#include <sys/socket.h>
+#include <unistd.h>
+#include <errno.h>
+#include <stdlib.h>
+#include <string.h>
+#include <functional>
+#include <future>
+#include <iostream>
+#include <mutex>
+#include <stdexcept>
+#include <string>
+#include <thread>
+#include <vector>
+
+#include "kqueue.hpp"
+#include "proxy.hpp"
+#include "DNSresolver.hpp"
+#include "worker_pool.hpp"
+
+namespace harness
+{
+    inline int connect_to(int port)
+    {
+        int fd = ::socket(AF_INET, SOCK_STREAM, 0);
+        struct sockaddr_in addr = {};
+        addr.sin_family = AF_INET;
+        addr.sin_port = htons(port);
+        addr.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+        if (fd == -1 || ::connect(fd, reinterpret_cast<sockaddr*>(&addr), sizeof(addr)) == -1) {
+            std::cout << "can't connect to port " << port << ": " << strerror(errno) << "\n";
+            exit(1);
+        }
+        return fd;
+    }
+
+    inline bool send_all(int fd, char const* data, size_t size)
+    {
+        while (size != 0) {
+            ssize_t n = ::send(fd, data, size, MSG_NOSIGNAL);
+            if (n <= 0)
+                return false;
+            data += n;
+            size -= n;
+        }
+        return true;
+    }
+
+    inline bool send_all(int fd, std::string const& text)
+    {
+        return send_all(fd, text.data(), text.size());
+    }
+
+    // a head, the bytes read past it stay in `buffer`; empty on eof
+    inline std::string read_head(int fd, std::string& buffer)
+    {
+        size_t end;
+        while ((end = buffer.find("\r\n\r\n")) == std::string::npos) {
+            char bytes[4096];
+            ssize_t n = ::recv(fd, bytes, sizeof(bytes), 0);
+            if (n <= 0)
+                return std::string();
+            buffer.append(bytes, n);
+        }
+        std::string head = buffer.substr(0, end + 4);
+        buffer.erase(0, end + 4);
+        return head;
+    }
+
+    inline size_t content_length(std::string const& head)
+    {
+        size_t at = head.find("Content-Length: ");
+        return at == std::string::npos ? 0 : strtoul(head.c_str() + at + 16, nullptr, 10);
+    }
+
+    // reads a response to its end without keeping the body, false on eof
+    inline bool read_response(int fd, std::string& buffer)
+    {
+        std::string head = read_head(fd, buffer);
+        if (head.empty())
+            return false;
+        size_t left = content_length(head);
+        size_t taken = std::min(left, buffer.size());
+        buffer.erase(0, taken);
+        left -= taken;
+        while (left != 0) {
+            char bytes[65536];
+            ssize_t n = ::recv(fd, bytes, std::min(left, sizeof(bytes)), 0);
+            if (n <= 0)
+                return false;
+            left -= n;
+        }
+        return true;
+    }
+
+    // a thread per connection runs `serve` on it; the listener is on a port of its own
+    struct origin
+    {
+        typedef std::function<void(int fd)> serve_t;
+
+        explicit origin(serve_t serve)
+            : serve(std::move(serve))
+        {
+            listener = ::socket(AF_INET, SOCK_STREAM, 0);
+            struct sockaddr_in addr = {};
+            addr.sin_family = AF_INET;
+            addr.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+            socklen_t length = sizeof(addr);
+            if (::bind(listener, reinterpret_cast<sockaddr*>(&addr), sizeof(addr)) == -1
+                || ::listen(listener, 128) == -1
+                || getsockname(listener, reinterpret_cast<sockaddr*>(&addr), &length) == -1) {
+                std::cout << "can't start the origin: " << strerror(errno) << "\n";
+                exit(1);
+            }
+            port = ntohs(addr.sin_port);
+            acceptor = std::thread([this]() {
+                for (;;) {
+                    int fd = ::accept(listener, nullptr, nullptr);
+                    if (fd == -1)
+                        return;
+                    std::lock_guard<std::mutex> lock(mutex);
+                    connections.push_back(std::thread([this, fd]() {
+                        this->serve(fd);
+                        ::close(fd);
+                    }));
+                }
+            });
+        }
+
+        // the connections must be over by now, closed by their clients
+        ~origin()
+        {
+            ::shutdown(listener, SHUT_RDWR);
+            acceptor.join();
+            ::close(listener);
+            for (auto& thread : connections)
+                thread.join();
+        }
+
+        std::string host() const { return "127.0.0.1:" + std::to_string(port); }
+
+        int listener;
+        int port;
+        serve_t serve;
+        std::thread acceptor;
+        std::mutex mutex;
+        std::vector<std::thread> connections;
+    };
+
+    // the proxy on a loop thread of its own, as main() runs it
+    struct proxy_loop
+    {
+        explicit proxy_loop(int port, socket_profiles const& sockets = socket_profiles())
+            : resolver(1)
+            , pool(1)
+        {
+            std::promise<io_queue*> started;
+            loop = std::thread([this, port, sockets, &started]() {
+                try {
+                    io_queue queue(io_backend::native);
+                    proxy_server proxy(queue, port, resolver, pool, false, sockets);
+                    started.set_value(&queue);
+                    queue.watch_loop();
+                } catch (std::runtime_error const&) {
+                    started.set_exception(std::current_exception());
+                }
+            });
+            try {
+                queue = started.get_future().get();
+            } catch (std::runtime_error const& error) {
+                std::cout << "can't start the proxy: " << error.what() << "\n";
+                loop.join();
+                exit(1);
+            }
+        }
+
+        ~proxy_loop()
+        {
+            io_queue* queue = this->queue;
+            queue->post([queue]() { queue->hard_stop(); });
+            loop.join();
+        }
+
+        // runs task on the loop thread and waits for it: the counters of
+        // the loop are per thread
+        void run(std::function<void()> task)
+        {
+            std::promise<void> done;
+            queue->post([&task, &done]() {
+                task();
+                done.set_value();
+            });
+            done.get_future().wait();
+        }
+
+        io_queue& get_queue() noexcept { return *queue; }
+
+        DNSresolver resolver;
+        worker_pool pool;
+        io_queue* queue = nullptr;
+        std::thread loop;
+    };
+}
+
+#endif /* harness_hpp */
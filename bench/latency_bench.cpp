@@ -0,0 +1,147 @@
+//
+//  latency_bench.cpp
+//  proxy
+//
+//  Round trips of small requests through the proxy, under socket profiles
+//  that differ in what the request asked to tune: Nagle on the client and
+//  upstream sockets, and TCP Fast Open to the origin. The origin writes the
+//  head and the body of its responses separately, as many do.
+//
+//  Fast Open needs net.ipv4.tcp_fastopen with both bits set (3), without
+//  them that profile connects as the default one does.
+//
+//  usage: latency_bench [round trips]
+//
+
+#include <stdlib.h>
+#include <algorithm>
+#include <chrono>
+#include <iomanip>
+#include <iostream>
+#include <string>
+#include <vector>
+
+#include "harness.hpp"
+
+namespace
+{
+    int const proxy_port = 25420;
+
+    typedef std::chrono::duration<double, std::micro> microseconds;
+
+    // /keep answers on a connection that stays open, /close on one that doesn't
+    void answer(int fd)
+    {
+        int set = 1;
+        setsockopt(fd, IPPROTO_TCP, TCP_NODELAY, &set, sizeof(set));
+        std::string const body(100, 'b');
+        std::string buffer;
+        for (;;) {
+            std::string head = harness::read_head(fd, buffer);
+            if (head.empty())
+                return;
+            bool close = head.compare(0, 11, "GET /close ") == 0;
+            harness::send_all(fd, "HTTP/1.1 200 OK\r\nContent-Length: " + std::to_string(body.size())
+                              + (close ? "\r\nConnection: close" : "") + "\r\n\r\n");
+            harness::send_all(fd, body);
+            if (close)
+                return;
+        }
+    }
+
+    struct quantiles
+    {
+        double p50, p90, p99;
+    };
+
+    quantiles of(std::vector<double> times)
+    {
+        if (times.empty())
+            return {0, 0, 0};
+        std::sort(times.begin(), times.end());
+        size_t n = times.size();
+        return {times[n / 2], times[n * 9 / 10], times[std::min(n - 1, n * 99 / 100)]};
+    }
+
+    // every request on one client connection, the upstream pooled
+    quantiles kept_alive(harness::origin const& origin, size_t count)
+    {
+        std::string const request = "GET http://" + origin.host() + "/keep HTTP/1.1\r\nHost: " + origin.host() + "\r\n\r\n";
+        std::vector<double> times;
+        int fd = harness::connect_to(proxy_port);
+        std::string buffer;
+        for (size_t i = 0; i < count; i++) {
+            auto start = std::chrono::steady_clock::now();
+            harness::send_all(fd, request);
+            if (!harness::read_response(fd, buffer))
+                break;
+            times.push_back(microseconds(std::chrono::steady_clock::now() - start).count());
+        }
+        ::close(fd);
+        return of(times);
+    }
+
+    // a new client connection and a new upstream connection for each request
+    quantiles connection_per_request(harness::origin const& origin, size_t count)
+    {
+        std::string const request = "GET http://" + origin.host() + "/close HTTP/1.1\r\nHost: " + origin.host() + "\r\n\r\n";
+        std::vector<double> times;
+        for (size_t i = 0; i < count; i++) {
+            auto start = std::chrono::steady_clock::now();
+            int fd = harness::connect_to(proxy_port);
+            std::string buffer;
+            harness::send_all(fd, request);
+            bool complete = harness::read_response(fd, buffer);
+            ::close(fd);
+            if (!complete)
+                break;
+            times.push_back(microseconds(std::chrono::steady_clock::now() - start).count());
+        }
+        return of(times);
+    }
+
+    void print(std::string const& profile, std::string const& mode, quantiles q)
+    {
+        std::cout << std::left << std::setw(10) << profile << std::setw(24) << mode << std::right << std::fixed
+                  << std::setprecision(1) << std::setw(10) << q.p50 << std::setw(10) << q.p90 << std::setw(10) << q.p99 << "\n";
+    }
+}
+
+int main(int argc, char* argv[])
+{
+    size_t count = argc > 1 ? strtoul(argv[1], nullptr, 10) : 2000;
+    if (count == 0)
+        count = 1;
+
+    harness::origin origin(answer);
+#if defined(TCP_FASTOPEN)
+    int queue = 16;
+    setsockopt(origin.listener, IPPROTO_TCP, TCP_FASTOPEN, &queue, sizeof(queue));
+#endif
+
+    socket_profiles nodelay; // the default
+    socket_profiles delay;
+    delay.client.no_delay = false;
+    delay.upstream.no_delay = false;
+    socket_profiles fast_open;
+    fast_open.upstream.fast_open = true;
+
+    struct { char const* name; socket_profiles const& sockets; } const profiles[] = {
+        {"nodelay", nodelay}, {"delay", delay}, {"fastopen", fast_open},
+    };
+    // printed at the end, the proxy logs as it goes
+    struct result { char const* profile; char const* mode; quantiles times; };
+    std::vector<result> results;
+    for (auto const& profile : profiles) {
+        harness::proxy_loop proxy(proxy_port, profile.sockets);
+        results.push_back({profile.name, "keep-alive", kept_alive(origin, count)});
+        results.push_back({profile.name, "connection per request", connection_per_request(origin, count)});
+    }
+
+    std::cout << "\n" << count << " round trips, microseconds\n";
+    std::cout << std::left << std::setw(10) << "profile" << std::setw(24) << "mode" << std::right
+              << std::setw(10) << "p50" << std::setw(10) << "p90" << std::setw(10) << "p99" << "\n";
+    for (auto const& r : results)
+        print(r.profile, r.mode, r.times);
+    return 0;
+}
@@ -0,0 +1,148 @@
+//
+//  parser_bench.cpp
+//  proxy
+//
+//  Throughput of the HTTP parser and the heap allocations it makes per
+//  message: heads in one part and trickled in small parts, a response with
+//  a Content-Length body and a chunked one. The parts are sliced out of
+//  blocks made up front, as reads leave them, so only the parser allocates.
+//
+//  usage: parser_bench [seconds per case]
+//
+
+#include <stdlib.h>
+#include <atomic>
+#include <chrono>
+#include <iomanip>
+#include <iostream>
+#include <new>
+#include <string>
+#include <vector>
+
+#include "chunked.hpp"
+#include "new_http_handler.hpp"
+
+namespace
+{
+    std::atomic<uint64_t> allocations{0};
+}
+
+void* operator new(size_t size)
+{
+    allocations.fetch_add(1, std::memory_order_relaxed);
+    if (void* p = malloc(size ? size : 1))
+        return p;
+    throw std::bad_alloc();
+}
+
+void operator delete(void* p) noexcept
+{
+    free(p);
+}
+
+void operator delete(void* p, size_t) noexcept
+{
+    free(p);
+}
+
+namespace
+{
+    std::string const request_head =
+        "GET http://www.example.com/static/js/application.min.js?v=1523 HTTP/1.1\r\n"
+        "Host: www.example.com\r\n"
+        "User-Agent: Mozilla/5.0 (X11; Linux x86_64; rv:109.0) Gecko/20100101 Firefox/115.0\r\n"
+        "Accept: */*\r\n"
+        "Accept-Language: en-US,en;q=0.5\r\n"
+        "Accept-Encoding: gzip, deflate, br\r\n"
+        "Referer: http://www.example.com/articles/2015/10/31/proxy\r\n"
+        "Cookie: session=8f14e45fceea167a5a36dedd4bea2543; theme=dark; consent=1\r\n"
+        "Proxy-Connection: keep-alive\r\n"
+        "If-None-Match: \"5e1f-61a2b3c4\"\r\n"
+        "If-Modified-Since: Sat, 31 Oct 2015 12:00:00 GMT\r\n"
+        "Cache-Control: max-age=0\r\n"
+        "\r\n";
+
+    std::string const response_head_fields =
+        "Date: Sat, 31 Oct 2015 12:00:00 GMT\r\n"
+        "Server: nginx\r\n"
+        "Content-Type: application/javascript\r\n"
+        "ETag: \"5e1f-61a2b3c4\"\r\n"
+        "Cache-Control: public, max-age=31536000\r\n"
+        "Vary: Accept-Encoding\r\n";
+
+    std::string length_response(size_t body)
+    {
+        return "HTTP/1.1 200 OK\r\n" + response_head_fields + "Content-Length: " + std::to_string(body)
+               + "\r\n\r\n" + std::string(body, 'b');
+    }
+
+    std::string chunked_response(size_t body, size_t chunk)
+    {
+        buffer_chain framed;
+        for (size_t sent = 0; sent < body; sent += chunk) {
+            buffer_chain data;
+            data.append(buffer_slice(std::string(std::min(chunk, body - sent), 'b')));
+            append_chunk(framed, data);
+        }
+        append_last_chunk(framed);
+        return "HTTP/1.1 200 OK\r\n" + response_head_fields + "Transfer-Encoding: chunked\r\n\r\n" + framed.to_string();
+    }
+
+    // the message in one block, cut in parts of `part` bytes
+    std::vector<buffer_slice> parts_of(std::string const& text, size_t part)
+    {
+        buffer_slice whole(text);
+        std::vector<buffer_slice> parts;
+        for (size_t from = 0; from < text.size(); from += part)
+            parts.push_back(whole.sub(from, std::min(part, text.size() - from)));
+        return parts;
+    }
+
+    template <typename message>
+    void measure(char const* name, std::string const& text, size_t part, bool keep_body, double seconds)
+    {
+        std::vector<buffer_slice> parts = parts_of(text, part);
+        uint64_t messages = 0;
+        uint64_t allocated = allocations.load();
+        auto start = std::chrono::steady_clock::now();
+        std::chrono::duration<double> spent(0);
+        while (spent.count() < seconds) {
+            for (int i = 0; i < 100; i++) {
+                message parsed(parts[0]);
+                if (!keep_body)
+                    parsed.discard_body();
+                for (size_t j = 1; j < parts.size(); j++)
+                    parsed.add_part(parts[j]);
+                if (parsed.get_state() != FULL_BODY) {
+                    std::cout << name << ": not parsed\n";
+                    exit(1);
+                }
+            }
+            messages += 100;
+            spent = std::chrono::steady_clock::now() - start;
+        }
+        allocated = allocations.load() - allocated;
+        std::cout << std::left << std::setw(40) << name << std::right << std::fixed << std::setprecision(1)
+                  << std::setw(10) << text.size() * messages / spent.count() / 1e6
+                  << std::setw(12) << double(allocated) / messages << "\n";
+    }
+}
+
+int main(int argc, char* argv[])
+{
+    double seconds = argc > 1 ? atof(argv[1]) : 0.5;
+
+    std::cout << std::left << std::setw(40) << "message" << std::right << std::setw(10) << "MB/s"
+              << std::setw(12) << "allocs/msg" << "\n";
+    measure<request>("request head, one part", request_head, request_head.size(), false, seconds);
+    measure<request>("request head, parts of 64 bytes", request_head, 64, false, seconds);
+    measure<request>("request head, parts of 1 byte", request_head, 1, false, seconds);
+    std::string const small = length_response(1024);
+    measure<response>("1 KiB response, one part, kept", small, small.size(), true, seconds);
+    std::string const large = length_response(256 * 1024);
+    measure<response>("256 KiB response, 16 KiB parts, passed", large, 16 * 1024, false, seconds);
+    measure<response>("256 KiB response, 16 KiB parts, kept", large, 16 * 1024, true, seconds);
+    std::string const chunked = chunked_response(256 * 1024, 4096);
+    measure<response>("256 KiB chunked, 16 KiB parts, passed", chunked, 16 * 1024, false, seconds);
+    return 0;
+}
@@ -0,0 +1,113 @@
+//
+//  relay_bench.cpp
+//  proxy
+//
+//  Responses trickled through the proxy by an origin on this host, a
+//  chunk at a time: what relaying a chunk costs the loop in timer
+//  operations, and how many bytes it copies per byte it relays.
+//
+//  usage: relay_bench [clients [chunks [chunk size [pause us]]]]
+//
+
+#include <stdlib.h>
+#include <chrono>
+#include <iostream>
+#include <string>
+#include <thread>
+#include <vector>
+
+#include "harness.hpp"
+
+namespace
+{
+    int const proxy_port = 25410;
+
+    struct options
+    {
+        size_t clients = 4;
+        size_t chunks = 2000;
+        size_t chunk_size = 4096;
+        std::chrono::microseconds pause{200};
+    };
+
+    // one response per connection, each chunk in a segment of its own
+    void trickle(options const& opts, int fd)
+    {
+        std::string buffer;
+        if (harness::read_head(fd, buffer).empty())
+            return;
+        int set = 1;
+        setsockopt(fd, IPPROTO_TCP, TCP_NODELAY, &set, sizeof(set));
+        std::string chunk(opts.chunk_size, 'c');
+        harness::send_all(fd, "HTTP/1.1 200 OK\r\nContent-Length: " + std::to_string(opts.chunks * opts.chunk_size) + "\r\n\r\n");
+        for (size_t i = 0; i < opts.chunks; i++) {
+            if (!harness::send_all(fd, chunk))
+                return;
+            std::this_thread::sleep_for(opts.pause);
+        }
+        // until the proxy lets the connection go
+        char byte;
+        while (::recv(fd, &byte, 1, 0) > 0) {
+        }
+    }
+}
+
+int main(int argc, char* argv[])
+{
+    options opts;
+    if (argc > 1)
+        opts.clients = strtoul(argv[1], nullptr, 10);
+    if (argc > 2)
+        opts.chunks = strtoul(argv[2], nullptr, 10);
+    if (argc > 3)
+        opts.chunk_size = strtoul(argv[3], nullptr, 10);
+    if (argc > 4)
+        opts.pause = std::chrono::microseconds(strtoul(argv[4], nullptr, 10));
+
+    harness::origin origin([&opts](int fd) { trickle(opts, fd); });
+    timer::counters before, after;
+    buffer_stats bytes_before, bytes_after;
+    {
+        harness::proxy_loop proxy(proxy_port);
+        proxy.run([&]() {
+            before = proxy.get_queue().get_timer().get_counters();
+            bytes_before = thread_buffer_stats();
+        });
+
+        auto start = std::chrono::steady_clock::now();
+        std::vector<std::thread> clients;
+        for (size_t i = 0; i < opts.clients; i++) {
+            clients.push_back(std::thread([&origin]() {
+                int fd = harness::connect_to(proxy_port);
+                std::string buffer;
+                harness::send_all(fd, "GET http://" + origin.host() + "/ HTTP/1.1\r\nHost: " + origin.host() + "\r\n\r\n");
+                if (!harness::read_response(fd, buffer))
+                    std::cout << "a response was cut short\n";
+                ::close(fd);
+            }));
+        }
+        for (auto& client : clients)
+            client.join();
+        std::chrono::duration<double> spent = std::chrono::steady_clock::now() - start;
+
+        proxy.run([&]() {
+            after = proxy.get_queue().get_timer().get_counters();
+            bytes_after = thread_buffer_stats();
+        });
+        std::cout << "\n" << opts.clients << " responses of " << opts.chunks << " chunks of " << opts.chunk_size
+                  << " bytes in " << spent.count() << " s\n";
+    }
+
+    double chunks = double(opts.clients * opts.chunks);
+    uint64_t added = after.added - before.added;
+    uint64_t removed = after.removed - before.removed;
+    uint64_t fired = after.fired - before.fired;
+    std::cout << "timer operations per relayed chunk: " << (added + removed) / chunks
+              << " (" << added << " added, " << removed << " removed, " << fired << " fired)\n";
+    // received counts both sides, the requests are a few bytes of it
+    uint64_t received = bytes_after.received - bytes_before.received;
+    uint64_t copied = bytes_after.copied - bytes_before.copied;
+    std::cout << "bytes copied per relayed byte: " << (received ? double(copied) / received : 0.)
+              << " (" << copied << " of " << received << " received)\n";
+    return 0;
+}
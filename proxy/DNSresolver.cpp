@@ -9,8 +9,38 @@
 #include "DNSresolver.hpp"
 
 #include <netdb.h>
+#include <cstdio>
+#include <cstring>
 #include <iostream>
 
+namespace
+{
+    // more than a race would ever get to
+    size_t const max_addresses = 8;
+}
+
+std::vector<sockaddr_storage> interleave(addrinfo const* res)
+{
+    std::vector<sockaddr_storage> first, second;
+    int first_family = res ? res->ai_family : AF_UNSPEC;
+    for (addrinfo const* ai = res; ai != nullptr; ai = ai->ai_next) {
+        if (ai->ai_addrlen > sizeof(sockaddr_storage))
+            continue;
+        sockaddr_storage addr;
+        memset(&addr, 0, sizeof(addr));
+        memcpy(&addr, ai->ai_addr, ai->ai_addrlen);
+        (ai->ai_family == first_family ? first : second).push_back(addr);
+    }
+    std::vector<sockaddr_storage> result;
+    for (size_t i = 0; result.size() < max_addresses && (i < first.size() || i < second.size()); i++) {
+        if (i < first.size())
+            result.push_back(first[i]);
+        if (i < second.size() && result.size() < max_addresses)
+            result.push_back(second[i]);
+    }
+    return result;
+}
+
 DNSresolver::DNSresolver() : DNSresolver(2)
 {}
 
@@ -42,13 +72,17 @@ void DNSresolver::resolver()
         lk.unlock();
         
         std::string port = "80";
-        if (request->hostname.find(":") != static_cast<size_t>(-1)) {
-            size_t port_str = request->hostname.find(":");
+        // an IPv6 literal is in brackets, its colons aren't the port's
+        size_t host_end = request->hostname.rfind("]");
+        size_t port_str = request->hostname.find(":", host_end == std::string::npos ? 0 : host_end);
+        if (port_str != std::string::npos) {
             port = request->hostname.substr(port_str + 1);
             request->hostname = request->hostname.erase(port_str);
         }
+        if (request->hostname.size() > 1 && request->hostname.front() == '[' && request->hostname.back() == ']')
+            request->hostname = request->hostname.substr(1, request->hostname.size() - 2);
     
-        sockaddr resolved;
+        std::vector<sockaddr_storage> resolved;
         
         std::unique_lock<std::mutex> lk2(cache_mutex);
         if (addr_cache.contain(request->hostname + port)) {
@@ -59,66 +93,55 @@ void DNSresolver::resolver()
             struct addrinfo hints, *res;
             
             memset(&hints, 0, sizeof(hints));
-            hints.ai_family = AF_INET;
+            hints.ai_family = AF_UNSPEC;
             hints.ai_socktype = SOCK_STREAM;
             hints.ai_flags = AI_NUMERICSERV;
             
             int error = getaddrinfo(request->hostname.c_str(), port.c_str(), &hints, &res);
             if (error) {
-                // todo: do something on error
-                perror(gai_strerror(error));
-                continue;
+                // the callback still runs, with no addresses
+                std::cout << "resolving " << request->hostname << ": " << gai_strerror(error) << "\n";
+            } else {
+                resolved = interleave(res);
+                freeaddrinfo(res);
+                std::unique_lock<std::mutex> lk2(cache_mutex);
+                addr_cache.put(request->hostname + port, resolved);
             }
-            
-            resolved = *(res->ai_addr);
-            freeaddrinfo(res);
-            std::unique_lock<std::mutex> lk2(cache_mutex);
-            addr_cache.put(request->hostname + port, resolved);
         }
         
         std::unique_lock<std::mutex> lk1(request->state_mutex);
         if (!request->canceled) {
-            // TODO: it is generally a bad practice to call callbacks
-            //       in a separate thread
-            // Rationale:
-            //       because a callback is called from separate thread
-            //       the code of callback must be multithreaded
-            //       and probably it has to lock some mutexes
-            //       'DNSResolver' call the callback holding the mutex 'state_mutex'
-            //       and the external code that uses it has some mutexes. It means
-            //       that the external code must be aware about existence of
-            //       mutex 'state_mutex' to prevent deadlocks.
-            //
-            //       In general if we call external code with some mutexes hold
-            //       these mutexes become a part of our public interface, not
-            //       an implementation detail
-            //
-            //       Avoid interfaces like this.
-            //
-            //       In this example it is possible to avoid this by queuing event
-            //       into kqueue and calling this callback from kqueue.
-            request->callback(resolved);
+            // the callback runs on the loop thread, so it needs no locking.
+            // The request may still be canceled before the task runs, that is
+            // checked there. Posting under state_mutex keeps the queue alive:
+            // it outlives the resolve_state that cancels the request
+            request->queue.post([request, resolved]() {
+                if (!request->canceled)
+                    request->callback(resolved);
+            }, handler_category::dns);
         }
+        lk1.unlock();
         
         condition.notify_one();
     }
 }
 
-DNSresolver::request::request(std::string const& hostname, callback_t callback) : callback( std::move(callback)), hostname(hostname)
+DNSresolver::request::request(std::string const& hostname, io_queue& queue, callback_t callback) : queue(queue), callback( std::move(callback)), hostname(hostname)
 {};
 
-resolve_state DNSresolver::resolve(const std::string &host, callback_t callback)
+resolve_state DNSresolver::resolve(const std::string &host, io_queue& queue, callback_t callback)
 {
-    std::unique_ptr<request> req(new request(host, std::move(callback)));
-    auto temp = req.get();
-    resolve_queue.push_back(temp);
+    std::shared_ptr<request> req(new request(host, queue, std::move(callback)));
+    std::unique_lock<std::mutex> lk(main_mutex); // called from every event loop thread
+    resolve_queue.push_back(req);
+    lk.unlock();
     condition.notify_one();
     return resolve_state(std::move(req));
 }
 
 resolve_state::resolve_state() {}
 
-resolve_state::resolve_state(std::unique_ptr<DNSresolver::request> request)
+resolve_state::resolve_state(std::shared_ptr<DNSresolver::request> request)
 {
     this->request = std::move(request);
 }
@@ -141,6 +164,8 @@ resolve_state& resolve_state::operator=(resolve_state &&other)
 
 void resolve_state::cancel()
 {
+    if (!request)
+        return;
     std::unique_lock<std::mutex> lk(request->state_mutex);
     request->canceled = true;
 }
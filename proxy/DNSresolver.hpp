@@ -15,10 +15,21 @@
 #include <thread>
 #include <condition_variable>
 #include <string>
+#include <functional>
+#include <memory>
+#include <sys/socket.h>
+#include <netdb.h>
 
+#include "kqueue.hpp"
 #include "utils.hpp"
 
-typedef std::function<void(struct sockaddr)> callback_t;
+// every address of the host, IPv6 and IPv4 interleaved; empty when it
+// couldn't be resolved
+typedef std::function<void(std::vector<sockaddr_storage> const&)> callback_t;
+
+// what getaddrinfo() returned, the families alternated starting with its
+// first choice (RFC 8305 4), at most 8 addresses
+std::vector<sockaddr_storage> interleave(addrinfo const* res);
 
 struct resolve_state;
 
@@ -28,24 +39,27 @@ struct DNSresolver
     DNSresolver(size_t thread_count);
     ~DNSresolver();
 
-    resolve_state resolve(std::string const& host, callback_t callback);
+    // callback is posted to queue and runs on its thread, unless the
+    // returned resolve_state is canceled or destroyed before that
+    resolve_state resolve(std::string const& host, io_queue& queue, callback_t callback);
 private:
     void resolver();
     
 private:
     struct request
     {
-        request(std::string const& hostname, callback_t callback);
+        request(std::string const& hostname, io_queue& queue, callback_t callback);
         bool canceled = false;
+        io_queue& queue;
         callback_t callback;
         std::string hostname;
         std::mutex state_mutex;
     };
     
     std::mutex cache_mutex;
-    lru_cache<std::string, sockaddr> addr_cache;
+    lru_cache<std::string, std::vector<sockaddr_storage>> addr_cache;
     std::vector<std::thread> resolvers;
-    std::deque<request*> resolve_queue;
+    std::deque<std::shared_ptr<request>> resolve_queue;
     std::mutex main_mutex;
     bool finished = false;
     std::condition_variable condition;
@@ -56,7 +70,7 @@ private:
 struct resolve_state
 {
     resolve_state();
-    resolve_state(std::unique_ptr<DNSresolver::request> request);
+    resolve_state(std::shared_ptr<DNSresolver::request> request);
     resolve_state(resolve_state const& other) = delete;
     resolve_state(resolve_state&& other);
     resolve_state& operator=(resolve_state&& other);
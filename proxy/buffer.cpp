@@ -0,0 +1,256 @@
+//
+//  buffer.cpp
+//  proxy
+//
+
+#include <sys/socket.h>
+#include <string.h>
+#include <vector>
+
+#include "buffer.hpp"
+
+namespace
+{
+    // a tail smaller than this isn't worth a recv() call
+    size_t const min_tail = 512;
+    // a loop keeps up to this many bytes of free blocks of each size
+    size_t const cached_per_class = 1024 * 1024;
+    // this many reads in a row using under 1/8 of a block make blocks smaller
+    unsigned const small_reads_to_shrink = 16;
+
+    struct block_pool
+    {
+        ~block_pool();
+
+        std::vector<std::unique_ptr<char[]>> free[buffer_storage::size_classes];
+    };
+
+    thread_local buffer_stats stats;
+    thread_local block_pool pool;
+    thread_local bool pool_destroyed = false;
+
+    block_pool::~block_pool()
+    {
+        pool_destroyed = true;
+    }
+}
+
+buffer_stats& thread_buffer_stats() noexcept
+{
+    return stats;
+}
+
+buffer_storage::buffer_storage(size_t capacity)
+    : bytes(new char[capacity])
+    , capacity(capacity)
+{}
+
+buffer_storage::buffer_storage(std::unique_ptr<char[]> bytes, unsigned size_class, void const* owner)
+    : bytes(std::move(bytes))
+    , capacity(class_size(size_class))
+    , size_class(size_class)
+    , owner(owner)
+{}
+
+buffer_storage::~buffer_storage()
+{
+    // blocks released by other threads, e.g. by the cache on a worker, are freed
+    if (size_class == unpooled || pool_destroyed || owner != &pool)
+        return;
+    auto& free = pool.free[size_class];
+    if (free.size() * capacity < cached_per_class)
+        free.push_back(std::move(bytes));
+}
+
+std::shared_ptr<buffer_storage> buffer_storage::from_pool(unsigned size_class)
+{
+    std::unique_ptr<char[]> bytes;
+    auto& free = pool.free[size_class];
+    if (free.empty()) {
+        bytes.reset(new char[class_size(size_class)]);
+        stats.blocks_allocated++;
+    } else {
+        bytes = std::move(free.back());
+        free.pop_back();
+        stats.blocks_reused++;
+    }
+    return std::shared_ptr<buffer_storage>(new buffer_storage(std::move(bytes), size_class, &pool));
+}
+
+size_t buffer_storage::class_size(unsigned size_class) noexcept
+{
+    return size_t(4 * 1024) << (2 * size_class);
+}
+
+buffer_slice::buffer_slice(std::string const& text)
+    : storage(std::make_shared<buffer_storage>(text.size() ? text.size() : 1))
+    , length(text.size())
+{
+    memcpy(storage->bytes.get(), text.data(), text.size());
+    storage->used = text.size();
+    stats.copied += text.size();
+}
+
+buffer_slice::buffer_slice(std::shared_ptr<buffer_storage> storage, size_t offset, size_t length)
+    : storage(std::move(storage))
+    , offset(offset)
+    , length(length)
+{}
+
+buffer_slice buffer_slice::sub(size_t from, size_t count) const
+{
+    if (from > length)
+        from = length;
+    if (count > length - from)
+        count = length - from;
+    return buffer_slice(storage, offset + from, count);
+}
+
+void buffer_slice::remove_prefix(size_t count) noexcept
+{
+    if (count > length)
+        count = length;
+    offset += count;
+    length -= count;
+}
+
+buffer_chain::buffer_chain(buffer_chain&& other) noexcept
+    : slices(std::move(other.slices))
+    , total(other.total)
+{
+    other.slices.clear();
+    other.total = 0;
+}
+
+buffer_chain& buffer_chain::operator=(buffer_chain&& other) noexcept
+{
+    slices = std::move(other.slices);
+    total = other.total;
+    other.slices.clear();
+    other.total = 0;
+    return *this;
+}
+
+void buffer_chain::append(buffer_slice slice)
+{
+    if (slice.empty())
+        return;
+    total += slice.size();
+    if (!slices.empty()) {
+        buffer_slice& last = slices.back();
+        if (last.storage == slice.storage && last.offset + last.length == slice.offset) {
+            last.length += slice.length;
+            return;
+        }
+    }
+    slices.push_back(std::move(slice));
+}
+
+void buffer_chain::append(buffer_chain const& other)
+{
+    for (auto const& slice : other.slices)
+        append(slice);
+}
+
+void buffer_chain::consume(size_t count)
+{
+    while (count != 0 && !slices.empty()) {
+        buffer_slice& first = slices.front();
+        if (count < first.size()) {
+            first.remove_prefix(count);
+            total -= count;
+            return;
+        }
+        count -= first.size();
+        total -= first.size();
+        slices.pop_front();
+    }
+}
+
+buffer_chain buffer_chain::prefix(size_t count) const
+{
+    buffer_chain result;
+    for (auto it = slices.begin(); it != slices.end() && count != 0; ++it) {
+        size_t n = it->size() < count ? it->size() : count;
+        result.append(it->sub(0, n));
+        count -= n;
+    }
+    return result;
+}
+
+size_t buffer_chain::fill_iovec(struct iovec* iov, size_t max_iov) const noexcept
+{
+    size_t count = 0;
+    for (auto it = slices.begin(); it != slices.end() && count < max_iov; ++it, ++count) {
+        iov[count].iov_base = const_cast<char*>(it->data());
+        iov[count].iov_len = it->size();
+    }
+    return count;
+}
+
+std::string buffer_chain::to_string(size_t from) const
+{
+    std::string result;
+    if (from >= total)
+        return result;
+    result.reserve(total - from);
+    for (auto const& slice : slices) {
+        if (from >= slice.size()) {
+            from -= slice.size();
+            continue;
+        }
+        result.append(slice.data() + from, slice.size() - from);
+        from = 0;
+    }
+    stats.copied += result.size();
+    return result;
+}
+
+buffer_slice buffer_chain::flatten() const
+{
+    auto storage = std::make_shared<buffer_storage>(total ? total : 1);
+    for (auto const& slice : slices) {
+        memcpy(storage->bytes.get() + storage->used, slice.data(), slice.size());
+        storage->used += slice.size();
+    }
+    stats.copied += total;
+    return buffer_slice(std::move(storage), 0, total);
+}
+
+ssize_t read_buffer::receive(int fd, size_t expected, buffer_slice& part)
+{
+    unsigned const largest = buffer_storage::size_classes - 1;
+    while (expected > buffer_storage::class_size(size_class) && size_class < largest)
+        size_class++;
+    size_t wanted = expected < min_tail ? min_tail : expected;
+    if (wanted > buffer_storage::class_size(size_class))
+        wanted = buffer_storage::class_size(size_class);
+    if (!storage || storage->capacity - storage->used < wanted)
+        storage = buffer_storage::from_pool(size_class);
+
+    size_t room = storage->capacity - storage->used;
+    ssize_t size = recv(fd, storage->bytes.get() + storage->used, room, 0);
+    if (size <= 0) {
+        part = buffer_slice();
+        return size;
+    }
+    part = buffer_slice(storage, storage->used, size);
+    storage->used += size;
+    stats.received += size;
+
+    if (static_cast<size_t>(size) == room && room >= buffer_storage::class_size(size_class) / 2) {
+        // the socket probably has more
+        if (size_class < largest)
+            size_class++;
+        small_reads = 0;
+    } else if (static_cast<size_t>(size) < buffer_storage::class_size(size_class) / 8) {
+        if (++small_reads == small_reads_to_shrink) {
+            if (size_class > 0)
+                size_class--;
+            small_reads = 0;
+        }
+    } else {
+        small_reads = 0;
+    }
+    return size;
+}
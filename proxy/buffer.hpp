@@ -0,0 +1,135 @@
+//
+//  buffer.hpp
+//  proxy
+//
+//  Reference-counted byte buffers. Bytes are read once into a storage block
+//  and from then on passed around as slices of it: queued for writing, kept
+//  by a response and by the cache, all without copying. A storage lives
+//  while any slice of it does.
+//
+
+#ifndef buffer_hpp
+#define buffer_hpp
+
+#include <sys/types.h>
+#include <sys/uio.h>
+#include <stdint.h>
+#include <deque>
+#include <memory>
+#include <string>
+
+// storage is pooled: blocks come in a few fixed sizes and go back to a
+// free list of the thread that allocated them, i.e. of its event loop
+struct buffer_storage
+{
+    static const unsigned size_classes = 4; // 4, 16, 64 and 256 KiB
+    static const unsigned unpooled = size_classes;
+
+    explicit buffer_storage(size_t capacity); // an exact size, not pooled
+    static std::shared_ptr<buffer_storage> from_pool(unsigned size_class);
+    static size_t class_size(unsigned size_class) noexcept;
+    ~buffer_storage();
+    buffer_storage(buffer_storage const&) = delete;
+    buffer_storage& operator=(buffer_storage const&) = delete;
+
+    std::unique_ptr<char[]> bytes;
+    size_t capacity;
+    size_t used = 0; // bytes handed out as slices, the rest may still be filled
+
+private:
+    buffer_storage(std::unique_ptr<char[]> bytes, unsigned size_class, void const* owner);
+
+    unsigned size_class = unpooled;
+    void const* owner = nullptr;
+};
+
+struct buffer_slice
+{
+    buffer_slice() = default;
+    explicit buffer_slice(std::string const& text); // copies text into its own storage
+    buffer_slice(std::shared_ptr<buffer_storage> storage, size_t offset, size_t length);
+
+    char const* data() const noexcept { return storage->bytes.get() + offset; }
+    size_t size() const noexcept { return length; }
+    bool empty() const noexcept { return length == 0; }
+
+    buffer_slice sub(size_t from, size_t count) const;
+    void remove_prefix(size_t count) noexcept;
+
+private:
+    std::shared_ptr<buffer_storage> storage;
+    size_t offset = 0;
+    size_t length = 0;
+
+    friend struct buffer_chain;
+};
+
+// a sequence of slices, e.g. a message or a write queue
+struct buffer_chain
+{
+    buffer_chain() = default;
+    buffer_chain(buffer_chain const&) = default;
+    buffer_chain& operator=(buffer_chain const&) = default;
+    buffer_chain(buffer_chain&& other) noexcept;            // leaves other empty
+    buffer_chain& operator=(buffer_chain&& other) noexcept;
+
+    // a slice right behind the last one in the same storage extends it
+    void append(buffer_slice slice);
+    void append(buffer_chain const& other);
+    void consume(size_t count);
+    // the first count bytes, sharing the storage
+    buffer_chain prefix(size_t count) const;
+
+    size_t size() const noexcept { return total; }
+    bool empty() const noexcept { return total == 0; }
+    size_t slice_count() const noexcept { return slices.size(); }
+
+    // describes up to max_iov leading slices, returns how many
+    size_t fill_iovec(struct iovec* iov, size_t max_iov) const noexcept;
+    std::string to_string(size_t from = 0) const; // copies
+    // the bytes in a storage of their own, exactly their size: to keep them
+    // without the rest of the blocks they were received in. Copies
+    buffer_slice flatten() const;
+
+private:
+    std::deque<buffer_slice> slices;
+    size_t total = 0;
+};
+
+// the free tail of the last pooled block of a reader, receives go there.
+// The block size follows the reader: it grows while reads fill whole
+// blocks and shrinks after a run of small reads
+struct read_buffer
+{
+    // receives into a tail with room for `expected` bytes, up to the largest
+    // block; same result as recv(), the data goes to `part`
+    ssize_t receive(int fd, size_t expected, buffer_slice& part);
+
+private:
+    std::shared_ptr<buffer_storage> storage;
+    unsigned size_class = 1;
+    unsigned small_reads = 0;
+};
+
+// bytes moved and copied by the buffers of the calling thread, that is
+// of one event loop; copied / received is the memcpy cost per relayed byte
+struct buffer_stats
+{
+    uint64_t received = 0;
+    uint64_t sent = 0;
+    uint64_t copied = 0;
+    uint64_t blocks_allocated = 0;
+    uint64_t blocks_reused = 0;
+    uint64_t queued = 0;      // bytes waiting in write queues now
+    uint64_t queued_peak = 0;
+    uint64_t pauses = 0;      // reads stopped by a full write queue
+    uint64_t zero_copy_sent = 0;     // bytes sent with MSG_ZEROCOPY
+    uint64_t zero_copy_copied = 0;   // MSG_ZEROCOPY sends the kernel copied anyway
+    uint64_t pinned = 0;             // bytes the kernel may still read, see tcp_client
+    uint64_t retained = 0;      // bytes of responses kept while they arrive, for the cache
+    uint64_t retained_peak = 0;
+};
+
+buffer_stats& thread_buffer_stats() noexcept;
+
+#endif /* buffer_hpp */
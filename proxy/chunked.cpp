@@ -0,0 +1,154 @@
+//
+//  chunked.cpp
+//  proxy
+//
+
+#include <algorithm>
+#include <stdio.h>
+
+#include "chunked.hpp"
+
+namespace
+{
+    // a size up to 2^64 - 1, more digits don't fit
+    unsigned const max_digits = 16;
+    // extensions and trailers of one message, as much as a head may have
+    size_t const max_overhead = 64 * 1024;
+
+    int hex_value(char c) noexcept
+    {
+        if (c >= '0' && c <= '9')
+            return c - '0';
+        if (c >= 'a' && c <= 'f')
+            return c - 'a' + 10;
+        if (c >= 'A' && c <= 'F')
+            return c - 'A' + 10;
+        return -1;
+    }
+}
+
+chunked_decoder::status chunked_decoder::feed(buffer_slice const& part, size_t& used, data_callback const& on_data)
+{
+    char const* data = part.data();
+    size_t size = part.size();
+    size_t i = 0;
+    while (i < size && current != state::done && current != state::bad) {
+        if (current == state::data) {
+            // the data isn't looked at, only counted
+            size_t count = static_cast<size_t>(std::min<uint64_t>(remaining, size - i));
+            if (on_data)
+                on_data(part.sub(i, count));
+            remaining -= count;
+            i += count;
+            if (remaining == 0)
+                current = state::data_cr;
+            continue;
+        }
+        step(data[i++]);
+    }
+    used = i;
+    return get_status();
+}
+
+chunked_decoder::status chunked_decoder::get_status() const noexcept
+{
+    switch (current) {
+        case state::done:
+            return status::done;
+        case state::bad:
+            return status::bad;
+        default:
+            return status::more;
+    }
+}
+
+void chunked_decoder::step(char c) noexcept
+{
+    switch (current) {
+        case state::size: {
+            int value = hex_value(c);
+            if (value >= 0 && digits < max_digits) {
+                remaining = remaining * 16 + value;
+                digits++;
+            } else if (value >= 0 || digits == 0) {
+                current = state::bad;
+            } else if (c == ' ' || c == '\t') {
+                current = state::size_space;
+            } else if (c == ';') {
+                current = state::extension;
+            } else {
+                current = c == '\r' ? state::size_lf : state::bad;
+            }
+            break;
+        }
+        case state::size_space:
+            // whitespace may only lead to an extension
+            if (c == ';')
+                current = state::extension;
+            else if (c == '\r')
+                current = state::size_lf;
+            else if ((c != ' ' && c != '\t') || ++overhead > max_overhead)
+                current = state::bad;
+            break;
+        case state::extension:
+            // extensions are skipped, nothing here understands them
+            if (c == '\r')
+                current = state::size_lf;
+            else if (c == '\n' || ++overhead > max_overhead)
+                current = state::bad;
+            break;
+        case state::size_lf:
+            if (c != '\n')
+                current = state::bad;
+            else
+                current = remaining == 0 ? state::trailer_start : state::data;
+            digits = 0;
+            break;
+        case state::data_cr:
+            current = c == '\r' ? state::data_lf : state::bad;
+            break;
+        case state::data_lf:
+            current = c == '\n' ? state::size : state::bad;
+            break;
+        case state::trailer_start:
+            if (c == '\r')
+                current = state::last_lf;
+            else if (c == '\n' || ++overhead > max_overhead)
+                current = state::bad;
+            else
+                current = state::trailer;
+            break;
+        case state::trailer:
+            if (c == '\r')
+                current = state::trailer_lf;
+            else if (c == '\n' || ++overhead > max_overhead)
+                current = state::bad;
+            break;
+        case state::trailer_lf:
+            current = c == '\n' ? state::trailer_start : state::bad;
+            break;
+        case state::last_lf:
+            current = c == '\n' ? state::done : state::bad;
+            break;
+        case state::data:
+        case state::done:
+        case state::bad:
+            break;
+    }
+}
+
+void append_chunk(buffer_chain& out, buffer_chain const& data)
+{
+    if (data.empty())
+        return;
+    char size_line[24];
+    int length = snprintf(size_line, sizeof size_line, "%llx\r\n", static_cast<unsigned long long>(data.size()));
+    out.append(buffer_slice(std::string(size_line, length)));
+    out.append(data);
+    out.append(buffer_slice(std::string("\r\n")));
+}
+
+void append_last_chunk(buffer_chain& out)
+{
+    out.append(buffer_slice(std::string("0\r\n\r\n")));
+}
@@ -0,0 +1,48 @@
+//
+//  chunked.hpp
+//  proxy
+//
+//  Transfer-Encoding: chunked (RFC 9112 7.1). The decoder follows the chunk
+//  sizes as the bytes arrive, so the end of a message is known exactly:
+//  wherever the reads split it, with extensions or trailers, and without
+//  keeping the body around.
+//
+
+#ifndef chunked_hpp
+#define chunked_hpp
+
+#include <functional>
+#include <stdint.h>
+
+#include "buffer.hpp"
+
+struct chunked_decoder
+{
+    enum class status { more, done, bad };
+    // the data of the chunks, a slice of the part that was fed
+    typedef std::function<void(buffer_slice)> data_callback;
+
+    // takes the bytes of part up to the end of the body, `used` tells how
+    // many: the rest is whatever follows the message
+    status feed(buffer_slice const& part, size_t& used, data_callback const& on_data = nullptr);
+    status get_status() const noexcept;
+
+private:
+    enum class state { size, size_space, extension, size_lf, data, data_cr, data_lf,
+                       trailer_start, trailer, trailer_lf, last_lf, done, bad };
+
+    void step(char c) noexcept;
+
+    state current = state::size;
+    uint64_t remaining = 0; // of the chunk size line being read, then of its data
+    unsigned digits = 0;
+    size_t overhead = 0;    // bytes of extensions and trailers, they're limited
+};
+
+// the other way: frames data as one chunk, without copying it; nothing
+// for no data, that would be the last chunk
+void append_chunk(buffer_chain& out, buffer_chain const& data);
+// the last chunk, without trailers
+void append_last_chunk(buffer_chain& out);
+
+#endif /* chunked_hpp */
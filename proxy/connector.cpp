@@ -0,0 +1,217 @@
+//
+//  connector.cpp
+//  proxy
+//
+
+#include <algorithm>
+#include <errno.h>
+#include <iostream>
+#include <stdexcept>
+#include <string.h>
+
+#include "connector.hpp"
+
+namespace
+{
+    // RFC 8305: 250 ms without history, never below 100 ms or above 2 s
+    constexpr const timer::clock_t::duration default_attempt_delay = std::chrono::milliseconds(250);
+    constexpr const timer::clock_t::duration min_attempt_delay = std::chrono::milliseconds(100);
+    constexpr const timer::clock_t::duration max_attempt_delay = std::chrono::seconds(2);
+    // the whole race, for an origin whose every address drops the SYN
+    constexpr const timer::clock_t::duration connect_timeout = std::chrono::seconds(10);
+    // a failed address goes last for this long, then it's tried as a new one
+    constexpr const timer::clock_t::duration failure_memory = std::chrono::minutes(5);
+    size_t const max_entries = 4096;
+}
+
+connect_history::connect_history()
+    : entries(max_entries)
+{}
+
+void connect_history::order(std::vector<sockaddr_storage>& addresses, timer::clock_t::time_point now)
+{
+    struct ranked
+    {
+        int rank;
+        timer::clock_t::duration rtt;
+        sockaddr_storage addr;
+    };
+    std::vector<ranked> sorted;
+    sorted.reserve(addresses.size());
+    for (auto const& addr : addresses) {
+        std::string key = format_address(addr);
+        ranked r{1, timer::clock_t::duration::zero(), addr};
+        if (entries.contain(key)) {
+            entry const& e = entries.get(key);
+            if (e.failing && now - e.failed_at < failure_memory) {
+                r.rank = 2;
+            } else if (e.rtt != timer::clock_t::duration::zero()) {
+                r.rank = 0;
+                r.rtt = e.rtt;
+            }
+        }
+        sorted.push_back(r);
+    }
+    std::stable_sort(sorted.begin(), sorted.end(), [](ranked const& a, ranked const& b) {
+        return a.rank != b.rank ? a.rank < b.rank : a.rtt < b.rtt;
+    });
+    for (size_t i = 0; i < sorted.size(); i++)
+        addresses[i] = sorted[i].addr;
+}
+
+connect_history::clock_t::duration connect_history::attempt_delay(sockaddr_storage const& addr)
+{
+    std::string key = format_address(addr);
+    if (!entries.contain(key) || entries.get(key).rtt == timer::clock_t::duration::zero())
+        return default_attempt_delay;
+    // a handshake taking twice as long as it used to is probably lost
+    timer::clock_t::duration delay = 2 * entries.get(key).rtt;
+    return std::max(min_attempt_delay, std::min(delay, max_attempt_delay));
+}
+
+void connect_history::connected(sockaddr_storage const& addr, timer::clock_t::duration rtt)
+{
+    std::string key = format_address(addr);
+    entry e;
+    if (entries.contain(key))
+        e = entries.get(key);
+    // smoothed like TCP's srtt
+    e.rtt = e.rtt == timer::clock_t::duration::zero() ? rtt : (7 * e.rtt + rtt) / 8;
+    e.failing = false;
+    entries.put(key, e);
+}
+
+void connect_history::failed(sockaddr_storage const& addr, timer::clock_t::time_point now)
+{
+    std::string key = format_address(addr);
+    entry e;
+    if (entries.contain(key))
+        e = entries.get(key);
+    e.failing = true;
+    e.failed_at = now;
+    entries.put(key, e);
+}
+
+connect_race::attempt::attempt(client_socket socket, sockaddr_storage const& addr)
+    : socket(std::move(socket))
+    , addr(addr)
+    , started(timer::clock_t::now())
+{}
+
+connect_race::connect_race(io_queue& queue, connect_history& history)
+    : queue(queue)
+    , history(history)
+    , stagger([this]() { on_stagger(); })
+    , deadline([this]() {
+        std::cout << "connect timed out\n";
+        for (auto const& a : attempts)
+            this->history.failed(a.addr, this->queue.now());
+        finish(client_socket(), sockaddr_storage());
+    })
+{}
+
+connect_race::~connect_race()
+{
+    cancel();
+}
+
+void connect_race::start(std::vector<sockaddr_storage> addresses, socket_profile const& profile, callback_t callback)
+{
+    cancel();
+    this->addresses = std::move(addresses);
+    this->profile = profile;
+    // with Fast Open every attempt is writable at once, the first one
+    // started would always win: only an origin with one address gets it
+    if (this->addresses.size() > 1)
+        this->profile.fast_open = false;
+    this->callback = std::move(callback);
+    tried = 0;
+    deadline.restart(queue.get_timer(), connect_timeout);
+    if (!next()) {
+        // reported from the loop, the caller isn't ready for the callback yet
+        stagger.restart(queue.get_timer(), timer::clock_t::duration::zero());
+    }
+}
+
+void connect_race::cancel()
+{
+    stagger.stop();
+    deadline.stop();
+    for (auto const& a : attempts)
+        queue.delete_event_handler(a.socket.getfd(), EVFILT_WRITE);
+    attempts.clear();
+    addresses.clear();
+    callback = nullptr;
+}
+
+bool connect_race::next()
+{
+    while (tried < addresses.size()) {
+        sockaddr_storage const& addr = addresses[tried++];
+        try {
+            attempts.emplace_back(client_socket(addr, profile), addr);
+        } catch (std::runtime_error const& error) {
+            // e.g. no route for the address family: the next one goes right away
+            std::cout << "connecting to " << format_address(addr) << ": " << error.what() << "\n";
+            history.failed(addr, queue.now());
+            continue;
+        }
+        int fd = attempts.back().socket.getfd();
+        // writable once the handshake is done, or with an error when it failed
+        queue.add_event_handler(fd, EVFILT_WRITE, [this, fd](struct kevent) { on_writable(fd); });
+        queue.set_descriptor_kind(fd, descriptor_kind::server);
+        if (tried < addresses.size()) {
+            stagger.restart(queue.get_timer(), history.attempt_delay(addr));
+        } else {
+            stagger.stop();
+        }
+        return true;
+    }
+    return false;
+}
+
+void connect_race::on_writable(int fd)
+{
+    auto it = std::find_if(attempts.begin(), attempts.end(), [fd](attempt const& a) { return a.socket.getfd() == fd; });
+    if (it == attempts.end())
+        return;
+    int error = 0;
+    socklen_t length = sizeof(error);
+    if (getsockopt(fd, SOL_SOCKET, SO_ERROR, &error, &length) == -1)
+        error = errno;
+    queue.delete_event_handler(fd, EVFILT_WRITE);
+
+    if (error == 0) {
+        // with Fast Open connect() returns at once, that is no handshake time
+        if (!profile.fast_open)
+            history.connected(it->addr, timer::clock_t::now() - it->started);
+        client_socket socket = std::move(it->socket);
+        sockaddr_storage addr = it->addr;
+        attempts.erase(it);
+        finish(std::move(socket), addr);
+        return;
+    }
+
+    std::cout << "connecting to " << format_address(it->addr) << ": " << strerror(error) << "\n";
+    history.failed(it->addr, queue.now());
+    attempts.erase(it);
+    // a refused address is done, the next one needn't wait for the delay
+    if (!next() && attempts.empty())
+        finish(client_socket(), sockaddr_storage());
+}
+
+void connect_race::on_stagger()
+{
+    if (!next() && attempts.empty())
+        finish(client_socket(), sockaddr_storage());
+}
+
+void connect_race::finish(client_socket socket, sockaddr_storage const& addr)
+{
+    callback_t done = std::move(callback);
+    // the slower handshakes are closed
+    cancel();
+    // may destroy the race
+    if (done)
+        done(std::move(socket), addr);
+}
@@ -0,0 +1,95 @@
+//
+//  connector.hpp
+//  proxy
+//
+//  Connecting to an origin with several addresses. Attempts are started one
+//  after another with a short delay and the first handshake to complete
+//  wins, the others are closed (Happy Eyeballs, RFC 8305): an address that
+//  drops the SYN costs the delay instead of a hanging client. Handshake
+//  times are remembered per address, the fastest known one is tried first.
+//
+
+#ifndef connector_hpp
+#define connector_hpp
+
+#include <functional>
+#include <list>
+#include <string>
+#include <vector>
+#include <sys/socket.h>
+
+#include "kqueue.hpp"
+#include "socket.hpp"
+#include "timer.h"
+#include "utils.hpp"
+
+// per event loop, like the upstream pool
+struct connect_history
+{
+    typedef ::timer::clock_t clock_t;
+
+    connect_history();
+
+    // fastest known handshake first, then the addresses not tried yet in
+    // the resolver's order, then the ones that failed lately
+    void order(std::vector<sockaddr_storage>& addresses, clock_t::time_point now);
+    // how long an attempt to addr runs alone before the next one starts
+    clock_t::duration attempt_delay(sockaddr_storage const& addr);
+    void connected(sockaddr_storage const& addr, clock_t::duration rtt);
+    void failed(sockaddr_storage const& addr, clock_t::time_point now);
+
+private:
+    struct entry
+    {
+        clock_t::duration rtt = clock_t::duration::zero(); // smoothed, zero when not measured
+        clock_t::time_point failed_at;
+        bool failing = false; // no success since the last failure
+    };
+
+    lru_cache<std::string, entry> entries;
+};
+
+struct connect_race
+{
+    // the socket has no descriptor when no address could be reached
+    typedef std::function<void(client_socket socket, sockaddr_storage const& addr)> callback_t;
+
+    connect_race(io_queue& queue, connect_history& history);
+    connect_race(connect_race const&) = delete;
+    connect_race& operator=(connect_race const&) = delete;
+    ~connect_race();
+
+    // tries the addresses in their order, callback runs once from the
+    // loop, never from start(). A race still running is canceled. Fast
+    // Open of the profile is only used when there is a single address
+    void start(std::vector<sockaddr_storage> addresses, socket_profile const& profile, callback_t callback);
+    void cancel();
+
+private:
+    struct attempt
+    {
+        attempt(client_socket socket, sockaddr_storage const& addr);
+
+        client_socket socket;
+        sockaddr_storage addr;
+        ::timer::clock_t::time_point started;
+    };
+
+    // starts attempts until one is in progress, false when none is left
+    bool next();
+    void on_writable(int fd);
+    void on_stagger();
+    void finish(client_socket socket, sockaddr_storage const& addr);
+
+    io_queue& queue;
+    connect_history& history;
+    socket_profile profile;
+    std::vector<sockaddr_storage> addresses;
+    size_t tried = 0;
+    std::list<attempt> attempts;
+    callback_t callback;
+    timer_element stagger;  // starts the next attempt, or reports that all failed
+    timer_element deadline; // gives up on the attempts still in progress
+};
+
+#endif /* connector_hpp */
@@ -0,0 +1,711 @@
+//
+//  epoll.cpp
+//  proxy
+//
+//  io_queue on top of epoll. EVFILT_READ/EVFILT_WRITE of one descriptor
+//  share a single epoll registration, EVFILT_USER is backed by an eventfd.
+//
+//  Interest changes are diffed per descriptor before the wait, so a handler
+//  that is replaced or removed and added back costs no syscall at all.
+//
+//  With io_backend::io_uring the ring does the I/O of the connections
+//  itself (see set_completion()): a multishot accept on the listener, a
+//  multishot receive into provided buffers on every connection and linked
+//  sends of its write queue, so a relayed chunk costs no syscall of its own.
+//  Its completions come from the same io_uring_enter as the wait. Other
+//  descriptors are multishot poll requests on the ring, their interest
+//  changes go to the kernel with the wait too.
+//
+
+#include <sys/epoll.h>
+#include <sys/eventfd.h>
+#include <sys/socket.h>
+#include <errno.h>
+#include <limits.h>
+#include <unistd.h>
+#include <algorithm>
+#include <iostream>
+#include <stdexcept>
+
+#include "kqueue.hpp"
+#include "throw_error.h"
+
+#if defined(PROXY_IO_URING)
+#include "uring.hpp"
+#endif
+
+namespace
+{
+    uint64_t const user_tag = 1ull << 63;
+    uint64_t const ident_mask = 0xffffffffull;
+    uint64_t const wakeup_tag = ~0ull;
+
+#if defined(PROXY_IO_URING)
+    // a request id is the ident with a sequence number from 1 to max_seq
+    // above it, that tells its completions from the ones of an earlier
+    // request, and what kind of request it is above that
+    uint32_t const max_seq = 0x1fffffff;
+    uint64_t const poll_request = 0;
+    uint64_t const receive_request = 1ull << 61; // or accept
+    uint64_t const send_request = 2ull << 61;
+    uint64_t const request_mask = 3ull << 61;
+
+    constexpr uint32_t next_seq(uint32_t seq)
+    {
+        return seq % max_seq + 1;
+    }
+
+    constexpr uint64_t make_id(uint64_t request, uintptr_t ident, uint32_t seq)
+    {
+        return request | ident | (static_cast<uint64_t>(seq) << 32);
+    }
+
+    static_assert(next_seq(max_seq) == 1, "the request sequence doesn't wrap to 1");
+    static_assert(((static_cast<uint64_t>(max_seq) << 32) & request_mask) == 0, "the sequence reaches the request kind");
+    static_assert((make_id(send_request, ident_mask, max_seq) & user_tag) == 0, "a request id reaches user_tag");
+
+    // the receive buffers of a loop, 4 MiB
+    unsigned const provided_count = 256;
+    unsigned const provided_class = 1;
+
+#if defined(IOV_MAX)
+    size_t const max_link_iov = IOV_MAX;
+#else
+    size_t const max_link_iov = 1024;
+#endif
+
+    size_t link_size(struct msghdr const& link)
+    {
+        size_t size = 0;
+        for (size_t i = 0; i < link.msg_iovlen; i++)
+            size += link.msg_iov[i].iov_len;
+        return size;
+    }
+#endif
+
+    struct kevent make_event(uintptr_t ident, int16_t filter, uint16_t flags, intptr_t data)
+    {
+        struct kevent event;
+        event.ident = ident;
+        event.filter = filter;
+        event.flags = flags;
+        event.fflags = 0;
+        event.data = data;
+        event.udata = nullptr;
+        return event;
+    }
+}
+
+io_queue::io_queue() : io_queue(io_backend::native)
+{}
+
+io_queue::io_queue(io_backend backend)
+{
+    if (backend == io_backend::io_uring) {
+#if defined(PROXY_IO_URING)
+        try {
+            ring.reset(new uring(1024));
+            // first, its probe wants the ring to itself
+            if (ring->setup_buffers(provided_count)) {
+                provided.resize(provided_count);
+                for (unsigned id = 0; id < provided_count; id++) {
+                    provided[id] = buffer_storage::from_pool(provided_class);
+                    provide_buffer(static_cast<uint16_t>(id));
+                }
+            } else {
+                std::cout << "no multishot receive into provided buffers, io_uring only polls\n";
+            }
+        } catch (std::runtime_error const& error) {
+            std::cout << error.what() << ", falling back to epoll\n";
+            ring.reset();
+        }
+#else
+        std::cout << "built without io_uring support, falling back to epoll\n";
+#endif
+    }
+
+    wakeup_fd = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC);
+    if (wakeup_fd.getfd() == -1) {
+        throw_error(errno, "eventfd()");
+    }
+#if defined(PROXY_IO_URING)
+    if (ring) {
+        ring->poll_add(wakeup_tag, wakeup_fd.getfd(), EPOLLIN, true);
+        return;
+    }
+#endif
+
+    fd = epoll_create1(EPOLL_CLOEXEC);
+    if (fd.getfd() == -1) {
+        throw_error(errno, "epoll_create1()");
+    }
+    struct epoll_event event;
+    event.events = EPOLLIN | EPOLLET;
+    event.data.u64 = wakeup_tag;
+    if (epoll_ctl(fd.getfd(), EPOLL_CTL_ADD, wakeup_fd.getfd(), &event) == -1) {
+        throw_error(errno, "epoll_ctl(EPOLL_CTL_ADD)");
+    }
+}
+
+io_queue::~io_queue()
+{
+    wait_for_offloaded();
+}
+
+void io_queue::add_user_event(uintptr_t ident, uint16_t /* flags, an eventfd is always edge-triggered */) {
+    if (user_events.find(ident) != user_events.end())
+        return;
+
+    file_descriptor event_fd(eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC));
+    if (event_fd.getfd() == -1) {
+        throw_error(errno, "eventfd()");
+    }
+    // the number was free, so a socket that had it is closed and already out
+    // of the epoll set: a pending EPOLL_CTL_DEL would hit the eventfd instead
+    if (static_cast<size_t>(event_fd.getfd()) < handlers.size())
+        handlers[event_fd.getfd()].interest.applied = 0;
+#if defined(PROXY_IO_URING)
+    if (ring) {
+        uring_arm_user_event(ident, event_fd.getfd());
+    } else
+#endif
+    {
+        struct epoll_event event;
+        event.events = EPOLLIN | EPOLLET;
+        event.data.u64 = user_tag | ident;
+        if (epoll_ctl(fd.getfd(), EPOLL_CTL_ADD, event_fd.getfd(), &event) == -1) {
+            throw_error(errno, "epoll_ctl(EPOLL_CTL_ADD)");
+        }
+    }
+    user_events.emplace(ident, std::move(event_fd));
+}
+
+void io_queue::delete_user_event(uintptr_t ident) {
+    auto it = user_events.find(ident);
+    if (it == user_events.end())
+        return;
+#if defined(PROXY_IO_URING)
+    if (ring) {
+        ring->poll_remove(user_tag | ident);
+    } else
+#endif
+    epoll_ctl(fd.getfd(), EPOLL_CTL_DEL, it->second.getfd(), nullptr);
+    user_events.erase(it);
+}
+
+void io_queue::trigger_user_event_handler(uintptr_t ident) {
+    auto it = user_events.find(ident);
+    if (it == user_events.end()) {
+        throw_error(ENOENT, "eventfd_write()");
+    }
+    if (eventfd_write(it->second.getfd(), 1) == -1) {
+        throw_error(errno, "eventfd_write()");
+    }
+}
+
+void io_queue::wake_up() {
+    if (eventfd_write(wakeup_fd.getfd(), 1) == -1) {
+        throw_error(errno, "eventfd_write()");
+    }
+}
+
+void io_queue::apply_changes()
+{
+    for (uintptr_t ident : changed) {
+        handler_slot& s = handlers[ident];
+        interest& i = s.interest;
+        i.queued = false;
+#if defined(PROXY_IO_URING)
+        if (s.completion)
+            apply_completion(ident, s);
+#endif
+
+        // after the slot was emptied the descriptor may have been closed and
+        // reused, which silently drops it from the epoll set
+        bool reused = i.applied_generation != s.generation;
+        if (i.wanted == i.applied && !reused)
+            continue;
+
+        uint32_t events = ((i.wanted & interest::read) ? EPOLLIN | EPOLLRDHUP : 0)
+                        | ((i.wanted & interest::write) ? uint32_t(EPOLLOUT) : 0);
+
+#if defined(PROXY_IO_URING)
+        if (ring) {
+            // the ring does the I/O of the descriptor instead
+            if (s.completion)
+                events = 0;
+            if (i.poll_id != 0)
+                ring->poll_remove(i.poll_id);
+            i.poll_id = 0;
+            if (events != 0) {
+                request_seq = next_seq(request_seq);
+                i.poll_id = make_id(poll_request, ident, request_seq);
+                ring->poll_add(i.poll_id, static_cast<int>(ident), events, i.wanted & interest::edge);
+            }
+            i.applied = i.wanted;
+            i.applied_generation = s.generation;
+            continue;
+        }
+#endif
+
+        if (events == 0) {
+            if (i.applied != 0 && epoll_ctl(fd.getfd(), EPOLL_CTL_DEL, static_cast<int>(ident), nullptr) == -1) {
+                if (errno != ENOENT && errno != EBADF)
+                    throw_error(errno, "epoll_ctl(EPOLL_CTL_DEL)");
+            }
+        } else {
+            struct epoll_event event;
+            event.events = events | ((i.wanted & interest::edge) ? uint32_t(EPOLLET) : 0);
+            event.data.u64 = ident;
+
+            int op = i.applied != 0 ? EPOLL_CTL_MOD : EPOLL_CTL_ADD;
+            if (epoll_ctl(fd.getfd(), op, static_cast<int>(ident), &event) == -1) {
+                // descriptor was closed and reused behind our back
+                op = (errno == ENOENT) ? EPOLL_CTL_ADD : (errno == EEXIST) ? EPOLL_CTL_MOD : -1;
+                if (op == -1 || epoll_ctl(fd.getfd(), op, static_cast<int>(ident), &event) == -1)
+                    throw_error(errno, "epoll_ctl()");
+            }
+        }
+        i.applied = i.wanted;
+        i.applied_generation = s.generation;
+    }
+    changed.clear();
+}
+
+size_t io_queue::make_events(uint64_t data, uint32_t events, struct kevent* evList)
+{
+    size_t count = 0;
+    if (data == wakeup_tag) {
+        // posted tasks run after dispatch
+        eventfd_t value;
+        eventfd_read(wakeup_fd.getfd(), &value);
+        return count;
+    }
+    if (data & user_tag) {
+        uintptr_t ident = data & ~user_tag;
+        auto it = user_events.find(ident);
+        if (it != user_events.end()) {
+            eventfd_t value;
+            eventfd_read(it->second.getfd(), &value);
+            evList[count++] = make_event(ident, EVFILT_USER, 0, 0);
+        }
+        return count;
+    }
+
+    uintptr_t ident = data & ident_mask;
+    // EPOLLERR alone is the error queue, e.g. MSG_ZEROCOPY completions: a
+    // failed connection always comes with EPOLLHUP
+    uint16_t flags = (events & (EPOLLRDHUP | EPOLLHUP)) ? EV_EOF : 0;
+    if (events & (EPOLLIN | EPOLLRDHUP | EPOLLHUP | EPOLLERR)) {
+        // no FIONREAD, that would be a syscall per event: readers size
+        // their receives from the buffer pool
+        evList[count++] = make_event(ident, EVFILT_READ, flags, 0);
+    }
+    if (events & (EPOLLOUT | EPOLLHUP | EPOLLERR)) {
+        evList[count++] = make_event(ident, EVFILT_WRITE, flags, 0);
+    }
+    return count;
+}
+
+bool io_queue::completes_io() const noexcept
+{
+#if defined(PROXY_IO_URING)
+    return ring && !provided.empty();
+#else
+    return false;
+#endif
+}
+
+void io_queue::set_completion(uintptr_t ident, completion_kind kind)
+{
+#if defined(PROXY_IO_URING)
+    if (!completes_io())
+        return;
+    handler_slot& s = slot(ident);
+    if (s.completion) {
+        if (s.completion->generation == s.generation && s.completion->kind == kind)
+            return;
+        retire_completion(*s.completion);
+        s.completion.reset();
+    }
+    if (kind == completion_kind::none)
+        return;
+    if (s.interest.poll_id != 0) {
+        ring->poll_remove(s.interest.poll_id);
+        s.interest.poll_id = 0;
+    }
+    request_seq = next_seq(request_seq);
+    s.completion.reset(new struct completion(kind, make_id(receive_request, ident, request_seq), s.generation));
+    queue_change(ident);
+#else
+    (void)ident;
+    (void)kind;
+#endif
+}
+
+ssize_t io_queue::receive(uintptr_t ident, read_buffer& input, size_t expected, buffer_slice& part)
+{
+#if defined(PROXY_IO_URING)
+    if (ident < handlers.size() && handlers[ident].completion) {
+        struct completion& c = *handlers[ident].completion;
+        if (!c.received.empty()) {
+            part = std::move(c.received.front());
+            c.received.pop_front();
+            return static_cast<ssize_t>(part.size());
+        }
+        part = buffer_slice();
+        if (c.eof)
+            return 0;
+        errno = c.error != 0 ? c.error : EAGAIN;
+        return -1;
+    }
+#endif
+    return input.receive(static_cast<int>(ident), expected, part);
+}
+
+int io_queue::accept(uintptr_t ident)
+{
+#if defined(PROXY_IO_URING)
+    if (ident < handlers.size() && handlers[ident].completion) {
+        struct completion& c = *handlers[ident].completion;
+        if (!c.accepted.empty()) {
+            int fd = c.accepted.front();
+            c.accepted.pop_front();
+            return fd;
+        }
+        if (c.error != 0) {
+            // the multishot accept is over: it starts again once the caller knows
+            errno = c.error;
+            c.error = 0;
+            queue_change(ident);
+            return -1;
+        }
+        errno = EAGAIN;
+        return -1;
+    }
+#endif
+    (void)ident;
+    errno = EINVAL;
+    return -1;
+}
+
+void io_queue::send(uintptr_t ident, buffer_chain const& bytes)
+{
+#if defined(PROXY_IO_URING)
+    if (completes_io() && ident < handlers.size() && handlers[ident].completion) {
+        request_seq = next_seq(request_seq);
+        uint64_t id = make_id(send_request, ident, request_seq);
+        pending_send& p = sends[id];
+        p.ident = ident;
+        p.generation = handlers[ident].generation;
+        p.bytes = bytes;
+
+        std::vector<struct iovec> slices(bytes.slice_count());
+        bytes.fill_iovec(slices.data(), slices.size());
+        // a slice across the end of a link is cut in two
+        size_t room = send_link_size;
+        std::vector<size_t> link_ends;
+        for (struct iovec slice : slices) {
+            while (slice.iov_len != 0) {
+                struct iovec piece = slice;
+                piece.iov_len = std::min(slice.iov_len, room);
+                p.iov.push_back(piece);
+                slice.iov_base = static_cast<char*>(slice.iov_base) + piece.iov_len;
+                slice.iov_len -= piece.iov_len;
+                room -= piece.iov_len;
+                if (room == 0 || p.iov.size() - (link_ends.empty() ? 0 : link_ends.back()) == max_link_iov) {
+                    link_ends.push_back(p.iov.size());
+                    room = send_link_size;
+                }
+            }
+        }
+        if (link_ends.empty() || link_ends.back() != p.iov.size())
+            link_ends.push_back(p.iov.size());
+
+        // msghdrs after the iovecs are all in place, they point into them
+        size_t begin = 0;
+        for (size_t end : link_ends) {
+            struct msghdr link = {};
+            link.msg_iov = p.iov.data() + begin;
+            link.msg_iovlen = end - begin;
+            p.links.push_back(link);
+            begin = end;
+        }
+        for (size_t i = 0; i < p.links.size(); i++)
+            ring->sendmsg(id, static_cast<int>(ident), &p.links[i], MSG_NOSIGNAL | MSG_WAITALL, i + 1 < p.links.size());
+        return;
+    }
+#endif
+    (void)ident;
+    (void)bytes;
+    throw_error(EINVAL, "io_queue::send()");
+}
+
+void io_queue::watch_loop() {
+#if defined(PROXY_IO_URING)
+    if (ring) {
+        uring_watch_loop();
+        return;
+    }
+#endif
+
+    size_t const evListSize = 256;
+    struct epoll_event epList[evListSize];
+    struct kevent evList[2 * evListSize];
+
+    while (!finished)
+    {
+        int timeout = prepare_wait();
+        int new_events = epoll_wait(fd.getfd(), epList, evListSize, timeout);
+        if (new_events == -1) {
+            switch (errno) {
+                case EINTR:
+                    // ignore;
+                    break;
+                default:
+                    throw_error(errno, "epoll_wait()");
+                    break;
+            }
+            continue;
+        }
+
+        size_t count = 0;
+        for (int i = 0; i < new_events; i++) {
+            count += make_events(epList[i].data.u64, epList[i].events, evList + count);
+        }
+        dispatch(evList, count);
+    }
+}
+
+#if defined(PROXY_IO_URING)
+void io_queue::uring_arm_user_event(uintptr_t ident, int event_fd)
+{
+    ring->poll_add(user_tag | ident, event_fd, EPOLLIN, true);
+}
+
+void io_queue::uring_watch_loop() {
+    size_t const evListSize = 256;
+    struct kevent evList[2 * evListSize];
+
+    while (!finished)
+    {
+        int timeout = prepare_wait();
+        if (ring->submit_and_wait(timeout) == -1) {
+            switch (errno) {
+                case EINTR:
+                case EAGAIN:
+                case EBUSY:
+                    // ignore;
+                    break;
+                default:
+                    throw_error(errno, "io_uring_enter()");
+                    break;
+            }
+            continue;
+        }
+
+        size_t ready = ring->ready();
+        if (ready > evListSize)
+            ready = evListSize;
+
+        completion_pass++;
+        size_t count = 0;
+        for (size_t i = 0; i < ready; i++) {
+            struct io_uring_cqe const& cqe = ring->completion(i);
+            uint64_t data = cqe.user_data;
+            bool rearm = !(cqe.flags & IORING_CQE_F_MORE);
+
+            if (data == 0)
+                continue; // completion of a poll_remove
+
+            if (data == wakeup_tag) {
+                if (rearm)
+                    ring->poll_add(wakeup_tag, wakeup_fd.getfd(), EPOLLIN, true);
+                make_events(data, 0, evList + count);
+                continue;
+            }
+            if (data & user_tag) {
+                auto it = user_events.find(data & ~user_tag);
+                if (it == user_events.end() || cqe.res < 0)
+                    continue;
+                if (rearm)
+                    uring_arm_user_event(it->first, it->second.getfd());
+                if (cqe.res > 0)
+                    count += make_events(data, static_cast<uint32_t>(cqe.res), evList + count);
+                continue;
+            }
+            if ((data & request_mask) == receive_request) {
+                if (complete_receive(cqe, evList[count]))
+                    count++;
+                continue;
+            }
+            if ((data & request_mask) == send_request) {
+                if (complete_send(cqe, evList[count]))
+                    count++;
+                continue;
+            }
+
+            uintptr_t ident = data & ident_mask;
+            if (ident >= handlers.size() || handlers[ident].interest.poll_id != data)
+                continue; // stale completion of a removed poll
+
+            if (rearm) {
+                // multishot poll was terminated by the kernel, keep it armed
+                handlers[ident].interest.poll_id = 0;
+                handlers[ident].interest.applied = 0;
+                queue_change(ident);
+            }
+            if (cqe.res < 0) {
+                if (cqe.res != -ECANCELED)
+                    count += make_events(data, EPOLLERR | EPOLLHUP, evList + count);
+            } else {
+                count += make_events(data, static_cast<uint32_t>(cqe.res), evList + count);
+            }
+        }
+        ring->advance(ready);
+
+        dispatch(evList, count);
+    }
+}
+
+io_queue::completion::completion(completion_kind kind, uint64_t id, uintptr_t generation)
+    : kind(kind)
+    , id(id)
+    , generation(generation)
+{}
+
+io_queue::completion::~completion()
+{
+    for (int fd : accepted)
+        ::close(fd);
+}
+
+void io_queue::apply_completion(uintptr_t ident, handler_slot& s)
+{
+    struct completion& c = *s.completion;
+    if (c.generation != s.generation) {
+        // deregistered, the descriptor may be closed and its number reused
+        retire_completion(c);
+        s.completion.reset();
+        return;
+    }
+    bool wanted = (s.interest.wanted & interest::read) && !c.eof && c.error == 0;
+    if (wanted && !c.armed) {
+        if (c.kind == completion_kind::listener) {
+            ring->accept_multishot(c.id, static_cast<int>(ident), SOCK_NONBLOCK | SOCK_CLOEXEC);
+        } else {
+            ring->recv_multishot(c.id, static_cast<int>(ident));
+        }
+        c.armed = true;
+    } else if (!wanted && c.armed && !c.cancelling) {
+        // what it completes until the cancel is kept, resume_events() reports it
+        ring->cancel(c.id);
+        c.cancelling = true;
+    }
+    // armed and cancelling: armed again after its last completion
+}
+
+void io_queue::retire_completion(struct completion& c)
+{
+    // a request holds on to the socket: it isn't closed until they are over
+    if (c.armed && !c.cancelling)
+        ring->cancel(c.id);
+    uintptr_t ident = c.id & ident_mask;
+    for (auto& entry : sends) {
+        pending_send& p = entry.second;
+        if (p.ident == ident && p.generation == c.generation && !p.cancelled) {
+            ring->cancel(entry.first);
+            p.cancelled = true;
+        }
+    }
+}
+
+void io_queue::provide_buffer(uint16_t id)
+{
+    buffer_storage& storage = *provided[id];
+    storage.used = 0;
+    ring->provide_buffer(id, storage.bytes.get(), static_cast<unsigned>(storage.capacity));
+}
+
+bool io_queue::complete_receive(struct io_uring_cqe const& cqe, struct kevent& event)
+{
+    uintptr_t ident = cqe.user_data & ident_mask;
+    struct completion* c = ident < handlers.size() ? handlers[ident].completion.get() : nullptr;
+    if (c != nullptr && (c->id != cqe.user_data || c->generation != handlers[ident].generation))
+        c = nullptr;
+
+    buffer_slice part;
+    if (cqe.flags & IORING_CQE_F_BUFFER) {
+        uint16_t id = uring::buffer_id(cqe);
+        if (c != nullptr && cqe.res > 0) {
+            // the slice keeps the block, a fresh one takes its place
+            std::shared_ptr<buffer_storage> storage = std::move(provided[id]);
+            storage->used = static_cast<size_t>(cqe.res);
+            part = buffer_slice(std::move(storage), 0, static_cast<size_t>(cqe.res));
+            provided[id] = buffer_storage::from_pool(provided_class);
+        }
+        provide_buffer(id);
+    }
+    if (c == nullptr) {
+        // of a registration that is gone: a connection accepted for it is closed
+        if (cqe.res > 0 && !(cqe.flags & IORING_CQE_F_BUFFER))
+            ::close(cqe.res);
+        return false;
+    }
+
+    if (!(cqe.flags & IORING_CQE_F_MORE)) {
+        // over: armed again by apply_completion() while it is wanted
+        c->armed = false;
+        c->cancelling = false;
+        queue_change(ident);
+    }
+    if (c->kind == completion_kind::listener && cqe.res >= 0) {
+        c->accepted.push_back(cqe.res);
+    } else if (cqe.res > 0) {
+        thread_buffer_stats().received += static_cast<uint64_t>(cqe.res);
+        c->received.push_back(std::move(part));
+    } else if (cqe.res == 0) {
+        c->eof = true;
+    } else if (cqe.res == -ECANCELED || cqe.res == -ENOBUFS) {
+        // cancelled by a pause, or out of buffers until this batch provided more
+        return false;
+    } else {
+        c->error = -cqe.res;
+    }
+    // the handler takes everything there is by then
+    if (c->reported == completion_pass)
+        return false;
+    c->reported = completion_pass;
+    event = make_event(ident, EVFILT_READ, 0, 0);
+    return true;
+}
+
+bool io_queue::complete_send(struct io_uring_cqe const& cqe, struct kevent& event)
+{
+    auto it = sends.find(cqe.user_data);
+    if (it == sends.end())
+        return false;
+    pending_send& p = it->second;
+    size_t expected = link_size(p.links[p.completed++]);
+    bool report = !p.failed && !p.cancelled;
+    int error = 0;
+    if (cqe.res < 0) {
+        error = -cqe.res;
+    } else if (static_cast<size_t>(cqe.res) < expected) {
+        // cut short without an error, the links behind it are cancelled: the rest goes again
+        error = EAGAIN;
+    }
+    if (error != 0)
+        p.failed = true;
+    uintptr_t ident = p.ident;
+    report = report && ident < handlers.size() && handlers[ident].generation == p.generation;
+    if (p.completed == p.links.size())
+        sends.erase(it);
+    if (!report)
+        return false;
+
+    event = make_event(ident, EVFILT_WRITE, error != 0 ? EV_ERROR : 0, cqe.res > 0 ? cqe.res : 0);
+    event.fflags = static_cast<uint32_t>(error);
+    return true;
+}
+#endif
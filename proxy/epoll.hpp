@@ -0,0 +1,36 @@
+//
+//  epoll.hpp
+//  proxy
+//
+//  kqueue-compatible event description for the epoll backend, so event
+//  handlers are written once against struct kevent on every platform.
+//
+
+#ifndef epoll_hpp
+#define epoll_hpp
+
+#include <stdint.h>
+#include <sys/types.h>
+
+#define EVFILT_READ     (-1)
+#define EVFILT_WRITE    (-2)
+#define EVFILT_USER     (-10)
+
+#define EV_ADD          0x0001
+#define EV_DELETE       0x0002
+#define EV_CLEAR        0x0020 // edge-triggered (EPOLLET)
+#define EV_ERROR        0x4000
+#define EV_EOF          0x8000
+
+#define NOTE_TRIGGER    0x01000000
+
+struct kevent {
+    uintptr_t ident;
+    int16_t filter;
+    uint16_t flags;
+    uint32_t fflags;
+    intptr_t data;      // EVFILT_READ: always 0, the bytes available aren't asked for
+    void* udata;
+};
+
+#endif /* epoll_hpp */
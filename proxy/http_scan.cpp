@@ -0,0 +1,239 @@
+//
+//  http_scan.cpp
+//  proxy
+//
+
+#include <string.h>
+
+#include "http_scan.hpp"
+
+#if (defined(__x86_64__) || defined(__i386__)) && defined(__GNUC__)
+// the kernels are compiled for their instruction set one by one with the
+// target attribute, the rest of the program runs on any x86
+#define PROXY_SCAN_X86
+#include <immintrin.h>
+#endif
+
+namespace
+{
+    uint32_t const head_end = 0x0d0a0d0a; // "\r\n\r\n"
+
+    // RFC 7230: "!" / "#" / "$" / "%" / "&" / "'" / "*" / "+" / "-" / "." /
+    // "^" / "_" / "`" / "|" / "~" / DIGIT / ALPHA
+    bool is_tchar(unsigned char c) noexcept
+    {
+        unsigned char folded = c | 0x20;
+        return (c >= '0' && c <= '9') || (folded >= 'a' && folded <= 'z')
+               || c == '!' || (c >= '#' && c <= '\'') || c == '*' || c == '+'
+               || c == '-' || c == '.' || c == '^' || c == '_' || c == '`'
+               || c == '|' || c == '~';
+    }
+
+    // the four bytes up to data + end, the ones before data come from tail
+    uint32_t last_four(char const* data, size_t end, uint32_t tail) noexcept
+    {
+        for (size_t i = end < 4 ? 0 : end - 4; i < end; i++)
+            tail = (tail << 8) | static_cast<unsigned char>(data[i]);
+        return tail;
+    }
+
+    size_t scalar_find_head_end(char const* data, size_t size, uint32_t& tail)
+    {
+        for (size_t i = 0; i < size; i++) {
+            tail = (tail << 8) | static_cast<unsigned char>(data[i]);
+            if (tail == head_end)
+                return i + 1;
+        }
+        return 0;
+    }
+
+    size_t scalar_find_either(char const* data, size_t size, char a, char b)
+    {
+        for (size_t i = 0; i < size; i++) {
+            if (data[i] == a || data[i] == b)
+                return i;
+        }
+        return size;
+    }
+
+    size_t scalar_token_length(char const* data, size_t size)
+    {
+        for (size_t i = 0; i < size; i++) {
+            if (!is_tchar(static_cast<unsigned char>(data[i])))
+                return i;
+        }
+        return size;
+    }
+
+    // a '\n' at p of a block ends the head when the three bytes before it
+    // are "\r\n\r"; lines are long enough for that to be rare
+    bool ends_head(char const* data, size_t p, uint32_t tail) noexcept
+    {
+        return last_four(data, p + 1, tail) == head_end;
+    }
+
+#ifdef PROXY_SCAN_X86
+    __attribute__((target("sse4.2")))
+    size_t sse42_find_head_end(char const* data, size_t size, uint32_t& tail)
+    {
+        __m128i const lf = _mm_set1_epi8('\n');
+        size_t i = 0;
+        for (; i + 16 <= size; i += 16) {
+            __m128i block = _mm_loadu_si128(reinterpret_cast<__m128i const*>(data + i));
+            unsigned mask = _mm_movemask_epi8(_mm_cmpeq_epi8(block, lf));
+            for (; mask != 0; mask &= mask - 1) {
+                size_t p = i + __builtin_ctz(mask);
+                if (ends_head(data, p, tail)) {
+                    tail = head_end;
+                    return p + 1;
+                }
+            }
+        }
+        tail = last_four(data, i, tail);
+        size_t end = scalar_find_head_end(data + i, size - i, tail);
+        return end == 0 ? 0 : i + end;
+    }
+
+    __attribute__((target("sse4.2")))
+    size_t sse42_find_either(char const* data, size_t size, char a, char b)
+    {
+        __m128i const set = _mm_setr_epi8(a, b, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0);
+        size_t i = 0;
+        for (; i + 16 <= size; i += 16) {
+            __m128i block = _mm_loadu_si128(reinterpret_cast<__m128i const*>(data + i));
+            int index = _mm_cmpestri(set, 2, block, 16, _SIDD_UBYTE_OPS | _SIDD_CMP_EQUAL_ANY | _SIDD_LEAST_SIGNIFICANT);
+            if (index != 16)
+                return i + index;
+        }
+        return i + scalar_find_either(data + i, size - i, a, b);
+    }
+
+    __attribute__((target("sse4.2")))
+    size_t sse42_token_length(char const* data, size_t size)
+    {
+        // the characters names are made of, the other tchars are checked one
+        // by one when they show up
+        __m128i const ranges = _mm_setr_epi8('0', '9', 'A', 'Z', 'a', 'z', '-', '-', 0, 0, 0, 0, 0, 0, 0, 0);
+        size_t i = 0;
+        while (i + 16 <= size) {
+            __m128i block = _mm_loadu_si128(reinterpret_cast<__m128i const*>(data + i));
+            int index = _mm_cmpestri(ranges, 8, block, 16, _SIDD_UBYTE_OPS | _SIDD_CMP_RANGES | _SIDD_NEGATIVE_POLARITY | _SIDD_LEAST_SIGNIFICANT);
+            if (index == 16) {
+                i += 16;
+            } else if (is_tchar(static_cast<unsigned char>(data[i + index]))) {
+                i += index + 1;
+            } else {
+                return i + index;
+            }
+        }
+        return i + scalar_token_length(data + i, size - i);
+    }
+
+    __attribute__((target("avx2")))
+    size_t avx2_find_head_end(char const* data, size_t size, uint32_t& tail)
+    {
+        __m256i const lf = _mm256_set1_epi8('\n');
+        size_t i = 0;
+        for (; i + 32 <= size; i += 32) {
+            __m256i block = _mm256_loadu_si256(reinterpret_cast<__m256i const*>(data + i));
+            uint32_t mask = _mm256_movemask_epi8(_mm256_cmpeq_epi8(block, lf));
+            for (; mask != 0; mask &= mask - 1) {
+                size_t p = i + __builtin_ctz(mask);
+                if (ends_head(data, p, tail)) {
+                    tail = head_end;
+                    return p + 1;
+                }
+            }
+        }
+        tail = last_four(data, i, tail);
+        size_t end = scalar_find_head_end(data + i, size - i, tail);
+        return end == 0 ? 0 : i + end;
+    }
+
+    __attribute__((target("avx2")))
+    size_t avx2_find_either(char const* data, size_t size, char a, char b)
+    {
+        __m256i const first = _mm256_set1_epi8(a);
+        __m256i const second = _mm256_set1_epi8(b);
+        size_t i = 0;
+        for (; i + 32 <= size; i += 32) {
+            __m256i block = _mm256_loadu_si256(reinterpret_cast<__m256i const*>(data + i));
+            __m256i found = _mm256_or_si256(_mm256_cmpeq_epi8(block, first), _mm256_cmpeq_epi8(block, second));
+            uint32_t mask = _mm256_movemask_epi8(found);
+            if (mask != 0)
+                return i + __builtin_ctz(mask);
+        }
+        return i + scalar_find_either(data + i, size - i, a, b);
+    }
+
+    // lo <= x <= hi for unsigned bytes
+    __attribute__((target("avx2")))
+    inline __m256i in_range(__m256i x, char lo, char hi)
+    {
+        __m256i above = _mm256_cmpeq_epi8(_mm256_max_epu8(x, _mm256_set1_epi8(lo)), x);
+        __m256i below = _mm256_cmpeq_epi8(_mm256_min_epu8(x, _mm256_set1_epi8(hi)), x);
+        return _mm256_and_si256(above, below);
+    }
+
+    __attribute__((target("avx2")))
+    size_t avx2_token_length(char const* data, size_t size)
+    {
+        __m256i const dash = _mm256_set1_epi8('-');
+        size_t i = 0;
+        while (i + 32 <= size) {
+            __m256i block = _mm256_loadu_si256(reinterpret_cast<__m256i const*>(data + i));
+            __m256i name = _mm256_or_si256(_mm256_or_si256(in_range(block, '0', '9'), in_range(block, 'A', 'Z')),
+                                           _mm256_or_si256(in_range(block, 'a', 'z'), _mm256_cmpeq_epi8(block, dash)));
+            uint32_t other = ~static_cast<uint32_t>(_mm256_movemask_epi8(name));
+            if (other == 0) {
+                i += 32;
+                continue;
+            }
+            size_t index = __builtin_ctz(other);
+            if (!is_tchar(static_cast<unsigned char>(data[i + index])))
+                return i + index;
+            i += index + 1;
+        }
+        return i + scalar_token_length(data + i, size - i);
+    }
+#endif
+
+    scan_kernels const scalar_kernels = {"scalar", scalar_find_head_end, scalar_find_either, scalar_token_length};
+#ifdef PROXY_SCAN_X86
+    scan_kernels const sse42_kernels = {"sse4.2", sse42_find_head_end, sse42_find_either, sse42_token_length};
+    scan_kernels const avx2_kernels = {"avx2", avx2_find_head_end, avx2_find_either, avx2_token_length};
+#endif
+}
+
+scan_kernels const& scalar_scan_kernels()
+{
+    return scalar_kernels;
+}
+
+scan_kernels const* sse42_scan_kernels()
+{
+#ifdef PROXY_SCAN_X86
+    __builtin_cpu_init();
+    if (__builtin_cpu_supports("sse4.2"))
+        return &sse42_kernels;
+#endif
+    return nullptr;
+}
+
+scan_kernels const* avx2_scan_kernels()
+{
+#ifdef PROXY_SCAN_X86
+    __builtin_cpu_init();
+    if (__builtin_cpu_supports("avx2"))
+        return &avx2_kernels;
+#endif
+    return nullptr;
+}
+
+scan_kernels const& http_scan()
+{
+    static scan_kernels const& best = avx2_scan_kernels() ? *avx2_scan_kernels()
+                                    : sse42_scan_kernels() ? *sse42_scan_kernels()
+                                    : scalar_scan_kernels();
+    return best;
+}
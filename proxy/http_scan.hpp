@@ -0,0 +1,37 @@
+//
+//  http_scan.hpp
+//  proxy
+//
+//  The loops of the HTTP parser that look at every byte of a message head,
+//  vectorized. The SSE4.2 or AVX2 kernels are picked once by what the CPU
+//  has, the scalar ones are used everywhere else; all of them return the
+//  same results for the same input.
+//
+
+#ifndef http_scan_hpp
+#define http_scan_hpp
+
+#include <stddef.h>
+#include <stdint.h>
+
+struct scan_kernels
+{
+    char const* name;
+    // offset just past the first "\r\n\r\n" in data, 0 when there is none.
+    // tail holds the last four bytes scanned, the search goes on with it
+    // in the next part
+    size_t (*find_head_end)(char const* data, size_t size, uint32_t& tail);
+    // offset of the first a or b in data, size when there is none
+    size_t (*find_either)(char const* data, size_t size, char a, char b);
+    // length of the run of token characters (RFC 7230 tchar) data starts with
+    size_t (*token_length)(char const* data, size_t size);
+};
+
+scan_kernels const& scalar_scan_kernels();
+// nullptr where the compiler or the CPU can't run them
+scan_kernels const* sse42_scan_kernels();
+scan_kernels const* avx2_scan_kernels();
+// the fastest of them on this CPU
+scan_kernels const& http_scan();
+
+#endif /* http_scan_hpp */
@@ -0,0 +1,149 @@
+//
+//  http_types.cpp
+//  proxy
+//
+
+#include <string.h>
+
+#include "http_types.hpp"
+
+namespace
+{
+    struct known_header
+    {
+        char const* name; // lowercase
+        header_id id;
+    };
+
+    size_t const header_slots = 64;
+
+    constexpr char lower(char c)
+    {
+        return c >= 'A' && c <= 'Z' ? c - 'A' + 'a' : c;
+    }
+
+    constexpr size_t length(char const* text)
+    {
+        return *text == 0 ? 0 : 1 + length(text + 1);
+    }
+
+    // the length and the last character tell the known names apart, an
+    // unknown name is compared with the one in its slot
+    constexpr size_t header_slot(char const* name, size_t size)
+    {
+        return (size + 12 * static_cast<unsigned char>(lower(name[size - 1]))) % header_slots;
+    }
+
+    constexpr known_header none = {"", header_id::other};
+
+    constexpr known_header header_table[header_slots] = {
+        none, none, none,
+        {"upgrade", header_id::upgrade},                         // 3
+        {"if-range", header_id::if_range},                       // 4
+        none,
+        {"keep-alive", header_id::keep_alive},                   // 6
+        none, none, none, none, none, none,
+        {"if-modified-since", header_id::if_modified_since},     // 13
+        {"proxy-authenticate", header_id::proxy_authenticate},   // 14
+        {"if-unmodified-since", header_id::if_unmodified_since}, // 15
+        none, none, none, none, none, none, none, none,
+        {"etag", header_id::etag},                               // 24
+        none, none, none, none,
+        {"cache-control", header_id::cache_control},             // 29
+        none,
+        {"trailer", header_id::trailer},                         // 31
+        none, none, none, none, none,
+        {"transfer-encoding", header_id::transfer_encoding},     // 37
+        none, none,
+        {"if-match", header_id::if_match},                       // 40
+        none, none, none, none,
+        {"if-none-match", header_id::if_none_match},             // 45
+        {"content-length", header_id::content_length},           // 46
+        none,
+        {"vary", header_id::vary},                               // 48
+        none,
+        {"connection", header_id::connection},                   // 50
+        none,
+        {"host", header_id::host},                               // 52
+        none,
+        {"expect", header_id::expect},                           // 54
+        none,
+        {"proxy-connection", header_id::proxy_connection},       // 56
+        none, none,
+        {"proxy-authorization", header_id::proxy_authorization}, // 59
+        none, none,
+        {"te", header_id::te},                                   // 62
+        none,
+    };
+
+    // every name is in the slot its hash points to...
+    constexpr bool in_their_slots(size_t slot)
+    {
+        return slot == header_slots
+               || ((header_table[slot].id == header_id::other
+                    || header_slot(header_table[slot].name, length(header_table[slot].name)) == slot)
+                   && in_their_slots(slot + 1));
+    }
+
+    constexpr bool in_table(header_id id, size_t slot)
+    {
+        return slot != header_slots && (header_table[slot].id == id || in_table(id, slot + 1));
+    }
+
+    // ...and every known header has one
+    constexpr bool all_in_table(size_t id)
+    {
+        return id == known_header_count || (in_table(static_cast<header_id>(id), 0) && all_in_table(id + 1));
+    }
+
+    static_assert(in_their_slots(0), "a known header is out of its slot, the hash has a collision");
+    static_assert(all_in_table(1), "a known header is missing from the table");
+}
+
+http_method find_method(char const* name, size_t size) noexcept
+{
+    switch (size) {
+        case 3:
+            if (memcmp(name, "GET", 3) == 0)
+                return http_method::GET;
+            if (memcmp(name, "PUT", 3) == 0)
+                return http_method::PUT;
+            break;
+        case 4:
+            if (memcmp(name, "POST", 4) == 0)
+                return http_method::POST;
+            if (memcmp(name, "HEAD", 4) == 0)
+                return http_method::HEAD;
+            break;
+        case 5:
+            if (memcmp(name, "PATCH", 5) == 0)
+                return http_method::PATCH;
+            if (memcmp(name, "TRACE", 5) == 0)
+                return http_method::TRACE;
+            break;
+        case 6:
+            if (memcmp(name, "DELETE", 6) == 0)
+                return http_method::DELETE;
+            break;
+        case 7:
+            if (memcmp(name, "CONNECT", 7) == 0)
+                return http_method::CONNECT;
+            if (memcmp(name, "OPTIONS", 7) == 0)
+                return http_method::OPTIONS;
+            break;
+    }
+    return http_method::other;
+}
+
+header_id find_header(char const* name, size_t size) noexcept
+{
+    if (size == 0)
+        return header_id::other;
+    known_header const& entry = header_table[header_slot(name, size)];
+    // a token has no NUL, a shorter name in the slot stops at its end
+    for (size_t i = 0; i < size; i++) {
+        if (lower(name[i]) != entry.name[i])
+            return header_id::other;
+    }
+    return entry.name[size] == 0 ? entry.id : header_id::other;
+}
@@ -0,0 +1,61 @@
+//
+//  http_types.hpp
+//  proxy
+//
+//  What the proxy looks for in a message, as values instead of strings: the
+//  method, the status code and the header names it acts on. A name is
+//  looked up once, when its head is parsed, in a perfect hash table.
+//
+
+#ifndef http_types_hpp
+#define http_types_hpp
+
+#include <stddef.h>
+#include <stdint.h>
+
+// RFC 9110 9.3, other is any method the proxy just forwards
+enum class http_method : uint8_t { other, GET, HEAD, POST, PUT, DELETE, CONNECT, OPTIONS, TRACE, PATCH };
+
+// any three digit code fits, the ones the proxy acts on are named
+enum class http_status : uint16_t
+{
+    none = 0, // not parsed yet
+    switching_protocols = 101,
+    ok = 200,
+    no_content = 204,
+    not_modified = 304,
+};
+
+// the headers of framing, connection management and revalidation
+enum class header_id : uint8_t
+{
+    other,
+    host,
+    content_length,
+    transfer_encoding,
+    connection,
+    proxy_connection,
+    keep_alive,
+    te,
+    trailer,
+    upgrade,
+    expect,
+    etag,
+    vary,
+    cache_control,
+    if_match,
+    if_modified_since,
+    if_none_match,
+    if_range,
+    if_unmodified_since,
+    proxy_authenticate,
+    proxy_authorization,
+};
+
+size_t const known_header_count = static_cast<size_t>(header_id::proxy_authorization) + 1;
+
+// methods are case-sensitive, header names aren't
+http_method find_method(char const* name, size_t size) noexcept;
+header_id find_header(char const* name, size_t size) noexcept;
+
+#endif /* http_types_hpp */
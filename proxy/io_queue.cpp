@@ -0,0 +1,367 @@
+//
+//  io_queue.cpp
+//  Proxy server
+//
+//  Backend independent part of io_queue: handler bookkeeping, dispatch and timers.
+//
+
+#include <iostream>
+#include <stdexcept>
+#include <thread>
+
+#include "kqueue.hpp"
+#include "buffer.hpp"
+#include "worker_pool.hpp"
+
+namespace
+{
+    int filter_index(int16_t filter)
+    {
+        switch (filter) {
+            case EVFILT_READ:
+                return 0;
+            case EVFILT_WRITE:
+                return 1;
+            case EVFILT_USER:
+                return 2;
+        }
+        return -1;
+    }
+
+    handler_category category_of(descriptor_kind kind, int index)
+    {
+        if (index == 1)
+            return handler_category::write;
+        if (index == 0) {
+            switch (kind) {
+                case descriptor_kind::listener:
+                    return handler_category::accept;
+                case descriptor_kind::client:
+                    return handler_category::client_read;
+                case descriptor_kind::server:
+                    return handler_category::server_read;
+                case descriptor_kind::unknown:
+                    break;
+            }
+        }
+        return handler_category::other;
+    }
+
+    std::atomic<unsigned> metrics_dumps_requested{0};
+}
+
+void io_queue::hard_stop() {
+    finished = true;
+}
+
+void io_queue::add_event_handler(uintptr_t ident, int16_t filter, funct_t funct) {
+    add_event_handler(ident, filter, 0, funct);
+}
+
+void io_queue::add_event_handler(uintptr_t ident, int16_t filter, uint16_t flags, funct_t funct) {
+    if (filter == EVFILT_USER) {
+        add_user_event(ident, flags);
+    } else {
+        interest& i = slot(ident).interest;
+        i.wanted |= (filter == EVFILT_READ) ? interest::read : interest::write;
+        if (flags & EV_CLEAR) {
+            i.wanted |= interest::edge;
+        } else {
+            i.wanted &= ~interest::edge;
+        }
+        queue_change(ident);
+    }
+    set_handler(ident, filter, std::move(funct));
+}
+
+void io_queue::delete_event_handler(uintptr_t ident, int16_t filter) {
+    if (filter == EVFILT_USER) {
+        delete_user_event(ident);
+    } else if (ident < handlers.size()) {
+        interest& i = handlers[ident].interest;
+        i.wanted &= ~((filter == EVFILT_READ) ? interest::read : interest::write);
+        if (!(i.wanted & (interest::read | interest::write)))
+            i.wanted = 0;
+        queue_change(ident);
+    }
+    remove_handler(ident, filter);
+}
+
+void io_queue::set_descriptor_kind(uintptr_t ident, descriptor_kind kind)
+{
+    slot(ident).kind = kind;
+}
+
+void io_queue::pause_events(uintptr_t ident, int16_t filter)
+{
+    if (ident >= handlers.size())
+        return;
+    handlers[ident].interest.wanted &= ~((filter == EVFILT_READ) ? interest::read : interest::write);
+    queue_change(ident);
+}
+
+void io_queue::resume_events(uintptr_t ident, int16_t filter)
+{
+    if (ident >= handlers.size() || !handlers[ident].handlers[filter_index(filter)])
+        return;
+    handlers[ident].interest.wanted |= (filter == EVFILT_READ) ? interest::read : interest::write;
+    queue_change(ident);
+    // an edge-triggered filter may have fired and been consumed while paused
+    redeliver(ident, filter);
+}
+
+void io_queue::redeliver(uintptr_t ident, int16_t filter)
+{
+    if (ident >= handlers.size())
+        return;
+    struct kevent event = {};
+    event.ident = ident;
+    event.filter = filter;
+    event.udata = reinterpret_cast<void*>(handlers[ident].generation);
+    redelivered.push_back(event);
+}
+
+void io_queue::post(std::function<void()> task)
+{
+    post(std::move(task), handler_category::completion);
+}
+
+void io_queue::post(std::function<void()> task, handler_category category)
+{
+    if (posted.push(std::move(task), static_cast<uint8_t>(category)))
+        wake_up();
+}
+
+void io_queue::offload(worker_pool& pool, std::function<void()> work, std::function<void()> continuation)
+{
+    offloaded_in_flight.fetch_add(1);
+    pool.submit([this, work, continuation]() {
+        timer::clock_t::time_point start = timer::clock_t::now();
+        bool done = true;
+        try {
+            work();
+        } catch (std::exception const& e) {
+            std::cerr << "error: " << e.what() << std::endl;
+            done = false;
+        } catch (...) {
+            std::cerr << "unknown exception in offloaded work" << std::endl;
+            done = false;
+        }
+        auto spent = std::chrono::duration_cast<std::chrono::nanoseconds>(timer::clock_t::now() - start);
+        stats.offloaded_ns.fetch_add(spent.count(), std::memory_order_relaxed);
+        stats.offloaded_tasks.fetch_add(1, std::memory_order_relaxed);
+        if (done)
+            post(continuation);
+        offloaded_in_flight.fetch_sub(1);
+    });
+}
+
+void io_queue::wait_for_offloaded()
+{
+    // workers post into this queue until their task is over
+    while (offloaded_in_flight.load() != 0)
+        std::this_thread::yield();
+}
+
+timer& io_queue::get_timer() noexcept
+{
+    return timer;
+}
+
+timer::clock_t::time_point io_queue::now() const noexcept
+{
+    return loop_time;
+}
+
+loop_stats const& io_queue::get_stats() const noexcept
+{
+    return stats;
+}
+
+void io_queue::enable_metrics(std::chrono::nanoseconds stall_threshold)
+{
+    metrics.reset(new loop_metrics(stall_threshold));
+}
+
+void io_queue::dump_metrics(std::ostream& out) const
+{
+    out << "event loop " << std::this_thread::get_id() << ": " << stats.batches << " batches, "
+        << std::chrono::duration_cast<std::chrono::milliseconds>(stats.inline_time).count() << " ms inline, "
+        << stats.offloaded_tasks.load() << " tasks offloaded for "
+        << stats.offloaded_ns.load() / 1000000 << " ms\n";
+    // meaningful on the loop thread, the counters are per thread
+    buffer_stats const& bytes = thread_buffer_stats();
+    out << "  buffers: " << bytes.received << " bytes received, " << bytes.sent << " sent, "
+        << bytes.copied << " copied (" << (bytes.received ? double(bytes.copied) / bytes.received : 0.)
+        << " per received byte), blocks " << bytes.blocks_allocated << " allocated, "
+        << bytes.blocks_reused << " reused\n"
+        << "  write queues: " << bytes.queued << " bytes, peak " << bytes.queued_peak << ", "
+        << bytes.pauses << " reads paused\n"
+        << "  zero-copy: " << bytes.zero_copy_sent << " bytes sent, " << bytes.zero_copy_copied
+        << " sends copied by the kernel, " << bytes.pinned << " bytes pinned\n"
+        << "  responses: " << bytes.retained << " bytes kept for the cache, peak " << bytes.retained_peak << "\n";
+    if (metrics)
+        metrics->dump(out);
+}
+
+void io_queue::request_metrics_dump() noexcept
+{
+    metrics_dumps_requested.fetch_add(1, std::memory_order_relaxed);
+}
+
+io_queue::handler_slot& io_queue::slot(uintptr_t ident)
+{
+    if (ident >= handlers.size())
+        handlers.resize(ident + 1);
+    return handlers[ident];
+}
+
+void io_queue::set_handler(uintptr_t ident, int16_t filter, funct_t funct)
+{
+    std::unique_ptr<funct_t>& handler = slot(ident).handlers[filter_index(filter)];
+    if (handler)
+        retired_handlers.push_back(std::move(handler));
+    handler.reset(new funct_t(std::move(funct)));
+}
+
+void io_queue::remove_handler(uintptr_t ident, int16_t filter)
+{
+    if (ident >= handlers.size())
+        return;
+    handler_slot& s = handlers[ident];
+    std::unique_ptr<funct_t>& handler = s.handlers[filter_index(filter)];
+    if (!handler)
+        return;
+    // the handler may be the one being executed right now
+    retired_handlers.push_back(std::move(handler));
+    if (!s.handlers[0] && !s.handlers[1] && !s.handlers[2]) {
+        s.generation++;
+        s.kind = descriptor_kind::unknown;
+    }
+}
+
+void io_queue::queue_change(uintptr_t ident)
+{
+    interest& i = handlers[ident].interest;
+    if (!i.queued) {
+        i.queued = true;
+        changed.push_back(ident);
+    }
+}
+
+void io_queue::dispatch(struct kevent* evList, size_t new_events) {
+    // one clock read per batch instead of one per handler
+    loop_time = timer::clock_t::now();
+    uint64_t start = 0;
+    if (metrics) {
+        start = wake_cycles = read_cycles();
+        metrics->batch_events.record(new_events);
+    }
+
+    // remember which registration each event belongs to: handlers called
+    // earlier in the batch may close the descriptor and reuse its number
+    for (size_t i = 0; i < new_events; i++) {
+        uintptr_t ident = evList[i].ident;
+        evList[i].udata = reinterpret_cast<void*>(ident < handlers.size() ? handlers[ident].generation : 0);
+    }
+
+    // events redelivered by the last batch go after the fresh ones
+    std::vector<struct kevent> again;
+    again.swap(redelivered);
+
+    for (size_t i = 0; i < new_events && !finished; i++)
+        dispatch_event(evList[i], start);
+    for (size_t i = 0; i < again.size() && !finished; i++)
+        dispatch_event(again[i], start);
+    if (!finished) {
+        if (metrics) {
+            // each task on its own, like the handlers
+            start = read_cycles();
+            posted.run([this, &start](uint8_t category) {
+                uint64_t end = read_cycles();
+                metrics->handler_done(static_cast<handler_category>(category), 0, start, end);
+                start = end;
+            });
+        } else {
+            posted.run();
+        }
+    }
+    retired_handlers.clear();
+
+    stats.batches++;
+    stats.inline_time += timer::clock_t::now() - loop_time;
+}
+
+void io_queue::dispatch_event(struct kevent const& event, uint64_t& start)
+{
+    uintptr_t ident = event.ident;
+    int index = filter_index(event.filter);
+    if (ident >= handlers.size() || index == -1)
+        return;
+    handler_slot& s = handlers[ident];
+    if (s.generation != reinterpret_cast<uintptr_t>(event.udata))
+        return;
+    funct_t* funct = s.handlers[index].get();
+    if (!funct)
+        return;
+    // paused by a handler earlier in the batch, or redelivered after that
+    uint8_t bit = index == 0 ? interest::read : index == 1 ? interest::write : 0;
+    if (bit != 0 && !(s.interest.wanted & bit))
+        return;
+    // the kind is taken before the handler may delete itself
+    descriptor_kind kind = s.kind;
+    (*funct)(event);
+    if (metrics) {
+        // one counter read per event: the end of a handler starts the next
+        uint64_t end = read_cycles();
+        metrics->handler_done(category_of(kind, index), ident, start, end);
+        start = end;
+    }
+}
+
+int io_queue::prepare_wait()
+{
+    int timeout = run_timers_calculate_timeout();
+    apply_changes();
+    if (!redelivered.empty())
+        timeout = 0;
+
+    if (metrics) {
+        if (wake_cycles != 0)
+            metrics->iteration.record(read_cycles() - wake_cycles);
+        unsigned requested = metrics_dumps_requested.load(std::memory_order_relaxed);
+        if (requested != dumps_done) {
+            dumps_done = requested;
+            dump_metrics(std::cerr);
+        }
+    }
+    return timeout;
+}
+
+int io_queue::run_timers_calculate_timeout()
+{
+    if (timer.empty())
+        return -1;
+    
+    timer::clock_t::time_point now = timer::clock_t::now();
+    loop_time = now;
+    if (metrics) {
+        uint64_t start = read_cycles();
+        timer.notify(now, [this, &start]() {
+            uint64_t end = read_cycles();
+            metrics->handler_done(handler_category::timer, 0, start, end);
+            start = end;
+        });
+    } else {
+        timer.notify(now);
+    }
+    
+    if (timer.empty())
+        return -1;
+    
+    // milliseconds, rounded up so that the loop doesn't spin until the deadline
+    auto timeout = std::chrono::duration_cast<std::chrono::milliseconds>(timer.top() - now);
+    if (now + timeout < timer.top())
+        timeout += std::chrono::milliseconds(1);
+    return static_cast<int>(timeout.count());
+}
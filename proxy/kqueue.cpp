@@ -9,49 +9,55 @@
 #include <sys/socket.h>
 #include <sys/errno.h>
 #include <iostream>
+#include <stdexcept>
 
 #include "kqueue.hpp"
 #include "throw_error.h"
 
-io_queue::io_queue()
+namespace
 {
+    // EVFILT_USER event that wakes the loop up for posted tasks
+    uintptr_t const wakeup_ident = ~uintptr_t(0);
+}
+
+io_queue::io_queue() : io_queue(io_backend::native)
+{}
+
+io_queue::io_queue(io_backend backend)
+{
+    if (backend != io_backend::native) {
+        throw std::runtime_error("io_uring backend is not available on this platform");
+    }
     fd = kqueue();
     if (fd.getfd() == -1) {
         throw_error(errno, "kqueue()");
     }
+    add_user_event(wakeup_ident, EV_CLEAR);
 }
 
-void io_queue::hard_stop() {
-    finished = true;
-}
-
-void io_queue::add_event_handler(uintptr_t ident, int16_t filter, funct_t funct) {
-    add_event_handler(ident, filter, 0, funct);
+io_queue::~io_queue()
+{
+    wait_for_offloaded();
 }
 
-void io_queue::add_event_handler(uintptr_t ident, int16_t filter, uint16_t flags, funct_t funct) {
+void io_queue::add_user_event(uintptr_t ident, uint16_t flags) {
+    // applied at once: the event may be triggered from another thread right away
     struct kevent event;
-    EV_SET(&event, ident, filter, EV_ADD|flags, 0, 0, NULL);
+    EV_SET(&event, ident, EVFILT_USER, EV_ADD|flags, 0, 0, NULL);
     int fail = kevent(fd.getfd(), &event, 1, NULL, 0, NULL);
     if (fail) {
         throw_error(errno, "kevent(EV_ADD)");
     }
-    auto event_handler = std::pair<std::pair<uintptr_t, int16_t>, funct_t>
-    (std::pair<uintptr_t, int16_t>(event.ident, event.filter),funct);
-    events_handlers.erase(std::pair<uintptr_t, int16_t>(event.ident, event.filter));
-    events_handlers.insert(event_handler);
 }
 
-void io_queue::delete_event_handler(uintptr_t ident, int16_t filter) {
+void io_queue::delete_user_event(uintptr_t ident) {
     struct kevent event;
-    EV_SET(&event, ident, filter, EV_DELETE, 0, 0, NULL);
+    EV_SET(&event, ident, EVFILT_USER, EV_DELETE, 0, 0, NULL);
     int fail = kevent(fd.getfd(), &event, 1, NULL, 0, NULL);
     if (fail == -1) {
         if (errno != ENOENT)
             throw_error(errno, "kevent(EV_DELETE)");
     }
-    deleted_events.push_back({ident, filter});
-    events_handlers.erase(std::pair<uintptr_t, int16_t>(ident, filter));
 }
 
 void io_queue::trigger_user_event_handler(uintptr_t ident) {
@@ -63,9 +69,70 @@ void io_queue::trigger_user_event_handler(uintptr_t ident) {
     }
 }
 
-timer& io_queue::get_timer() noexcept
+void io_queue::wake_up() {
+    trigger_user_event_handler(wakeup_ident);
+}
+
+void io_queue::apply_changes() {
+    for (uintptr_t ident : changed) {
+        handler_slot& s = handlers[ident];
+        interest& i = s.interest;
+        i.queued = false;
+
+        // after the slot was emptied the descriptor may have been closed,
+        // taking its knotes with it, so nothing the kernel had can be assumed
+        bool reused = i.applied_generation != s.generation;
+        if (i.wanted == i.applied && !reused)
+            continue;
+
+        uint16_t clear = (i.wanted & interest::edge) ? EV_CLEAR : 0;
+        bool edge_changed = (i.wanted ^ i.applied) & interest::edge;
+        struct filter_change { int16_t filter; uint8_t bit; } filters[] = {
+            {EVFILT_READ, interest::read},
+            {EVFILT_WRITE, interest::write}
+        };
+        for (auto const& f : filters) {
+            struct kevent event;
+            if (i.wanted & f.bit) {
+                if (!(i.applied & f.bit) || reused || edge_changed) {
+                    EV_SET(&event, ident, f.filter, EV_ADD|clear, 0, 0, NULL);
+                    changelist.push_back(event);
+                }
+            } else if (i.applied & f.bit) {
+                EV_SET(&event, ident, f.filter, EV_DELETE, 0, 0, NULL);
+                changelist.push_back(event);
+            }
+        }
+        i.applied = i.wanted;
+        i.applied_generation = s.generation;
+    }
+    changed.clear();
+}
+
+bool io_queue::completes_io() const noexcept
 {
-    return timer;
+    return false;
+}
+
+void io_queue::set_completion(uintptr_t, completion_kind)
+{
+    // no ring: the handlers do their own I/O
+}
+
+ssize_t io_queue::receive(uintptr_t ident, read_buffer& input, size_t expected, buffer_slice& part)
+{
+    return input.receive(static_cast<int>(ident), expected, part);
+}
+
+int io_queue::accept(uintptr_t)
+{
+    errno = EINVAL;
+    return -1;
+}
+
+void io_queue::send(uintptr_t, buffer_chain const&)
+{
+    throw_error(EINVAL, "io_queue::send()");
 }
 
 void io_queue::watch_loop() {
@@ -74,13 +141,17 @@ void io_queue::watch_loop() {
     
     while (!finished)
     {
-        int timeout = run_timers_calculate_timeout();
-        struct timespec tmout = {timeout, 0};
+        // interest changes of the last iteration go to the kernel with the wait
+        int timeout = prepare_wait();
+        struct timespec tmout = {timeout / 1000, (timeout % 1000) * 1000000};
         
-        int new_events = kevent(fd.getfd(), NULL, 0, evList, evListSize, timeout == -1 ? nullptr : &tmout);
+        int new_events = kevent(fd.getfd(), changelist.data(), static_cast<int>(changelist.size()), evList, evListSize, timeout == -1 ? nullptr : &tmout);
+        changelist.clear();
         if (new_events == -1) {
             switch (errno) {
                 case EINTR:
+                case ENOENT:
+                case EBADF:
                     // ignore;
                     break;
                 default:
@@ -89,40 +160,20 @@ void io_queue::watch_loop() {
             }
             continue;
         }
-        for (size_t i = 0; i < new_events && !finished; i++) {
-            if (evList[i].ident != -1) {
-                std::pair<uintptr_t, int16_t> event(evList[i].ident, evList[i].filter);
-                if (events_handlers.find(event) != events_handlers.end()) {
-                    funct_t funct = events_handlers.at(event);
-                    funct(evList[i]);
-                    if (deleted_events.size() != 0) {
-                        for (size_t j = i; j < new_events; j++) {
-                            for (size_t k = 0; k < deleted_events.size(); k++) {
-                                if (std::make_pair(evList[j].ident, evList[j].filter) == deleted_events[k]) {
-                                    evList[j].ident = -1;
-                                }
-                            }
-                        }
-                        while (!deleted_events.empty()) {
-                            deleted_events.pop_back();
-                        }
-                    }
-                }
+
+        // failed changes come back as EV_ERROR events; deleting a filter of
+        // an already closed descriptor is expected
+        int count = 0;
+        for (int i = 0; i < new_events; i++) {
+            if (evList[i].flags & EV_ERROR) {
+                if (evList[i].data != ENOENT && evList[i].data != EBADF)
+                    throw_error(static_cast<int>(evList[i].data), "kevent(changelist)");
+                continue;
             }
+            if (evList[i].filter == EVFILT_USER && evList[i].ident == wakeup_ident)
+                continue; // posted tasks run after dispatch
+            evList[count++] = evList[i];
         }
+        dispatch(evList, count);
     }
 }
-
-int io_queue::run_timers_calculate_timeout()
-{
-    if (timer.empty())
-        return -1;
-    
-    timer::clock_t::time_point now = timer::clock_t::now();
-    timer.notify(now);
-    
-    if (timer.empty())
-        return -1;
-    
-    return std::chrono::duration_cast<std::chrono::seconds>(timer.top() - now).count();
-}
\ No newline at end of file
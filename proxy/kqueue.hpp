@@ -10,38 +10,248 @@
 #define kqueue_hpp
 
 #include <sys/types.h>
-#include <sys/event.h>
+#include <atomic>
+#include <deque>
+#include <functional>
 #include <map>
+#include <memory>
 #include <vector>
 
+#if defined(PROXY_IO_EPOLL)
+#include "epoll.hpp"
+#else
+#include <sys/event.h>
+#endif
+
+#include "buffer.hpp"
 #include "file_descriptor.h"
+#include "metrics.hpp"
+#include "task_queue.hpp"
 #include "timer.h"
 
 typedef std::function<void(struct kevent)> funct_t;
 
+#if defined(PROXY_IO_URING)
+#include <sys/socket.h>
+
+struct uring;
+struct io_uring_cqe;
+#endif
+
+// io_uring: the I/O of connections is submitted to a ring and completes
+// there, readiness of the other descriptors comes from poll requests on it
+enum class io_backend { native, io_uring };
+
+// what the ring does by itself for a descriptor, see io_queue::set_completion()
+enum class completion_kind : uint8_t { none, stream, listener };
+
+struct worker_pool;
+
+// what a descriptor is to its owner, used to group handlers in the metrics
+enum class descriptor_kind : uint8_t { unknown, listener, client, server };
+
+// where the time of a loop goes: handlers and posted tasks run inline on
+// the loop thread, offloaded work on the worker_pool
+struct loop_stats
+{
+    uint64_t batches = 0;
+    std::chrono::nanoseconds inline_time{0};
+    std::atomic<uint64_t> offloaded_tasks{0};
+    std::atomic<uint64_t> offloaded_ns{0};
+};
+
 struct io_queue {
-    
+
     io_queue();
+    explicit io_queue(io_backend backend);
+    ~io_queue();
     io_queue(io_queue const&) = delete;
-    
+
     void add_event_handler(uintptr_t ident, int16_t filter, funct_t funct);
     void add_event_handler(uintptr_t ident, int16_t filter, uint16_t flags, funct_t funct);
     void delete_event_handler(uintptr_t ident, int16_t filter);
+    // forgotten when all handlers of the descriptor are deleted
+    void set_descriptor_kind(uintptr_t ident, descriptor_kind kind);
     void trigger_user_event_handler(uintptr_t ident);
-    
+    // stops reporting the filter of ident while keeping its handler;
+    // resume_events() reports it again right away if it is still ready
+    void pause_events(uintptr_t ident, int16_t filter);
+    void resume_events(uintptr_t ident, int16_t filter);
+    // reports the filter of ident again at the next iteration, without
+    // waiting for the kernel: for an edge-triggered handler that stopped
+    // before the descriptor was drained to let others run
+    void redeliver(uintptr_t ident, int16_t filter);
+
+    // true where the ring does the I/O of the descriptors set to
+    // set_completion(), instead of reporting them ready
+    bool completes_io() const noexcept;
+    // a stream is received from by a multishot receive into provided
+    // buffers: its read handler runs when there are bytes for receive(). It
+    // sends with send(), its write handler runs for the completions only.
+    // A listener accepts with a multishot accept, its read handler runs when
+    // there are connections for accept(). Nothing without completes_io();
+    // forgotten with the handlers of ident
+    void set_completion(uintptr_t ident, completion_kind kind);
+    // the next bytes the ring received from a stream, or a recv() into
+    // input for any other descriptor; the same result as recv()
+    ssize_t receive(uintptr_t ident, read_buffer& input, size_t expected, buffer_slice& part);
+    // the next connection the ring accepted on a listener, the same
+    // result as accept4() with SOCK_NONBLOCK | SOCK_CLOEXEC
+    int accept(uintptr_t ident);
+    // hands bytes to the ring to send on a stream, in linked requests of up
+    // to send_link_size bytes that go out in order. The write handler runs
+    // as each is done with the bytes it sent in data; EV_ERROR and the
+    // errno in fflags when it failed, the links behind it aren't reported.
+    // One call at a time per stream, bytes must stay as they are until sent
+    void send(uintptr_t ident, buffer_chain const& bytes);
+
+    static const size_t send_link_size = 64 * 1024;
+
+    // runs task on the loop thread; may be called from any thread.
+    // Tasks posted between two loop iterations share a single wakeup.
+    // The metrics time each task under its category
+    void post(std::function<void()> task);
+    void post(std::function<void()> task, handler_category category);
+    // runs work on the pool, then continuation on the loop thread; the
+    // queue waits for offloaded work in flight before it is destroyed
+    void offload(worker_pool& pool, std::function<void()> work, std::function<void()> continuation);
+
     void watch_loop();
     void hard_stop(); //other
-    
-    timer& get_timer() noexcept;
-    
+
+    struct timer& get_timer() noexcept;
+    // time of the current loop iteration, refreshed when events are
+    // dispatched and when timers run; cheap enough to call on every I/O
+    ::timer::clock_t::time_point now() const noexcept;
+    loop_stats const& get_stats() const noexcept;
+
+    // histograms of iteration, batch and handler times plus stalls over the
+    // threshold; every loop dumps them to stderr at its next iteration after
+    // request_metrics_dump(), which is async-signal-safe
+    void enable_metrics(std::chrono::nanoseconds stall_threshold);
+    void dump_metrics(std::ostream& out) const;
+    static void request_metrics_dump() noexcept;
+
 private:
+    // interest in a descriptor: what the handlers want and what the kernel
+    // was told; changes are collected and applied right before the next wait
+    struct interest
+    {
+        enum : uint8_t { read = 1, write = 2, edge = 4 };
+
+        uint8_t wanted = 0;
+        uint8_t applied = 0;
+        bool queued = false;
+        uintptr_t applied_generation = 0;
+        uint64_t poll_id = 0; // io_uring only
+    };
+
+#if defined(PROXY_IO_URING)
+    // a descriptor the ring does the I/O of. One multishot receive or accept
+    // at a time, its id stays the same for the registration: what it
+    // completes is kept until the handler takes it, even while paused
+    struct completion
+    {
+        completion(completion_kind kind, uint64_t id, uintptr_t generation);
+        ~completion(); // closes the connections not taken
+
+        completion_kind kind;
+        uint64_t id;
+        uintptr_t generation;
+        bool armed = false;      // until the completion without IORING_CQE_F_MORE
+        bool cancelling = false;
+        bool eof = false;
+        int error = 0;           // reported once what came before it is taken
+        uint64_t reported = 0;   // the completion_pass the read handler was last told in
+        std::deque<buffer_slice> received;
+        std::deque<int> accepted;
+    };
+
+    // a send() the kernel may still read from, it outlives the descriptor
+    struct pending_send
+    {
+        uintptr_t ident;
+        uintptr_t generation;
+        buffer_chain bytes;
+        std::vector<struct iovec> iov;
+        std::vector<struct msghdr> links;
+        size_t completed = 0;   // links
+        bool failed = false;    // the links behind a failed one aren't reported
+        bool cancelled = false;
+    };
+#endif
+
+    // handlers of one descriptor; generation changes every time the slot
+    // becomes empty, i.e. the descriptor is deregistered and may be reused
+    struct handler_slot
+    {
+        std::unique_ptr<funct_t> handlers[3]; // EVFILT_READ, EVFILT_WRITE, EVFILT_USER
+        uintptr_t generation = 0;
+        struct interest interest;
+        descriptor_kind kind = descriptor_kind::unknown;
+#if defined(PROXY_IO_URING)
+        std::unique_ptr<struct completion> completion;
+#endif
+    };
+
+    int prepare_wait(); // runs timers and applies changes, returns the timeout
     int run_timers_calculate_timeout();
-    
-    std::map<std::pair<uintptr_t, int16_t>, funct_t> events_handlers;
+    void dispatch(struct kevent* evList, size_t new_events);
+    void dispatch_event(struct kevent const& event, uint64_t& start);
+    handler_slot& slot(uintptr_t ident);
+    void set_handler(uintptr_t ident, int16_t filter, funct_t funct);
+    void remove_handler(uintptr_t ident, int16_t filter);
+    void queue_change(uintptr_t ident);
+
+    // backend specific
+    void apply_changes();
+    void add_user_event(uintptr_t ident, uint16_t flags);
+    void delete_user_event(uintptr_t ident);
+    void wake_up(); // any thread
+    void wait_for_offloaded();
+
+    std::vector<handler_slot> handlers;
+    std::vector<std::unique_ptr<funct_t>> retired_handlers; // removed while the batch is dispatched
+    std::vector<uintptr_t> changed;
+    std::vector<struct kevent> redelivered; // udata is the generation
     file_descriptor fd;
-    std::vector<std::pair<uintptr_t, int16_t>> deleted_events;
     bool finished = false;
     struct timer timer;
+    task_queue posted;
+    loop_stats stats;
+    std::atomic<size_t> offloaded_in_flight{0};
+    std::unique_ptr<loop_metrics> metrics;
+    uint64_t wake_cycles = 0;
+    unsigned dumps_done = 0;
+    ::timer::clock_t::time_point loop_time = ::timer::clock_t::now();
+
+#if defined(PROXY_IO_EPOLL)
+    size_t make_events(uint64_t data, uint32_t events, struct kevent* evList);
+
+    std::map<uintptr_t, file_descriptor> user_events;
+    file_descriptor wakeup_fd; // eventfd for posted tasks
+#else
+    std::vector<struct kevent> changelist;
+#endif
+#if defined(PROXY_IO_URING)
+    void uring_watch_loop();
+    void uring_arm_user_event(uintptr_t ident, int event_fd);
+    void apply_completion(uintptr_t ident, handler_slot& s);
+    void retire_completion(struct completion& c);
+    // what a completion means for its descriptor, false if nothing to report
+    bool complete_receive(struct io_uring_cqe const& cqe, struct kevent& event);
+    bool complete_send(struct io_uring_cqe const& cqe, struct kevent& event);
+    void provide_buffer(uint16_t id);
+
+    uint32_t request_seq = 0;
+    uint64_t completion_pass = 0; // counts the batches of completions taken
+    // the buffers the kernel receives into, by id; a received one is handed
+    // out as a slice and a new one takes its place
+    std::vector<std::shared_ptr<buffer_storage>> provided;
+    std::map<uint64_t, pending_send> sends;
+    // last: closed before the buffers the kernel may still use go
+    std::unique_ptr<uring> ring;
+#endif
 };
 
 #endif /* kqueue_hpp */
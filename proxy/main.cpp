@@ -5,22 +5,145 @@
 //  Copyright © 2015 Kurkin Dmitry. All rights reserved.
 //
 
+#include <ctype.h>
 #include <signal.h>
+#include <pthread.h>
+#include <stdlib.h>
+#include <string.h>
+#include <algorithm>
+#include <stdexcept>
 #include <iostream>
+#include <string>
+#include <thread>
+#include <vector>
 
 #include "kqueue.hpp"
 #include "proxy.hpp"
 #include "DNSresolver.hpp"
+#include "worker_pool.hpp"
 
-int main()
+namespace
 {
+    struct options
+    {
+        io_backend backend = io_backend::native;
+        size_t threads = 1;
+        size_t workers = 2;
+        bool metrics = false;
+        std::chrono::milliseconds stall_threshold{5};
+        bool pin_cpus = false;
+        size_t prewarm = 0;
+        socket_profiles sockets;
+    };
+
+    // a non-negative number, the whole argument
+    size_t to_count(std::string const& option, std::string const& value)
+    {
+        size_t end = 0;
+        unsigned long result = 0;
+        try {
+            result = std::stoul(value, &end);
+        } catch (std::exception const&) {
+        }
+        if (value.empty() || !isdigit(static_cast<unsigned char>(value[0])) || end != value.size())
+            throw std::invalid_argument("bad value for " + option + ": " + value);
+        return result;
+    }
+
+    void pin_to_cpu(size_t index)
+    {
+#if defined(__linux__)
+        size_t cpus = std::thread::hardware_concurrency();
+        cpu_set_t set;
+        CPU_ZERO(&set);
+        CPU_SET(cpus ? index % cpus : index, &set);
+        int error = pthread_setaffinity_np(pthread_self(), sizeof(set), &set);
+        if (error)
+            std::cout << "can't pin event loop " << index << " to cpu: " << strerror(error) << "\n";
+#else
+        std::cout << "cpu pinning is not supported on this platform\n";
+#endif
+    }
+
+    // one reactor: its own queue, listener, connections, cache and timer;
+    // connections never leave the loop that accepted them
+    void run_event_loop(options const& opts, DNSresolver& resolver, worker_pool& pool, size_t index)
+    {
+        if (opts.pin_cpus)
+            pin_to_cpu(index);
+        try {
+            io_queue queue(opts.backend);
+            if (opts.metrics)
+                queue.enable_metrics(opts.stall_threshold);
+            proxy_server proxy(queue, 2540, resolver, pool, opts.threads > 1, opts.sockets);
+            proxy.prewarm_upstreams(opts.prewarm);
+            queue.watch_loop();
+        } catch (std::runtime_error const& error) {
+            // the other loops would go on with fewer listeners, unnoticed:
+            // one failed loop takes the process down instead
+            std::cout << "event loop " << index << ": " << error.what() << std::endl;
+            _Exit(EXIT_FAILURE);
+        }
+    }
+}
+
+int main(int argc, char* argv[])
+{
+    options opts;
+    try {
+        for (int i = 1; i < argc; i++) {
+            std::string arg = argv[i];
+            if (arg == "--io-uring") {
+                opts.backend = io_backend::io_uring;
+            } else if (arg == "--threads" && i + 1 < argc) {
+                opts.threads = to_count(arg, argv[++i]);
+                if (opts.threads == 0)
+                    opts.threads = std::max(1u, std::thread::hardware_concurrency());
+            } else if (arg == "--workers" && i + 1 < argc) {
+                opts.workers = to_count(arg, argv[++i]);
+                if (opts.workers == 0)
+                    opts.workers = std::max(1u, std::thread::hardware_concurrency());
+            } else if (arg == "--metrics") {
+                opts.metrics = true;
+            } else if (arg == "--stall-ms" && i + 1 < argc) {
+                opts.metrics = true;
+                opts.stall_threshold = std::chrono::milliseconds(to_count(arg, argv[++i]));
+            } else if (arg == "--pin-cpus") {
+                opts.pin_cpus = true;
+            } else if (arg == "--prewarm" && i + 1 < argc) {
+                opts.prewarm = to_count(arg, argv[++i]);
+            } else if (arg == "--sockopt" && i + 1 < argc) {
+                opts.sockets.parse(argv[++i]);
+            } else {
+                std::cout << "usage: " << argv[0] << " [--io-uring] [--threads N (0: one per core)] [--workers N (0: one per core)] [--metrics] [--stall-ms N] [--pin-cpus] [--prewarm N]"
+                          << " [--sockopt listener|client|upstream:OPTION,...]\n"
+                          << "socket options: nodelay, delay, sndbuf=N, rcvbuf=N, keepalive=S, keepintvl=S, keepcnt=N,"
+                          << " backlog=N, defer-accept=S, fastopen[=QUEUE], zerocopy (client only)\n";
+                return 1;
+            }
+        }
+    } catch (std::invalid_argument const& error) {
+        std::cout << error.what() << "\n";
+        return 1;
+    }
+
+    if (opts.metrics) {
+        // each loop prints its metrics to stderr at its next iteration
+        signal(SIGUSR1, [](int) { io_queue::request_metrics_dump(); });
+    }
+
     try {
-        io_queue queue;
         DNSresolver resolver(2);
-        proxy_server proxy(queue, 2540, resolver);
-        queue.watch_loop();
+        worker_pool pool(opts.workers); // shared by all loops, outlives them
+        std::vector<std::thread> loops;
+        for (size_t i = 1; i < opts.threads; i++)
+            loops.push_back(std::thread(run_event_loop, std::cref(opts), std::ref(resolver), std::ref(pool), i));
+        run_event_loop(opts, resolver, pool, 0);
+        for (auto& thread : loops)
+            thread.join();
     } catch (std::runtime_error const& error) {
         std::cout << error.what() << "\n";
+        return 1;
     }
 
     return 0;
@@ -0,0 +1,120 @@
+//
+//  metrics.cpp
+//  proxy
+//
+
+#include <iomanip>
+#include <mutex>
+#include <ostream>
+#include <thread>
+
+#include "metrics.hpp"
+
+namespace
+{
+    char const* const category_names[loop_metrics::category_count] = {
+        "accept", "client read", "server read", "write", "timer", "dns", "completion", "other"
+    };
+
+    double const quantiles[] = {0.5, 0.9, 0.99, 0.999};
+    char const* const quantile_names[] = {"p50", "p90", "p99", "p99.9"};
+
+    void print_row(std::ostream& out, char const* name, histogram const& h, double scale)
+    {
+        out << "  " << std::left << std::setw(14) << name << std::right
+            << std::setw(10) << h.count();
+        for (double q : quantiles)
+            out << std::setw(10) << h.quantile(q) / scale;
+        out << std::setw(10) << h.maximum() / scale << "\n";
+    }
+}
+
+histogram::histogram()
+{
+    for (size_t i = 0; i < bucket_count; i++)
+        counts[i] = 0;
+}
+
+uint64_t histogram::highest_in(size_t index) noexcept
+{
+    if (index < sub_count)
+        return index;
+    size_t shift = (index - sub_count) / sub_count;
+    uint64_t sub = (index - sub_count) % sub_count;
+    uint64_t lowest = (uint64_t(1) << (shift + sub_bits)) | (sub << shift);
+    return lowest + ((uint64_t(1) << shift) - 1);
+}
+
+uint64_t histogram::quantile(double q) const noexcept
+{
+    if (total == 0)
+        return 0;
+    uint64_t rank = static_cast<uint64_t>(q * total);
+    if (rank >= total)
+        rank = total - 1;
+    uint64_t seen = 0;
+    for (size_t i = 0; i < bucket_count; i++) {
+        seen += counts[i];
+        if (seen > rank)
+            return highest_in(i) < max ? highest_in(i) : max;
+    }
+    return max;
+}
+
+double cycles_per_ns()
+{
+    static double rate = 1;
+    static std::once_flag once;
+    std::call_once(once, []() {
+        auto start = std::chrono::steady_clock::now();
+        uint64_t start_cycles = read_cycles();
+        std::this_thread::sleep_for(std::chrono::milliseconds(10));
+        uint64_t cycles = read_cycles() - start_cycles;
+        auto ns = std::chrono::duration_cast<std::chrono::nanoseconds>(std::chrono::steady_clock::now() - start).count();
+        if (ns > 0 && cycles > 0)
+            rate = static_cast<double>(cycles) / ns;
+    });
+    return rate;
+}
+
+loop_metrics::loop_metrics(std::chrono::nanoseconds stall_threshold)
+    : stall_cycles(static_cast<uint64_t>(stall_threshold.count() * cycles_per_ns()))
+{}
+
+void loop_metrics::record_stall(handler_category category, uintptr_t ident, uint64_t cycles) noexcept
+{
+    recent[stalls % stall_history] = stall{category, ident, cycles, std::chrono::system_clock::now()};
+    stalls++;
+}
+
+void loop_metrics::dump(std::ostream& out) const
+{
+    double per_us = cycles_per_ns() * 1000;
+
+    out << "  " << std::left << std::setw(14) << "" << std::right << std::setw(10) << "count";
+    for (char const* name : quantile_names)
+        out << std::setw(10) << name;
+    out << std::setw(10) << "max" << "\n";
+
+    out << std::fixed << std::setprecision(1);
+    print_row(out, "iteration us", iteration, per_us);
+    print_row(out, "events", batch_events, 1);
+    out << "  handlers, us\n";
+    for (size_t i = 0; i < category_count; i++) {
+        if (handlers[i].count() != 0)
+            print_row(out, category_names[i], handlers[i], per_us);
+    }
+
+    out << "  stalls over " << stall_cycles / per_us / 1000 << " ms: " << stalls << "\n";
+    auto now = std::chrono::system_clock::now();
+    size_t shown = stalls < stall_history ? stalls : stall_history;
+    for (size_t i = 0; i < shown; i++) {
+        stall const& s = recent[(stalls - shown + i) % stall_history];
+        auto ago = std::chrono::duration_cast<std::chrono::milliseconds>(now - s.when);
+        out << "    " << category_names[static_cast<size_t>(s.category)];
+        if (s.ident != 0)
+            out << " of " << s.ident;
+        out << ": " << s.cycles / per_us / 1000 << " ms, " << ago.count() / 1000.0 << " s ago\n";
+    }
+    out << std::defaultfloat;
+}
@@ -0,0 +1,128 @@
+//
+//  metrics.hpp
+//  proxy
+//
+//  Event loop instrumentation: log-linear (HDR style) histograms of loop
+//  iteration time, events per batch and handler time per category, and a
+//  stall detector that remembers the handlers that ran for too long.
+//
+//  Durations are taken from the cpu cycle counter, a few ns per reading,
+//  and converted to nanoseconds only when the metrics are dumped.
+//
+
+#ifndef metrics_hpp
+#define metrics_hpp
+
+#include <stdint.h>
+#include <stddef.h>
+#include <chrono>
+#include <iosfwd>
+
+inline uint64_t read_cycles() noexcept
+{
+#if defined(__x86_64__) || defined(__i386__)
+    return __builtin_ia32_rdtsc();
+#elif defined(__aarch64__)
+    uint64_t value;
+    asm volatile("mrs %0, cntvct_el0" : "=r"(value));
+    return value;
+#else
+    return std::chrono::duration_cast<std::chrono::nanoseconds>(
+        std::chrono::steady_clock::now().time_since_epoch()).count();
+#endif
+}
+
+// counts of values in buckets of 1/16 of their power of two: record() is
+// a couple of instructions, quantiles are within 6.25% of the exact value
+struct histogram
+{
+    histogram();
+
+    void record(uint64_t value) noexcept
+    {
+        counts[index_of(value)]++;
+        total++;
+        if (value > max)
+            max = value;
+    }
+
+    uint64_t count() const noexcept { return total; }
+    uint64_t maximum() const noexcept { return max; }
+    // upper bound of the bucket holding the q-th quantile, q in [0, 1]
+    uint64_t quantile(double q) const noexcept;
+
+private:
+    static const unsigned sub_bits = 4;
+    static const unsigned sub_count = 1u << sub_bits;
+    static const size_t bucket_count = sub_count + (64 - sub_bits) * sub_count;
+
+    static size_t index_of(uint64_t value) noexcept
+    {
+        if (value < sub_count)
+            return static_cast<size_t>(value);
+        unsigned msb = 63 - __builtin_clzll(value);
+        unsigned shift = msb - sub_bits;
+        return sub_count + shift * sub_count + ((value >> shift) & (sub_count - 1));
+    }
+    static uint64_t highest_in(size_t index) noexcept;
+
+    uint64_t counts[bucket_count];
+    uint64_t total = 0;
+    uint64_t max = 0;
+};
+
+enum class handler_category : uint8_t
+{
+    accept,
+    client_read,
+    server_read,
+    write,
+    timer,
+    dns,        // resolved addresses posted back to the loop
+    completion, // other tasks posted to the loop, e.g. offload continuations
+    other
+};
+
+struct loop_metrics
+{
+    static const size_t category_count = static_cast<size_t>(handler_category::other) + 1;
+    static const size_t stall_history = 16;
+
+    struct stall
+    {
+        handler_category category;
+        uintptr_t ident;
+        uint64_t cycles;
+        std::chrono::system_clock::time_point when;
+    };
+
+    explicit loop_metrics(std::chrono::nanoseconds stall_threshold);
+
+    // start and end are read_cycles() values of one callback; ident is the
+    // descriptor, 0 for timers and posted tasks
+    void handler_done(handler_category category, uintptr_t ident, uint64_t start, uint64_t end) noexcept
+    {
+        uint64_t cycles = end - start;
+        handlers[static_cast<size_t>(category)].record(cycles);
+        if (cycles > stall_cycles)
+            record_stall(category, ident, cycles);
+    }
+
+    void dump(std::ostream& out) const;
+
+    histogram iteration;       // cycles from the end of one wait to the start of the next
+    histogram batch_events;    // events per wait
+    histogram handlers[category_count];
+    uint64_t stalls = 0;
+
+private:
+    void record_stall(handler_category category, uintptr_t ident, uint64_t cycles) noexcept;
+
+    uint64_t stall_cycles;
+    stall recent[stall_history];
+};
+
+// cycle counter ticks per nanosecond, measured once per process
+double cycles_per_ns();
+
+#endif /* metrics_hpp */
@@ -7,85 +7,316 @@
 //
 
 #include "new_http_handler.hpp"
+#include "http_scan.hpp"
 #include <algorithm>
+#include <string.h>
+
+namespace
+{
+    char lower(char c) noexcept
+    {
+        return c >= 'A' && c <= 'Z' ? c - 'A' + 'a' : c;
+    }
+
+    text_view trim(char const* begin, char const* end) noexcept
+    {
+        while (begin != end && (*begin == ' ' || *begin == '\t'))
+            begin++;
+        while (end != begin && (end[-1] == ' ' || end[-1] == '\t'))
+            end--;
+        return text_view(begin, end - begin);
+    }
+
+    // "HTTP/1.0" or "HTTP/1.1", false on anything else
+    bool parse_version(text_view text, unsigned& minor) noexcept
+    {
+        if (text.size != 8 || memcmp(text.data, "HTTP/1.", 7) != 0 || (text.data[7] != '0' && text.data[7] != '1'))
+            return false;
+        minor = text.data[7] - '0';
+        return true;
+    }
+
+    // digits only, false on anything else or on overflow
+    bool parse_length(text_view text, uint64_t& value) noexcept
+    {
+        if (text.empty())
+            return false;
+        value = 0;
+        for (size_t i = 0; i < text.size; i++) {
+            char c = text.data[i];
+            if (c < '0' || c > '9' || value > (UINT64_MAX - 9) / 10)
+                return false;
+            value = value * 10 + (c - '0');
+        }
+        return true;
+    }
+}
+
+text_view::text_view(char const* text)
+    : data(text)
+    , size(strlen(text))
+{}
+
+bool text_view::operator==(text_view other) const noexcept
+{
+    return size == other.size && (size == 0 || memcmp(data, other.data, size) == 0);
+}
+
+bool text_view::equals_nocase(text_view other) const noexcept
+{
+    if (size != other.size)
+        return false;
+    for (size_t i = 0; i < size; i++) {
+        if (lower(data[i]) != lower(other.data[i]))
+            return false;
+    }
+    return true;
+}
+
+std::ostream& operator<<(std::ostream& out, text_view text)
+{
+    return out.write(text.data, text.size);
+}
 
 http::~http() {}
 
 void http::add_part(std::string const& part)
 {
-    text.append(part);
-    update_state();
+    add_part(buffer_slice(part));
 }
 
-void http::update_state()
+void http::add_part(buffer_slice part)
 {
-    if (state == DEF && text.find("\r\n") != std::string::npos) {
-        state = FIRST_LINE;
-        parse_first_line();
-    }
-    if (state == FIRST_LINE && (body_start == 0 || body_start == std::string::npos)) {
-        body_start = text.find("\r\n\r\n");
-    }
-    if (state == FIRST_LINE && body_start != std::string::npos && body_start != 0) {
-        state = FULL_HEADERS;
-        body_start += 4;
-        parse_headers();
+    if (part.empty())
+        return;
+    size_t body_from = 0; // where the body starts in this part
+    while (state == DEF) {
+        // the scan goes on where the last part left it, "\r\n\r\n" may be
+        // split between parts
+        char const* data = part.data() + body_from;
+        size_t left = part.size() - body_from;
+        size_t end = http_scan().find_head_end(data, left, head_tail);
+        // in one part or in several
+        if (partial_head.size() + (end == 0 ? left : end) > max_head) {
+            state = BAD;
+            message.append(std::move(part));
+            return;
+        }
+        if (end == 0) {
+            partial_head.append(data, left);
+            thread_buffer_stats().copied += left;
+            message.append(std::move(part));
+            return;
+        }
+        if (partial_head.empty()) {
+            head = part.sub(body_from, end);
+        } else {
+            partial_head.append(data, end);
+            head = buffer_slice(partial_head);
+            std::string().swap(partial_head);
+        }
+        body_from += end;
+        body_start = message.size() + body_from;
+        parse_head();
+        if (state == FULL_HEADERS && is_interim()) {
+            // a 100 Continue and the like: the message is the head that follows
+            state = DEF;
+            headers.clear();
+            std::fill(std::begin(known), std::end(known), text_view());
+            head_tail = 0;
+        }
     }
     if (state >= FULL_HEADERS) {
+        if (body_from < part.size())
+            read_body(part.sub(body_from, part.size() - body_from));
         check_body();
     }
+    if (keep_body) {
+        message.append(std::move(part));
+    } else if (body_from != 0) {
+        message.append(part.sub(0, body_from));
+    }
 }
 
-void http::parse_headers()
+void http::parse_head()
 {
-    auto headers_start = std::find_if(text.begin(), text.end(), [](char a) {
-        return a == '\n';
-    })++;
-    auto headers_end = headers_start + 1;
-    
-    while (headers_end != text.end() && *headers_end != '\r')
-    {
-        auto space = std::find_if(headers_end, text.end(), [](char a) { return a == ':'; });
-        auto crlf = std::find_if(space + 1, text.end(), [](char a){ return a == '\r'; });
-        
-        headers.insert({{headers_end, space}, {space + 2, crlf}});
-        headers_end = crlf + 2;
-    };
+    char const* begin = head.data();
+    // found before the "\r\n\r\n" at the end at the latest
+    size_t eol = http_scan().find_either(begin, head.size(), '\r', '\n');
+    if (begin[eol] != '\r' || begin[eol + 1] != '\n') {
+        state = BAD;
+        return;
+    }
+    state = FIRST_LINE;
+    parse_first_line(text_view(begin, eol));
+    if (state == BAD || !parse_headers())
+        return;
+    state = FULL_HEADERS;
 }
 
-std::string const& http::get_header(std::string const& name) const
+bool http::parse_headers()
 {
-    if (headers.find(name) != headers.end())
-        return headers.at(name);
-    return empty_header;
+    scan_kernels const& scan = http_scan();
+    char const* end = head.data() + head.size() - 2; // before the empty line
+    char const* line = head.data() + scan.find_either(head.data(), head.size(), '\n', '\n') + 1;
+    // one allocation for most heads
+    headers.reserve(16);
+    while (line < end) {
+        // the name is a token right up to the colon: no folded lines, no
+        // space before the colon
+        char const* colon = line + scan.token_length(line, end - line);
+        if (colon == line || colon == end || *colon != ':') {
+            state = BAD;
+            return false;
+        }
+        // a bare '\n' ends no line
+        char const* crlf = colon + scan.find_either(colon, end - colon, '\r', '\n');
+        if (crlf == end || *crlf != '\r' || crlf[1] != '\n') {
+            state = BAD;
+            return false;
+        }
+        text_view name(line, colon - line);
+        text_view value = trim(colon + 1, crlf);
+        header_id id = find_header(name.data, name.size);
+        headers.push_back(http_header{id, name, value});
+        if (id != header_id::other && !add_known(id, value)) {
+            state = BAD;
+            return false;
+        }
+        line = crlf + 2;
+    }
+
+    // decided once, the body parts only move the counters
+    if (!has_body())
+        return true;
+    text_view length = get_header(header_id::content_length);
+    text_view encoding = get_header(header_id::transfer_encoding);
+    if (length.data != nullptr && encoding.data != nullptr) {
+        // each side of the proxy could find a different end (RFC 9112 6.3)
+        state = BAD;
+        return false;
+    }
+    if (length.data != nullptr) {
+        if (!parse_length(length, content_length)) {
+            state = BAD;
+            return false;
+        }
+        body_framing = framing::length;
+        body_length = content_length;
+    } else if (encoding.equals_nocase("chunked")) {
+        body_framing = framing::chunked;
+    } else if (ends_at_close()) {
+        body_framing = framing::close;
+    }
+    return true;
 }
 
-void http::check_body()
+bool http::add_known(header_id id, text_view value)
 {
-    size_t length = text.size() - body_start;
-    
-    if (get_header("Content-Length") != "")
-    {
-        if (length == static_cast<size_t>(std::stoi(get_header("Content-Length")))) {
-            state = FULL_BODY;
-        } else {
-            state = PARTICAL_BODY;
-        }
+    text_view& first = known[static_cast<size_t>(id)];
+    if (first.data == nullptr) {
+        first = value;
+        return true;
     }
-    else if (get_header("Transfer-Encoding") == "chunked")
-    {
-        if (std::string(text.end() - 7, text.end()) == "\r\n0\r\n\r\n") {
-            state = FULL_BODY;
-        } else {
-            state = PARTICAL_BODY;
-        }
+    // a second one, each side of the proxy could go by a different one
+    switch (id) {
+        case header_id::host:
+        case header_id::transfer_encoding:
+            return false;
+        case header_id::content_length:
+            return first == value;
+        default:
+            return true;
     }
-    else if (length == 0)
-    {
-        state = FULL_BODY;
-    } else {
-        state = BAD;
+}
+
+text_view http::get_header(text_view name) const
+{
+    header_id id = find_header(name.data, name.size);
+    if (id != header_id::other)
+        return get_header(id);
+    for (auto const& header : headers) {
+        if (header.id == header_id::other && header.name.equals_nocase(name))
+            return header.value;
     }
+    return text_view();
+}
+
+void http::read_body(buffer_slice part)
+{
+    uint64_t before = body_received;
+    body_received += part.size();
+    if (body_framing == framing::length && keep_content && before < content_length) {
+        // without whatever the peer sent after the body
+        content.append(part.sub(0, static_cast<size_t>(std::min<uint64_t>(part.size(), content_length - before))));
+        return;
+    }
+    if (body_framing != framing::chunked || chunks.get_status() != chunked_decoder::status::more)
+        return;
+    size_t used = 0;
+    chunked_decoder::status status = keep_content
+        ? chunks.feed(part, used, [this](buffer_slice data) { content.append(std::move(data)); })
+        : chunks.feed(part, used);
+    if (status == chunked_decoder::status::done)
+        body_length = before + used;
+}
+
+void http::check_body()
+{
+    switch (body_framing) {
+        case framing::length:
+            state = body_received >= content_length ? FULL_BODY : PARTICAL_BODY;
+            break;
+        case framing::chunked:
+            switch (chunks.get_status()) {
+                case chunked_decoder::status::done:
+                    state = FULL_BODY;
+                    break;
+                case chunked_decoder::status::bad:
+                    state = BAD;
+                    break;
+                case chunked_decoder::status::more:
+                    state = PARTICAL_BODY;
+                    break;
+            }
+            break;
+        case framing::none:
+            state = body_received == 0 ? FULL_BODY : BAD;
+            break;
+        case framing::close:
+            // complete at end_of_input(), whatever came so far
+            state = PARTICAL_BODY;
+            break;
+    }
+}
+
+void http::end_of_input()
+{
+    if (body_framing != framing::close || state != PARTICAL_BODY)
+        return;
+    body_length = body_received;
+    state = FULL_BODY;
+}
+
+void http::discard_body()
+{
+    if (!keep_body || body_start == 0)
+        return;
+    keep_body = false;
+    message = message.prefix(body_start);
+    content = buffer_chain();
+}
+
+request::request(std::string const& text)
+    : request(buffer_slice(text))
+{}
+
+request::request(buffer_slice part)
+{
+    // the body isn't kept as received, it's forwarded as it arrives, see take_body()
+    keep_body = false;
+    keep_content = true;
+    add_part(std::move(part));
 }
 
 std::string request::get_URI()
@@ -97,37 +328,35 @@ std::string request::get_URI()
 
 std::string request::get_host()
 {
-    if (method == "CONNECT")
+    if (method == http_method::CONNECT)
         return URI;
     if (host == "")
-        host = get_header("Host");
-    if (host == "")
-        host = get_header("host");
+        host = get_header(header_id::host).str();
     if (host == "")
         throw std::runtime_error("empty host");
     return host;
 }
 
-void request::parse_first_line()
+void request::parse_first_line(text_view line)
 {
-    auto first_space = std::find(text.begin(), text.end(), ' ');
-    auto second_space = std::find_if(first_space + 1, text.end(), [](char a) { return a == ' '; });
-    auto crlf = std::find_if(second_space + 1, text.end(), [](char a) { return a == '\r'; });
-    
-    if (first_space == text.end() || second_space == text.end() || crlf == text.end()) {
+    scan_kernels const& scan = http_scan();
+    char const* end = line.data + line.size;
+    char const* first_space = line.data + scan.token_length(line.data, line.size);
+    if (first_space == line.data || first_space == end || *first_space != ' ') {
         state = BAD;
         return;
     }
-    
-    method = {text.begin(), first_space};
-    URI = {first_space + 1, second_space};
-    http_version = {second_space + 1, crlf};
-    
-    if (URI == "") {
+    char const* second_space = first_space + 1 + scan.find_either(first_space + 1, end - first_space - 1, ' ', ' ');
+    if (second_space == end) {
         state = BAD;
         return;
     }
-    if (http_version != "HTTP/1.1" && http_version != "HTTP/1.0") {
+
+    method_name = text_view(line.data, first_space - line.data);
+    method = find_method(method_name.data, method_name.size);
+    URI.assign(first_space + 1, second_space);
+
+    if (URI == "" || !parse_version(text_view(second_space + 1, end - second_space - 1), version_minor)) {
         state = BAD;
         return;
     }
@@ -135,61 +364,126 @@ void request::parse_first_line()
 
 std::string request::get_request_text() const
 {
-    std::string first_line;
-    if (method == "CONNECT") {
-        first_line = method + " " + host + URI + " " + http_version + "\r\n";
-    } else {
-        first_line = method + " " + URI + " " + http_version + "\r\n";
+    std::string text;
+    text.reserve(head.size());
+    text.append(method_name.data, method_name.size);
+    text.append(" ");
+    if (method == http_method::CONNECT)
+        text.append(host);
+    text.append(URI);
+    text.append(version_minor == 0 ? " HTTP/1.0\r\n" : " HTTP/1.1\r\n");
+    for (auto const& header : headers) {
+        if (header.id == header_id::proxy_connection)
+            continue; // todo: drop hop-by-hop headers
+        text.append(header.name.data, header.name.size);
+        text.append(": ");
+        text.append(header.value.data, header.value.size);
+        text.append("\r\n");
     }
-    std::string headers = "";
-    for (auto it : this->headers) {
-        if (it.first != "Proxy-Connection")
-            headers.append(it.first + ": " + it.second + "\r\n"); // todo: drop hop-by-hop headers
+    text.append("\r\n");
+    return text;
+}
+
+buffer_chain request::take_body()
+{
+    buffer_chain body;
+    if (body_framing == framing::chunked) {
+        // sizes with leading zeros, extensions and the like could be read
+        // differently by the origin, it gets plain chunks. Trailers are
+        // dropped, as a recipient that removes the coding may (RFC 9110 6.5.1)
+        append_chunk(body, content);
+        if (state == FULL_BODY && !last_chunk_taken) {
+            append_last_chunk(body);
+            last_chunk_taken = true;
+        }
+    } else {
+        body = std::move(content);
     }
-    headers += "\r\n";
-    
-    return first_line + headers + text.substr(body_start);
+    content = buffer_chain();
+    return body;
 }
 
 bool request::is_validating() const
 {
-    return  get_header("If-Match") != ""
-            || get_header("If-Modified-Since") != ""
-            || get_header("If-None-Match") != ""
-            || get_header("If-Range") != ""
-            || get_header("If-Unmodified-Since") != "";
+    return  !get_header(header_id::if_match).empty()
+            || !get_header(header_id::if_modified_since).empty()
+            || !get_header(header_id::if_none_match).empty()
+            || !get_header(header_id::if_range).empty()
+            || !get_header(header_id::if_unmodified_since).empty();
 }
 
 bool response::is_cacheable() const
 {
-    return state == FULL_BODY
-           && get_header("ETag") != ""
-           && get_header("Vary") == ""
-           && get_code() == "200";
+    return state == FULL_BODY && may_be_cacheable();
+}
+
+bool response::may_be_cacheable() const
+{
+    // a Content-Length over the limit is known before the body arrives
+    uint64_t size = body_start + std::max(body_received, body_framing == framing::length ? content_length : 0);
+    return state >= FULL_HEADERS
+           && keep_body
+           && size <= max_cacheable
+           && status == http_status::ok
+           && !get_header(header_id::etag).empty()
+           && get_header(header_id::vary).empty();
+}
+
+bool response::is_interim() const
+{
+    // 101 ends the HTTP part of the connection
+    unsigned code = static_cast<unsigned>(status);
+    return code >= 100 && code < 200 && status != http_status::switching_protocols;
+}
+
+bool response::has_body() const
+{
+    // 1xx, 204 and 304 (RFC 9112 6.3); a response to HEAD isn't told apart
+    // here, it waits for a body and its connection isn't reused
+    unsigned code = static_cast<unsigned>(status);
+    return code >= 200 && status != http_status::no_content && status != http_status::not_modified;
+}
+
+bool response::keeps_alive() const
+{
+    if (body_framing == framing::close)
+        return false;
+    text_view connection = get_header(header_id::connection);
+    if (version_minor == 0)
+        return connection.equals_nocase("keep-alive");
+    return !connection.equals_nocase("close");
 }
 
 request* response::get_validating_request(std::string URI, std::string host) const
 {
-    return new request{"GET " + URI + " HTTP/1.1\r\nIf-None-Match: " + get_header("ETag") + "\r\nHost: " + host + "\r\n\r\n"};
+    return new request{"GET " + URI + " HTTP/1.1\r\nIf-None-Match: " + get_header(header_id::etag).str() + "\r\nHost: " + host + "\r\n\r\n"};
 }
 
-void response::parse_first_line()
+void response::parse_first_line(text_view line)
 {
-    auto first_space = std::find_if(text.begin(), text.end(), [](char a) { return a == ' '; });
-    auto second_space = std::find_if(first_space + 1, text.end(), [](char a) { return a == ' '; });
-    auto crlf = std::find_if(second_space + 1, text.end(), [](char a) { return a == '\r'; });
-    
-    if (first_space == text.end() || second_space == text.end() || crlf == text.end()) {
+    scan_kernels const& scan = http_scan();
+    char const* end = line.data + line.size;
+    char const* first_space = line.data + scan.find_either(line.data, line.size, ' ', ' ');
+    char const* second_space = first_space == end ? end : first_space + 1 + scan.find_either(first_space + 1, end - first_space - 1, ' ', ' ');
+
+    if (first_space == end) {
         state = BAD;
         return;
     }
-    
-    http_version = {text.begin(), first_space};
-    code = {first_space + 1, second_space};
-    code_description = {second_space + 1, crlf};
-    
-    if (http_version != "HTTP/1.1" && http_version != "HTTP/1.0") {
+
+    // three digits; the reason phrase may be missing, "HTTP/1.1 204"
+    char const* code = first_space + 1;
+    if (second_space - code != 3 || !parse_version(text_view(line.data, first_space - line.data), version_minor)) {
         state = BAD;
         return;
     }
-}
\ No newline at end of file
+    unsigned value = 0;
+    for (int i = 0; i < 3; i++) {
+        if (code[i] < '0' || code[i] > '9') {
+            state = BAD;
+            return;
+        }
+        value = value * 10 + (code[i] - '0');
+    }
+    status = static_cast<http_status>(value);
+}
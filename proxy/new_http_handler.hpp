@@ -10,68 +10,166 @@
 #define new_http_handler_hpp
 
 #include <iostream>
-#include <map>
 #include <string>
+#include <vector>
+
+#include "buffer.hpp"
+#include "chunked.hpp"
+#include "http_types.hpp"
 
 enum STATE { DEF, BAD, FIRST_LINE, FULL_HEADERS, PARTICAL_BODY, FULL_BODY};
 
+// a piece of a parsed message head, pointing into the buffer it was
+// received in: valid as long as the message, or a copy of it, is
+struct text_view
+{
+    text_view() = default;
+    text_view(char const* data, size_t size) : data(data), size(size) {}
+    text_view(char const* text);
+    
+    bool empty() const noexcept { return size == 0; }
+    std::string str() const { return std::string(data, size); }
+    bool operator==(text_view other) const noexcept;
+    bool operator!=(text_view other) const noexcept { return !(*this == other); }
+    // header names and some values compare case-insensitively
+    bool equals_nocase(text_view other) const noexcept;
+    
+    char const* data = nullptr;
+    size_t size = 0;
+};
+
+std::ostream& operator<<(std::ostream& out, text_view text);
+
+struct http_header
+{
+    header_id id; // other for the names the proxy doesn't know
+    text_view name;
+    text_view value;
+};
+
+// parses as the parts of a message arrive: nothing received is looked at
+// twice, and a head that comes in one part isn't copied. The body is
+// followed by its framing to the exact end
 struct http
 {
-    http(std::string text) : text(std::move(text)) {}
+    // a head that hasn't ended by then isn't one
+    static const size_t max_head = 64 * 1024;
+
+    http() = default;
+    http(http const&) = default;
+    http(http&&) = default;
+    http& operator=(http const&) = default;
+    http& operator=(http&&) = default;
     virtual ~http() = 0;
     void add_part(std::string const&);
+    void add_part(buffer_slice part);
     
     int get_state() { return state; };
-    std::string const& get_header(std::string const&) const;
-    std::string get_body() const { return text.substr(body_start); }
-    std::string get_text() const { return text; }
+    // empty when there is no such header; the first one of several
+    text_view get_header(header_id id) const noexcept { return known[static_cast<size_t>(id)]; }
+    // case-insensitive, a linear search for unknown names
+    text_view get_header(text_view name) const;
+    std::string get_body() const { return message.to_string(body_start); }
+    std::string get_text() const { return message.to_string(); }
+    buffer_chain const& get_message() const { return message; }
+    size_t get_size() const { return message.size(); }
+    // bytes were received past the end of the complete message
+    bool has_excess() const noexcept { return state == FULL_BODY && body_received > body_length; }
+    // the body is only counted from now on, not kept: for a message that
+    // is relayed as it arrives and needn't be looked at later
+    void discard_body();
+    // the peer closed the connection: that ends a body without framing
+    void end_of_input();
     
 protected:
-    void update_state();
+    // close: the body goes on until the connection is closed
+    enum class framing { none, length, chunked, close };
+    
+    void parse_head();
+    bool parse_headers();
+    bool add_known(header_id id, text_view value);
+    void read_body(buffer_slice part);
     void check_body();
-    void parse_headers();
-    virtual void parse_first_line() = 0;
+    virtual void parse_first_line(text_view line) = 0;
+    // responses to some requests have no body, whatever their headers say
+    virtual bool has_body() const { return true; }
+    // without a length or chunks: a request has no body, a response's
+    // ends with the connection
+    virtual bool ends_at_close() const { return false; }
+    // a head that only comes before the message, 1xx responses
+    virtual bool is_interim() const { return false; }
 
     STATE state = DEF;
-    size_t body_start = 0;
-    std::string text;
-    std::map<std::string, std::string> headers;
-    std::string empty_header = ""; // remove
+    size_t body_start = 0;  // offset of the body in message, 0 until the head is complete
+    buffer_chain message;   // the message as received, see discard_body()
+    uint32_t head_tail = 0; // last four bytes scanned, to find the end of the head
+    std::string partial_head; // the head so far, when it doesn't come in one part
+    buffer_slice head;      // the complete head, the headers point into it
+    std::vector<http_header> headers; // in their order, to be forwarded
+    text_view known[known_header_count]; // by header_id, data is null when there is none
+    unsigned version_minor = 1; // HTTP/1.x
+    framing body_framing = framing::none;
+    uint64_t content_length = 0;
+    uint64_t body_received = 0; // after the head, including any excess
+    uint64_t body_length = 0;   // with its framing, known once the message is complete
+    bool keep_body = true;
+    chunked_decoder chunks;
+    bool keep_content = false;  // the body's data goes to content
+    buffer_chain content;       // the data received and not taken yet, without chunked framing
 };
 
 struct request : public http
 {
-    request(std::string text) : http(std::move(text)) { update_state(); };
+    request(std::string const& text);
+    request(buffer_slice part);
     
-    std::string get_method() const { return method; }
+    http_method get_method() const noexcept { return method; }
     std::string get_URI();
     std::string get_host();
+    // the head as it goes to the origin
     std::string get_request_text() const;
+    // the body received since the last call, framed for the origin: as it
+    // came with a Content-Length, as plain chunks when chunked
+    buffer_chain take_body();
+    // bytes received for take_body()
+    size_t get_pending_size() const noexcept { return content.size(); }
     
     bool is_validating() const;
     
 private:
-    void parse_first_line() override;
+    void parse_first_line(text_view line) override;
 
-    std::string method;
+    http_method method = http_method::other;
+    text_view method_name;  // as received, other methods are forwarded as they are
     std::string URI;
-    std::string http_version;
     std::string host = "";
+    bool last_chunk_taken = false;
 };
 
 struct response : public http
 {
-    response(std::string text) : http(std::move(text)) { update_state(); };
+    // a bigger response isn't cached, its body only passes through
+    static const size_t max_cacheable = 1024 * 1024;
+
+    response(std::string const& text) { add_part(text); }
+    response(buffer_slice part) { add_part(std::move(part)); }
     bool is_cacheable() const;
-    std::string get_code() const { return code; }
+    // what the head and the size so far say of is_cacheable(), before the
+    // body is complete; false from the time the body is discarded
+    bool may_be_cacheable() const;
+    // the origin leaves the connection open after this response, which
+    // it can't when the response ends with the connection
+    bool keeps_alive() const;
+    http_status get_status() const noexcept { return status; }
     request* get_validating_request(std::string URI, std::string host) const;
     
 private:
-    void parse_first_line() override;
+    void parse_first_line(text_view line) override;
+    bool has_body() const override;
+    bool ends_at_close() const override { return true; }
+    bool is_interim() const override;
     
-    std::string code;
-    std::string code_description;
-    std::string http_version;
+    http_status status = http_status::none;
 };
 
 #endif /* new_http_handler_hpp */
@@ -7,6 +7,7 @@
 //
 
 #include <assert.h>
+#include <string.h>
 #include <sys/errno.h>
 
 #include "proxy.hpp"
@@ -15,51 +16,89 @@
 
 namespace
 {
-    void write_some(tcp_client& dest, io_queue& queue, int ident)
+    constexpr const timer::clock_t::duration timeout = std::chrono::seconds(120);
+    // responses from this size on are handed to the cache off the loop thread
+    constexpr const size_t offload_size = 64 * 1024;
+    // bytes one read event may take before the other descriptors get their turn
+    constexpr const size_t read_budget = 256 * 1024;
+    // connections one listener event may accept
+    constexpr const size_t accept_budget = 64;
+    // how long the listener rests while there is no descriptor for accept()
+    constexpr const std::chrono::milliseconds accept_retry_delay(100);
+
+    struct cache_candidate
     {
-        if (dest.msg_queue.empty()) {
-            queue.delete_event_handler(ident, EVFILT_WRITE);
-            return;
-        }
-        write_part part = dest.msg_queue.front();
-        dest.msg_queue.pop_front();
-        size_t writted = ::write(ident, part.get_part_text(), part.get_part_size());
-        if (writted == -1) {
-            if (errno != EPIPE) {
-                throw_error(errno, "write()");
-            } else {
-                if (part.get_part_size() != 0) {
-                    dest.msg_queue.push_front(part); // no strong exception guarantee
-                }
-            }
-        } else {
-            part.writted += writted;
-            if (part.get_part_size() != 0) {
-                dest.msg_queue.push_front(part);
-            }
-        }
-    }
+        std::string key;
+        std::unique_ptr<struct response> response;
+    };
 
-    constexpr const timer::clock_t::duration timeout = std::chrono::seconds(120);
+    // a slice pins the whole receive block it points into, up to 256 KiB for
+    // a response of a few: what the cache keeps gets a block of its own
+    response compacted(response const& received)
+    {
+        response copy(received.get_message().flatten());
+        // all of it was received, a body that ends with the connection too
+        copy.end_of_input();
+        return copy;
+    }
 }
 
-proxy_server::proxy_server(io_queue& queue, int port, DNSresolver& resolver): server(server_socket(port)), queue(queue), resolver(resolver), cache(10000)
+proxy_server::proxy_server(io_queue& queue, int port, DNSresolver& resolver, worker_pool& pool): proxy_server(queue, port, resolver, pool, false)
+{}
+
+proxy_server::proxy_server(io_queue& queue, int port, DNSresolver& resolver, worker_pool& pool, bool reuse_port): proxy_server(queue, port, resolver, pool, reuse_port, socket_profiles())
+{}
+
+proxy_server::proxy_server(io_queue& queue, int port, DNSresolver& resolver, worker_pool& pool, bool reuse_port, socket_profiles const& sockets): server(server_socket(port, reuse_port, sockets.listener)), queue(queue), resolver(resolver), pool(pool), sockets(sockets), cache(10000), upstreams(queue, sockets.upstream)
 {
     server.bind_and_listen();
 
-    funct_t connect_client = [this](struct kevent event) {
-        std::unique_ptr<proxy_tcp_connection> cc(new proxy_tcp_connection(*this, this->queue, tcp_client(client_socket(server))));
-        proxy_tcp_connection* pcc = cc.get();
-        connections.emplace(pcc, std::move(cc));
-        
-        pcc->set_client_on_read_write(
-            [pcc](struct kevent event)
-            { pcc->client_on_read(event); },
-            [pcc](struct kevent event)
-            { pcc->client_on_write(event); });
+    funct_t connect_client = [this](struct kevent) {
+        // the listener is level-triggered: what is left past the budget is
+        // reported again by the next wait
+        for (size_t i = 0; i < accept_budget; i++) {
+            client_socket socket;
+            try {
+                if (!server.accept(this->queue, this->sockets.client, socket)) {
+                    // the backlog isn't drained: a level-triggered listener
+                    // would report it again at once, over and over
+                    if (server.starved()) {
+                        this->queue.pause_events(server.getfd(), EVFILT_READ);
+                        accept_retry.restart(this->queue.get_timer(), accept_retry_delay);
+                    }
+                    return;
+                }
+            } catch (std::runtime_error const& error) {
+                std::cout << error.what() << "\n";
+                continue;
+            }
+            if (socket.getfd() == -1)
+                continue;
+            tcp_client client(std::move(socket));
+            // the ring sends from the write queue, the kernel doesn't pin it
+            if (this->sockets.client.zero_copy && !this->queue.completes_io())
+                client.enable_zero_copy();
+            std::unique_ptr<proxy_tcp_connection> cc(new proxy_tcp_connection(*this, this->queue, std::move(client)));
+            proxy_tcp_connection* pcc = cc.get();
+            connections.emplace(pcc, std::move(cc));
+            
+            pcc->set_client_on_read_write(
+                [pcc](struct kevent event)
+                { pcc->client_on_read(event); },
+                [pcc](struct kevent event)
+                { pcc->client_on_write(event); });
+        }
+        // what the ring accepted past the budget is reported by nothing else
+        if (this->queue.completes_io())
+            this->queue.redeliver(server.getfd(), EVFILT_READ);
     };
 
+    accept_retry.set_callback([this]() {
+        this->queue.resume_events(server.getfd(), EVFILT_READ);
+    });
     queue.add_event_handler(server.getfd(), EVFILT_READ, connect_client);
+    queue.set_descriptor_kind(server.getfd(), descriptor_kind::listener);
+    queue.set_completion(server.getfd(), completion_kind::listener);
 }
 
 proxy_server::~proxy_server()
@@ -67,36 +106,52 @@ proxy_server::~proxy_server()
     queue.delete_event_handler(server.getfd(), EVFILT_READ);
 }
 
+void proxy_server::prewarm_upstreams(size_t spare)
+{
+    upstreams.set_prewarm(spare);
+}
+
 proxy_server::proxy_tcp_connection::proxy_tcp_connection(proxy_server& proxy, io_queue& queue, tcp_client client)
     : tcp_connection(queue, std::move(client))
-    , timer(this->queue.get_timer(), timeout, [this, &proxy]() {
-        std::cout << "timeout for " << get_client_socket() << "\n";
-        proxy.connections.erase(this);
-    })
+    , connecting(queue, proxy.connects)
+    , last_activity(this->queue.now())
+    , timer(this->queue.get_timer(), timeout, [this]() { on_idle_timer(); })
     , proxy(proxy)
+{}
+
+proxy_server::proxy_tcp_connection::~proxy_tcp_connection()
 {
-    queue.add_event_handler(get_client_socket(), EVFILT_USER, EV_CLEAR, [this](struct kevent event)
-                            { on_resolver_hostname(event); });
+    response.reset();
+    count_retained();
 }
 
-proxy_server::proxy_tcp_connection::~proxy_tcp_connection()
+void proxy_server::proxy_tcp_connection::mark_active() noexcept
 {
-    queue.delete_event_handler(get_client_socket(), EVFILT_USER);
+    last_activity = queue.now();
 }
 
-std::string proxy_server::proxy_tcp_connection::get_host() const noexcept
+void proxy_server::proxy_tcp_connection::on_idle_timer()
 {
-    return request->get_host();
+    // the timer is armed once per idle period instead of on every read and
+    // write: when it fires for an active connection it is pushed forward
+    timer::clock_t::time_point deadline = last_activity + timeout;
+    if (deadline > queue.now()) {
+        timer.restart(queue.get_timer(), deadline);
+        return;
+    }
+    std::cout << "timeout for " << get_client_socket() << "\n";
+    proxy.connections.erase(this);
 }
 
-void proxy_server::proxy_tcp_connection::set_client_addr(const sockaddr& addr)
+std::string proxy_server::proxy_tcp_connection::get_host() const noexcept
 {
-    client_addr = addr;
+    return request->get_host();
 }
 
-void proxy_server::proxy_tcp_connection::set_client_addr(const sockaddr&& addr)
+void proxy_server::proxy_tcp_connection::set_server_addresses(std::vector<sockaddr_storage> const& addresses)
 {
-    client_addr = std::move(addr);
+    server_addresses = addresses;
+    proxy.connects.order(server_addresses, queue.now());
 }
 
 void proxy_server::proxy_tcp_connection::connect_to_server()
@@ -106,19 +161,47 @@ void proxy_server::proxy_tcp_connection::connect_to_server()
         {
             std::cout << "keep-alive is working!\n";
             try_to_cache();
-            response.release();
-            response = nullptr;
+            response.reset();
+            count_retained();
             URI = request->get_URI();
+            on_server_ready();
             return;
         } else {
             deregistrate(server);
+            server = tcp_client();
         }
     }
-    
-    server = tcp_client(client_socket(client_addr));
     host = request->get_host();
     URI = request->get_URI();
- 
+    
+    // a tunnel can't be retried on a fresh connection, it never takes one
+    // from the pool, and neither does a request whose body is still arriving
+    client_socket pooled;
+    if (request->get_method() != http_method::CONNECT && request->get_state() == FULL_BODY)
+        pooled = proxy.upstreams.acquire(server_addresses, client_addr);
+    server_reused = pooled.getfd() != -1;
+    if (server_reused) {
+        std::cout << "upstream pool is working! " << pooled.getfd() << "\n";
+        attach_server(std::move(pooled));
+        on_server_ready();
+        return;
+    }
+    connecting.start(server_addresses, proxy.sockets.upstream, [this](client_socket socket, sockaddr_storage const& addr)
+    {
+        if (socket.getfd() == -1) {
+            send(get_client_socket(), "HTTP/1.1 502 Bad Gateway\r\nContent-Length: 0\r\nConnection: close\r\n\r\n", strlen("HTTP/1.1 502 Bad Gateway\r\nContent-Length: 0\r\nConnection: close\r\n\r\n"), MSG_NOSIGNAL);
+            proxy.connections.erase(this);
+            return;
+        }
+        client_addr = addr;
+        attach_server(std::move(socket));
+        on_server_ready();
+    });
+}
+
+void proxy_server::proxy_tcp_connection::attach_server(client_socket socket)
+{
+    server = tcp_client(std::move(socket));
     set_server_on_read_write(
         [this](struct kevent event)
         { server_on_read(event); },
@@ -134,120 +217,321 @@ void proxy_server::proxy_tcp_connection::client_on_read(struct kevent event)
         proxy.connections.erase(this);
     } else
     {
-        timer.restart(queue.get_timer(), timeout);
-        char buff[event.data];
+        mark_active();
         
         std::cout << "read request of " << event.ident << "\n";
         
-        size_t size = read(get_client_socket() , buff, event.data);
-        if (size == static_cast<size_t>(-1)) {
-            throw_error(errno, "read()");
-        }
-    
-        if (request) {
-            request->add_part({buff, size});
-        } else {
-            request.reset(new struct request({buff, size}));
-        }
-        
-        if (request->get_state() == BAD)
+        read_status status = read_available(client, event.data, client_input, [this](buffer_slice const& part)
         {
-            send(get_client_socket(), "HTTP/1.1 400 Bad Request\r\n\r\n", strlen("HTTP/1.1 400 Bad Request\r\n\r\n"), 0);
-            proxy.connections.erase(this);
-            return;
-        }
-        
-        if (request->get_state() == FULL_BODY)
-        {
-            std::cout << "push to resolve " << get_host() << request->get_URI() << "\n";
-            state = proxy.resolver.resolve(get_host(), [this](struct sockaddr addr)
+            bool had_head = false;
+            if (request) {
+                had_head = request->get_state() >= FULL_HEADERS;
+                request->add_part(part);
+            } else {
+                request.reset(new struct request(part));
+            }
+            
+            if (request->get_state() == BAD)
             {
-                // mutex??
-                set_client_addr(addr);
-                queue.trigger_user_event_handler(get_client_socket());
-            });
+                send(get_client_socket(), "HTTP/1.1 400 Bad Request\r\n\r\n", strlen("HTTP/1.1 400 Bad Request\r\n\r\n"), MSG_NOSIGNAL);
+                proxy.connections.erase(this);
+                return false;
+            }
+            
+            if (streaming_body)
+            {
+                // the origin may have answered and closed before the end of the body
+                buffer_chain body = request->take_body();
+                if (get_server_socket() != -1)
+                    write_to_server(body);
+                if (request->get_state() == FULL_BODY) {
+                    streaming_body = false;
+                    request.reset();
+                }
+                return true;
+            }
+            
+            if (!had_head && request->get_state() >= FULL_HEADERS)
+            {
+                // the origin is looked up and connected while the body arrives
+                std::cout << "push to resolve " << get_host() << request->get_URI() << "\n";
+                state = proxy.resolver.resolve(get_host(), queue, [this](std::vector<sockaddr_storage> const& addresses)
+                {
+                    set_server_addresses(addresses);
+                    on_resolver_hostname();
+                });
+            }
+            // until then the body waits in the request, up to the watermark
+            if (request && !client.paused && request->get_pending_size() >= high_watermark)
+            {
+                client.paused = true;
+                thread_buffer_stats().pauses++;
+                queue.pause_events(get_client_socket(), EVFILT_READ);
+            }
+            return true;
+        });
+        if (status == read_status::eof) {
+            std::cout << "EOF from " << event.ident << " client\n";
+            proxy.connections.erase(this);
         }
     }
 }
 
 void proxy_server::proxy_tcp_connection::client_on_write(struct kevent event)
 {
-    timer.restart(queue.get_timer(), timeout);
-    write_some(client, queue, event.ident);
+    mark_active();
+    write_some(client, event);
 }
 
 void proxy_server::proxy_tcp_connection::server_on_write(struct kevent event)
 {
-    timer.restart(queue.get_timer(), timeout);
-    write_some(server, queue, event.ident);
+    mark_active();
+    write_some(server, event);
 }
 
 void proxy_server::proxy_tcp_connection::server_on_read(struct kevent event)
 {
-    if (event.flags & EV_EOF && event.data == 0) {
-        std::cout << "EV_EOF from " << event.ident << " server\n";
-        try_to_cache();
-        deregistrate(server);
-        server = client_socket();
-    } else {
-        timer.restart(queue.get_timer(), timeout);
-        char buff[event.data];
-        size_t size = recv(get_server_socket(), buff, event.data, 0);
-        if (size == -1) {
-            if (errno == EAGAIN) {
-                return;
-            } else {
-                throw_error(errno, "recv()");
-            }
-        }
+    // with an eof there may still be data: the read finds out which comes first
+    mark_active();
+    read_status status = read_available(server, event.data, server_input, [this](buffer_slice const& part)
+    {
+        // a reused connection is past the quick acks of its handshake: an
+        // origin writing the head and the body separately would have the
+        // body held back by Nagle until our delayed ack
+        if (server_reused)
+            server.ack_now();
+        // the response and the client's write queue share the bytes
         if (response == nullptr) {
-            response.reset(new struct response({buff,size}));
+            response.reset(new struct response(part));
         } else {
-            response->add_part({buff, size});
+            response->add_part(part);
         }
-        write_to_client({buff, size});
+        write_to_client(part);
+        // a body the cache won't take only passes through, and so does
+        // one that turns out too big for it
+        if (!response->may_be_cacheable())
+            response->discard_body();
+        count_retained();
+        // the end of the response, not the eof, decides when the connection is free
+        if (response->get_state() == FULL_BODY && release_server())
+            return false;
+        return true;
+    });
+    // with EV_CLEAR the eof is reported only once, possibly together with the last data
+    if (status == read_status::eof || (status == read_status::drained && (event.flags & EV_EOF))) {
+        server_closed();
     }
 }
 
+void proxy_server::proxy_tcp_connection::server_closed()
+{
+    std::cout << "EV_EOF from " << get_server_socket() << " server\n";
+    if (server_reused && response == nullptr && !retry_request.empty()) {
+        // the origin closed the idle connection before it got the request
+        std::cout << "pooled upstream was closed, reconnecting\n";
+        deregistrate(server);
+        server_reused = false;
+        try {
+            server = tcp_client(client_socket(client_addr, proxy.sockets.upstream));
+        } catch (std::runtime_error const& error) {
+            std::cout << error.what() << "\n";
+            proxy.connections.erase(this);
+            return;
+        }
+        set_server_on_read_write(
+            [this](struct kevent event)
+            { server_on_read(event); },
+            [this](struct kevent event)
+            { server_on_write(event); });
+        write_to_server(retry_request);
+        retry_request.clear();
+        return;
+    }
+    if (response)
+        response->end_of_input();
+    try_to_cache();
+    deregistrate(server);
+    server = client_socket();
+}
+
+bool proxy_server::proxy_tcp_connection::release_server()
+{
+    // bytes past the end of the response were never asked for
+    if (!response->keeps_alive() || response->has_excess())
+        return false;
+    // an origin may answer early, e.g. a 413 to a body still being uploaded:
+    // the rest of the request would be read as the next one. Such a
+    // connection is closed, what the client still sends of the body is dropped
+    bool forwarded = !streaming_body && server.msg_queue.empty();
+    try_to_cache();
+    response.reset();
+    count_retained();
+    retry_request.clear();
+    deregistrate(server);
+    if (forwarded) {
+        std::cout << "upstream " << get_server_socket() << " back to the pool\n";
+        proxy.upstreams.release(client_addr, std::move(server.socket));
+    } else {
+        std::cout << "upstream " << get_server_socket() << " closed, answered before the whole request was sent\n";
+    }
+    server = tcp_client();
+    return true;
+}
+
 void proxy_server::proxy_tcp_connection::CONNECT_on_read(struct kevent event)
 {
-    if (event.flags & EV_EOF && event.data == 0) {
+    mark_active();
+    bool from_client = static_cast<uintptr_t>(get_client_socket()) == event.ident;
+    read_status status = read_available(from_client ? client : server, event.data, from_client ? client_input : server_input, [this, from_client](buffer_slice const& part)
+    {
+        if (from_client) {
+            write_to_server(part);
+        } else {
+            write_to_client(part);
+        }
+        return true;
+    });
+    if (status == read_status::eof || (status == read_status::drained && (event.flags & EV_EOF))) {
+        half_closed(from_client ? client : server);
+    }
+}
+
+void proxy_server::proxy_tcp_connection::CONNECT_on_write(tcp_client& dest, struct kevent const& event)
+{
+    mark_active();
+    write_some(dest, event);
+    if (peer_of(dest).eof && dest.msg_queue.empty())
+        half_closed(peer_of(dest));
+}
+
+void proxy_server::proxy_tcp_connection::half_closed(tcp_client& from)
+{
+    from.eof = true;
+    queue.delete_event_handler(from.get_socket(), EVFILT_READ);
+    tcp_client& to = peer_of(from);
+    if (to.msg_queue.empty())
+        shutdown(to.get_socket(), SHUT_WR);
+    if (client.eof && server.eof && client.msg_queue.empty() && server.msg_queue.empty())
         proxy.connections.erase(this);
-    } else {
-        timer.restart(queue.get_timer(), timeout);
-        char buff[event.data];
-        size_t size = recv(event.ident, buff, event.data, 0);
+}
+
+proxy_server::proxy_tcp_connection::read_status
+proxy_server::proxy_tcp_connection::read_available(tcp_client& source, size_t expected, read_buffer& input, std::function<bool(buffer_slice const&)> const& on_part)
+{
+    int fd = source.get_socket();
+    size_t budget = read_budget;
+    for (;;) {
+        buffer_slice part;
+        ssize_t size = queue.receive(fd, input, expected, part);
+        if (size == 0)
+            return read_status::eof;
         if (size == -1) {
-            if (errno == EAGAIN) {
-                return;
-            } else {
-                throw_error(errno, "recv()");
-            }
+            if (errno == EAGAIN)
+                return read_status::drained;
+            if (errno == EINTR)
+                continue;
+            // a reset ends the stream like a FIN, without the rest
+            if (is_peer_error(errno))
+                return read_status::eof;
+            throw_error(errno, "recv()");
         }
-        if (get_client_socket() == event.ident) {
-            write_to_server({buff, size});
-        } else {
-            write_to_client({buff, size});
+        // the connection may be gone once on_part says stop
+        if (!on_part(part))
+            return read_status::stopped;
+        if (source.paused)
+            return read_status::paused;
+        if (static_cast<size_t>(size) >= budget) {
+            // edge-triggered: nothing new would be reported for the rest
+            queue.redeliver(fd, EVFILT_READ);
+            return read_status::more;
         }
+        budget -= size;
+        expected = expected > static_cast<size_t>(size) ? expected - size : 0;
     }
 }
 
-void proxy_server::proxy_tcp_connection::on_resolver_hostname(struct kevent event)
+bool proxy_server::proxy_tcp_connection::start_splice_tunnel()
+{
+#if defined(__linux__)
+    // bytes queued for userspace writes would be overtaken by the pipes, and
+    // so would the ones the ring received already
+    if (!client.msg_queue.empty() || !server.msg_queue.empty() || queue.completes_io())
+        return false;
+    try {
+        to_server.reset(new splice_relay());
+        to_client.reset(new splice_relay());
+    } catch (std::runtime_error const& error) {
+        std::cout << error.what() << ", tunneling by copy\n";
+        to_server.reset();
+        to_client.reset();
+        return false;
+    }
+    // readable source and writable destination both move the same direction
+    set_client_on_read_write(
+                             [this](struct kevent)
+                             { splice_ready(*to_server, client, server); },
+                             [this](struct kevent)
+                             { splice_ready(*to_client, server, client); });
+    set_server_on_read_write(
+                             [this](struct kevent)
+                             { splice_ready(*to_client, server, client); },
+                             [this](struct kevent)
+                             { splice_ready(*to_server, client, server); });
+    // whatever the client sent before the handlers were replaced
+    splice_ready(*to_server, client, server);
+    return true;
+#else
+    return false;
+#endif
+}
+
+#if defined(__linux__)
+void proxy_server::proxy_tcp_connection::splice_ready(splice_relay& relay, tcp_client& from, tcp_client& to)
+{
+    mark_active();
+    // the direction is over, the other one may not be
+    if (from.eof)
+        return;
+    switch (relay.pump(from.get_socket(), to.get_socket())) {
+        case splice_relay::result::drained:
+            queue.delete_event_handler(to.get_socket(), EVFILT_WRITE);
+            break;
+        case splice_relay::result::blocked:
+            queue.add_event_handler(to.get_socket(), EVFILT_WRITE, EV_CLEAR, to.on_write);
+            break;
+        case splice_relay::result::finished:
+            queue.delete_event_handler(to.get_socket(), EVFILT_WRITE);
+            half_closed(from);
+            break;
+        case splice_relay::result::failed:
+            proxy.connections.erase(this);
+            break;
+    }
+}
+#endif
+
+void proxy_server::proxy_tcp_connection::on_resolver_hostname()
 {
     std::cout << "host resolved \n";
     connect_to_server();
-    if (request->get_method() == "CONNECT" ) {
+}
+
+void proxy_server::proxy_tcp_connection::on_server_ready()
+{
+    if (request->get_method() == http_method::CONNECT) {
         write_to_client("HTTP/1.1 200 Connection established\r\n\r\n");
+        if (start_splice_tunnel())
+            return;
         set_client_on_read_write(
                                  [this](struct kevent event)
                                  { CONNECT_on_read(event); },
                                  [this](struct kevent event)
-                                 { client_on_write(event); });
+                                 { CONNECT_on_write(client, event); });
         set_server_on_read_write(
                                  [this](struct kevent event)
                                  { CONNECT_on_read(event); },
                                  [this](struct kevent event)
-                                 { server_on_write(event); });
+                                 { CONNECT_on_write(server, event); });
     } else {
         make_request();
     }
@@ -255,58 +539,61 @@ void proxy_server::proxy_tcp_connection::on_resolver_hostname(struct kevent even
 
 void proxy_server::proxy_tcp_connection::make_request()
 {
-    if (!request->is_validating() && proxy.cache.contain(request->get_host() + request->get_URI())) {
+    bool revalidating = false;
+    // a request with a body is the origin's to answer
+    if (request->get_method() == http_method::GET && request->get_state() == FULL_BODY && request->get_pending_size() == 0
+        && !request->is_validating() && proxy.cache.contain(request->get_host() + request->get_URI())) {
         std::cout << "cache is working! for " << get_client_socket() << "\n";
+        revalidating = true;
         const struct response& cache_response =  proxy.cache.get(request->get_host() + request->get_URI());
         request.reset(cache_response.get_validating_request(request->get_URI(), request->get_host()));
         set_server_on_read_write([this, cache_response](struct kevent event){
-            if (event.flags & EV_EOF && event.data == 0) {
-                std::cout << "EV_EOF from " << event.ident << " server\n";
-                try_to_cache();
-                deregistrate(server);
-                server = client_socket();
-            } else {
-                timer.restart(queue.get_timer(), timeout);
-                char buff[event.data];
-                size_t size = recv(get_server_socket(), buff, event.data, 0);
-                if (size == -1) {
-                    if (errno == EAGAIN) {
-                        return;
-                    } else {
-                        throw_error(errno, "recv()");
-                    }
-                }
+            mark_active();
+            read_status status = read_available(server, event.data, server_input, [this, &cache_response](buffer_slice const& part)
+            {
                 if (response == nullptr) {
-                    response.reset(new struct response({buff,size}));
+                    response.reset(new struct response(part));
                 } else {
-                    response->add_part({buff, size});
+                    response->add_part(part);
                 }
-                if (response->get_state() >= FIRST_LINE) {
-                    if (response->get_code() != "200") {
-                        std::cout << "Not modified " << response->get_code() << "\n";
-                        write_to_client(cache_response.get_text());
-                        set_server_on_read_write(
-                                                 [this](struct kevent event)
-                                                 {  if (event.flags & EV_EOF && event.data == 0) {
-                                                        deregistrate(server);
-                                                        server = client_socket();
-                                                    } else {
-                                                        timer.restart(queue.get_timer(), timeout);
-                                                        char buff[event.data];
-                                                        recv(get_server_socket(), buff, event.data, 0);}
-                                                 },
-                                                 [this](struct kevent event)
-                                                 { server_on_write(event); });
-                    } else {
-                        std::cout << "Modified " << response->get_code() << "\n";
-                        write_to_client({buff, size});
-                        set_server_on_read_write(
-                                                 [this](struct kevent event)
-                                                 { server_on_read(event); },
-                                                 [this](struct kevent event)
-                                                 { server_on_write(event); });
-                    }
+                count_retained();
+                if (response->get_state() < FIRST_LINE)
+                    return true;
+                if (response->get_status() != http_status::ok) {
+                    std::cout << "Not modified " << static_cast<unsigned>(response->get_status()) << "\n";
+                    write_to_client(cache_response.get_message());
+                    if (response->get_state() == FULL_BODY && release_server())
+                        return false;
+                    set_server_on_read_write(
+                                             [this](struct kevent event)
+                                             {
+                                                mark_active();
+                                                read_status status = read_available(server, event.data, server_input, [](buffer_slice const&)
+                                                { return true; });
+                                                if (status == read_status::eof || (status == read_status::drained && (event.flags & EV_EOF))) {
+                                                    deregistrate(server);
+                                                    server = client_socket();
+                                                }
+                                             },
+                                             [this](struct kevent event)
+                                             { server_on_write(event); });
+                } else {
+                    std::cout << "Modified " << static_cast<unsigned>(response->get_status()) << "\n";
+                    write_to_client(response->get_message());
+                    if (response->get_state() == FULL_BODY && release_server())
+                        return false;
+                    set_server_on_read_write(
+                                             [this](struct kevent event)
+                                             { server_on_read(event); },
+                                             [this](struct kevent event)
+                                             { server_on_write(event); });
                 }
+                // the rest of the response is for the new handler
+                queue.redeliver(get_server_socket(), EVFILT_READ);
+                return false;
+            });
+            if (status == read_status::eof || (status == read_status::drained && (event.flags & EV_EOF))) {
+                server_closed();
             }
         },
                                 [this](struct kevent event) {
@@ -315,14 +602,58 @@ void proxy_server::proxy_tcp_connection::make_request()
     }
     
     std::cout << "tcp_pair: client: " << get_client_socket() << " server: " << get_server_socket() << "\n";
-    write_to_server(request->get_request_text());
-    request.release();
+    std::string text = request->get_request_text();
+    buffer_chain body = request->take_body();
+    // a revalidation has a handler of its own, only plain requests are
+    // retried; a reused connection only gets complete requests
+    retry_request = server_reused && !revalidating && request->get_state() == FULL_BODY ? text + body.to_string() : std::string();
+    write_to_server(text);
+    write_to_server(body);
+    // the client was paused while its body waited for the connection
+    check_watermarks(server);
+    if (request->get_state() == FULL_BODY) {
+        request.reset();
+    } else {
+        streaming_body = true;
+    }
 }
 
 void proxy_server::proxy_tcp_connection::try_to_cache()
 {
-    if (response != nullptr && response->is_cacheable()) {
-        std::cout << "add to cache: " << host + URI  <<  " " << response->get_header("ETag") << "\n";
-        proxy.cache.put(host + URI, *response);
+    if (response == nullptr)
+        return;
+    if (response->get_size() < offload_size) {
+        if (response->is_cacheable()) {
+            std::cout << "add to cache: " << host + URI  <<  " " << response->get_header("ETag") << "\n";
+            proxy.cache.put(host + URI, compacted(*response));
+        }
+        return;
     }
+
+    // the connection is done with the response: a worker checks it and
+    // frees the ones that can't be cached, the loop only moves it in the cache
+    std::shared_ptr<cache_candidate> candidate(new cache_candidate{host + URI, std::move(response)});
+    count_retained();
+    proxy_server* owner = &proxy;
+    queue.offload(proxy.pool, [candidate]() {
+        if (!candidate->response->is_cacheable())
+            candidate->response.reset();
+        else
+            candidate->response.reset(new struct response(compacted(*candidate->response)));
+    }, [owner, candidate]() {
+        if (candidate->response) {
+            std::cout << "add to cache: " << candidate->key <<  " " << candidate->response->get_header("ETag") << "\n";
+            owner->cache.put(candidate->key, std::move(*candidate->response));
+        }
+    });
+}
+
+void proxy_server::proxy_tcp_connection::count_retained() noexcept
+{
+    size_t size = response ? response->get_size() : 0;
+    buffer_stats& stats = thread_buffer_stats();
+    stats.retained = stats.retained - retained + size;
+    if (stats.retained > stats.retained_peak)
+        stats.retained_peak = stats.retained;
+    retained = size;
 }
\ No newline at end of file
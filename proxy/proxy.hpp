@@ -21,12 +21,16 @@
 #include <arpa/inet.h>
 #include <thread>
 
+#include "connector.hpp"
 #include "kqueue.hpp"
 #include "utils.hpp"
 #include "new_http_handler.hpp"
 #include "throw_error.h"
 #include "DNSresolver.hpp"
 #include "socket.hpp"
+#include "tunnel.hpp"
+#include "upstream_pool.hpp"
+#include "worker_pool.hpp"
 
 uintptr_t const ident = 0x5c0276ef;
 
@@ -40,40 +44,95 @@ private:
     server_socket server;
     io_queue& queue;
     DNSresolver& resolver;
+    worker_pool& pool;
     
+    socket_profiles sockets;
     lru_cache<std::string, response> cache;
+    connect_history connects;
+    upstream_pool upstreams;
+    timer_element accept_retry; // resumes the listener, see server_socket::starved()
     
 public:
-    proxy_server(io_queue& queue, int port, DNSresolver& resolver);
+    proxy_server(io_queue& queue, int port, DNSresolver& resolver, worker_pool& pool);
+    proxy_server(io_queue& queue, int port, DNSresolver& resolver, worker_pool& pool, bool reuse_port);
+    proxy_server(io_queue& queue, int port, DNSresolver& resolver, worker_pool& pool, bool reuse_port, socket_profiles const& sockets);
     ~proxy_server();
+    // see upstream_pool::set_prewarm()
+    void prewarm_upstreams(size_t spare);
 
 private:
     struct proxy_tcp_connection : tcp_connection
     {
+        enum class read_status
+        {
+            drained, // the socket would block
+            more,    // the read budget ran out, the event is redelivered
+            eof,
+            paused,  // the other side has too much to write, see tcp_connection
+            stopped  // on_part asked to stop
+        };
+
         proxy_tcp_connection(proxy_server& proxy, io_queue& queue, tcp_client client);
         ~proxy_tcp_connection();
         
+        void mark_active() noexcept;
+        void on_idle_timer();
         std::string get_host() const noexcept;
-        void set_client_addr(const sockaddr& addr);
-        void set_client_addr(const sockaddr&& addr);
+        void set_server_addresses(std::vector<sockaddr_storage> const& addresses);
+        // an idle pooled connection or the winner of a connect race, then
+        // on_server_ready(); a 502 when the origin can't be reached
         void connect_to_server();
+        void attach_server(client_socket socket);
+        void on_server_ready();
         void client_on_write(struct kevent event);
         void client_on_read(struct kevent event);
         void server_on_write(struct kevent event);
         void server_on_read(struct kevent event);
+        void server_closed();
+        // lets the server connection go when its response is complete: to the
+        // pool, or closed if the request wasn't all sent. False if it is kept
+        // until the origin closes it
+        bool release_server();
         void CONNECT_on_read(struct kevent event);
-        void on_resolver_hostname(struct kevent event);
+        void CONNECT_on_write(tcp_client& dest, struct kevent const& event);
+        // one side of a tunnel sent its FIN: it is passed on once what came
+        // before it is written, the other direction goes on until it ends too
+        void half_closed(tcp_client& from);
+        bool start_splice_tunnel();
+        // reads until the socket would block, calling on_part with every
+        // chunk while it returns true; stops after read_budget bytes so a
+        // busy socket doesn't hold up the rest of the loop
+        read_status read_available(tcp_client& source, size_t expected, read_buffer& input, std::function<bool(buffer_slice const&)> const& on_part);
+#if defined(__linux__)
+        void splice_ready(splice_relay& relay, tcp_client& from, tcp_client& to);
+#endif
+        void on_resolver_hostname();
         void make_request();
         void try_to_cache();
+        // brings thread_buffer_stats().retained up to date with response
+        void count_retained() noexcept;
         
-        std::unique_ptr<response> response;
-        std::unique_ptr<request> request;
+        std::unique_ptr<struct response> response;
+        size_t retained = 0;          // response bytes counted in the stats
+        std::unique_ptr<struct request> request;
         resolve_state state;
         std::string host;
         std::string URI;
-        sockaddr client_addr;
+        std::vector<sockaddr_storage> server_addresses; // in the order to try them
+        sockaddr_storage client_addr;   // the one the server connection goes to
+        connect_race connecting;
+        bool server_reused = false;   // the server connection came from the pool
+        std::string retry_request;    // sent again if a reused connection turns out closed
+        bool streaming_body = false;  // the head went to the origin, the body follows as it arrives
+        ::timer::clock_t::time_point last_activity;
         timer_element timer;
+        read_buffer client_input;
+        read_buffer server_input;
         proxy_server& proxy;
+#if defined(__linux__)
+        std::unique_ptr<splice_relay> to_server;
+        std::unique_ptr<splice_relay> to_client;
+#endif
     };
 };
 
@@ -7,16 +7,140 @@
 //
 
 #include <fcntl.h>
+#include <errno.h>
+#include <limits.h>
 #include <arpa/inet.h>
 #include <iostream>
 #include <sys/types.h>
 #include <sys/socket.h>
+#include <sys/uio.h>
 #include <netdb.h>
 #include <netinet/in.h>
+#include <netinet/tcp.h>
+#include <string.h>
+#include <map>
+#include <memory>
+#if defined(__linux__)
+#include <linux/errqueue.h>
+#endif
 
 #include "socket.hpp"
 #include "throw_error.h"
 
+namespace
+{
+#if defined(IOV_MAX)
+    size_t const max_iov = IOV_MAX;
+#else
+    size_t const max_iov = 1024;
+#endif
+
+#if defined(MSG_ZEROCOPY) && defined(SO_ZEROCOPY) && defined(SO_EE_ORIGIN_ZEROCOPY)
+#define PROXY_ZERO_COPY
+#endif
+
+    // a client that has zero-copy sends in flight when its connection is
+    // closed: the socket stays open, and the bytes pinned, until the kernel
+    // is done with them
+    struct lingering
+    {
+        lingering(tcp_client client);
+
+        tcp_client client;
+        timer_element timer;
+    };
+
+    // the kernel has these to send them, stuck in a dead connection otherwise
+    constexpr const timer::clock_t::duration linger_timeout = std::chrono::seconds(30);
+
+    thread_local std::map<int, std::unique_ptr<lingering>> lingering_clients;
+
+    lingering::lingering(tcp_client client)
+        : client(std::move(client))
+    {}
+
+    void close_lingering(io_queue& queue, int fd)
+    {
+        queue.delete_event_handler(fd, EVFILT_WRITE);
+        lingering_clients.erase(fd);
+    }
+
+    void keep_until_sent(io_queue& queue, tcp_client client)
+    {
+        int fd = client.get_socket();
+        // what wasn't sent yet is dropped as close() would
+        thread_buffer_stats().queued -= client.msg_queue.size();
+        client.msg_queue = buffer_chain();
+        std::unique_ptr<lingering> entry(new lingering(std::move(client)));
+        entry->timer.set_callback([&queue, fd]() {
+            // a reset drops the send queue and whatever the kernel meant to read
+            struct linger abort = {1, 0};
+            setsockopt(fd, SOL_SOCKET, SO_LINGER, &abort, sizeof(abort));
+            close_lingering(queue, fd);
+        });
+        entry->timer.restart(queue.get_timer(), linger_timeout);
+        lingering_clients[fd] = std::move(entry);
+        queue.add_event_handler(fd, EVFILT_WRITE, EV_CLEAR, [&queue, fd](struct kevent) {
+            auto it = lingering_clients.find(fd);
+            if (it == lingering_clients.end())
+                return;
+            if (it->second->client.reap_zero_copy())
+                close_lingering(queue, fd);
+        });
+    }
+
+    // SOCK_NONBLOCK and SOCK_CLOEXEC where socket() and accept4() take them,
+    // otherwise the same with fcntl(); and no SIGPIPE where send() can't say so
+    void prepare(int fd, bool flags_set)
+    {
+#ifdef SO_NOSIGPIPE
+        const int set = 1;
+        if (setsockopt(fd, SOL_SOCKET, SO_NOSIGPIPE, &set, sizeof(set)) == -1) { // NOSIGPIPE FOR SEND
+            throw_error(errno, "setsockopt()");
+        };
+#endif
+        if (flags_set)
+            return;
+        int flags;
+        if (-1 == (flags = fcntl(fd, F_GETFL, 0)))
+            flags = 0;
+        if (fcntl(fd, F_SETFL, flags | O_NONBLOCK) == -1) {
+            throw_error(errno, "fcntl()");
+        }
+        fcntl(fd, F_SETFD, FD_CLOEXEC);
+    }
+}
+
+std::string format_address(sockaddr_storage const& addr)
+{
+    char text[INET6_ADDRSTRLEN];
+    if (addr.ss_family == AF_INET6) {
+        sockaddr_in6 const& in6 = reinterpret_cast<sockaddr_in6 const&>(addr);
+        if (inet_ntop(AF_INET6, &in6.sin6_addr, text, sizeof(text)) == nullptr)
+            text[0] = '\0';
+        return "[" + std::string(text) + "]:" + std::to_string(ntohs(in6.sin6_port));
+    }
+    sockaddr_in const& in = reinterpret_cast<sockaddr_in const&>(addr);
+    if (inet_ntop(AF_INET, &in.sin_addr, text, sizeof(text)) == nullptr)
+        text[0] = '\0';
+    return std::string(text) + ":" + std::to_string(ntohs(in.sin_port));
+}
+
+bool is_peer_error(int error) noexcept
+{
+    switch (error) {
+        case EPIPE:
+        case ECONNRESET:
+        case ECONNREFUSED:
+        case ECONNABORTED:
+        case ETIMEDOUT:
+        case EHOSTUNREACH:
+        case ENETUNREACH:
+            return true;
+    }
+    return false;
+}
+
 client_socket::client_socket() noexcept {};
 
 client_socket::client_socket(client_socket&& other) noexcept
@@ -30,60 +154,125 @@ client_socket& client_socket::operator=(client_socket&& rhs) noexcept
     return *this;
 }
 
-client_socket::client_socket(const server_socket& server)
-{
-    struct sockaddr addr;
-    socklen_t socklen = sizeof(addr);
-    fd = accept(server.getfd(), &addr, &socklen);
-    if (getfd() == -1) {
-        throw_error(errno, "accept()");
-    }
-    
-    const int set = 1;
-    if (setsockopt(getfd(), SOL_SOCKET, SO_NOSIGPIPE, &set, sizeof(set)) == -1) { // NOSIGPIPE FOR SEND
-        throw_error(errno, "setsockopt()");
-    };
-    
-    int flags;
-    if (-1 == (flags = fcntl(getfd(), F_GETFL, 0)))
-        flags = 0;
-    if (fcntl(getfd(), F_SETFL, flags | O_NONBLOCK) == -1) {
-        throw_error(errno, "fcntl()");
-    }
-}
+client_socket::client_socket(int fd) noexcept
+    : fd(fd)
+{}
+
+client_socket::client_socket(sockaddr_storage const& addr): client_socket(addr, socket_profile())
+{}
 
-client_socket::client_socket(const sockaddr addr)
+client_socket::client_socket(sockaddr_storage const& addr, socket_profile const& profile)
 {
-    fd = ::socket(AF_INET, SOCK_STREAM, 0);
+#if defined(SOCK_NONBLOCK)
+    fd = ::socket(addr.ss_family, SOCK_STREAM | SOCK_NONBLOCK | SOCK_CLOEXEC, 0);
+    bool flags_set = true;
+#else
+    fd = ::socket(addr.ss_family, SOCK_STREAM, 0);
+    bool flags_set = false;
+#endif
     if (getfd() == -1) {
         throw_error(errno, "socket()");
     }
-    
-    const int set = 1;
-    if (setsockopt(getfd(), SOL_SOCKET, SO_NOSIGPIPE, &set, sizeof(set)) == -1) { // NOSIGPIPE FOR SEND
-        throw_error(errno, "setsockopt()");
-    };
-    
-    int flags;
-    if (-1 == (flags = fcntl(getfd(), F_GETFL, 0)))
-        flags = 0;
-    if (fcntl(getfd(), F_SETFL, flags | O_NONBLOCK) == -1) {
-        throw_error(errno, "fcntl()");
+    prepare(getfd(), flags_set);
+    // buffer sizes have to be known before the handshake negotiates the window scale
+    profile.apply(getfd());
+#if defined(TCP_FASTOPEN_CONNECT)
+    // connect() returns at once, the SYN goes out with the first write
+    const int fast_open = 1;
+    if (profile.fast_open && setsockopt(getfd(), IPPROTO_TCP, TCP_FASTOPEN_CONNECT, &fast_open, sizeof(fast_open)) == -1) {
+        throw_error(errno, "setsockopt(TCP_FASTOPEN_CONNECT)");
     }
+#endif
     
-    std::cout << "connecting to " << inet_ntoa(((sockaddr_in*) &addr)->sin_addr) << " on sock " << getfd() << "\n";
-    std::cout << "connecting to " << ntohs(((sockaddr_in*) &addr)->sin_port) << " on sock " << getfd() << "\n";
-    if (connect(getfd(),  &addr, sizeof(addr)) < 0) {
+    std::cout << "connecting to " << format_address(addr) << " on sock " << getfd() << "\n";
+    socklen_t length = addr.ss_family == AF_INET6 ? sizeof(sockaddr_in6) : sizeof(sockaddr_in);
+    if (connect(getfd(), reinterpret_cast<sockaddr const*>(&addr), length) < 0) {
         if (errno != EINPROGRESS) {
             throw_error(errno, "connect()");
         }
     }
 }
 
-server_socket::server_socket(int port): port(port) {
+server_socket::server_socket(int port): server_socket(port, false)
+{}
+
+server_socket::server_socket(int port, bool reuse_port): server_socket(port, reuse_port, socket_profile())
+{}
+
+server_socket::server_socket(int port, bool reuse_port, socket_profile const& profile): reserve(open("/dev/null", O_RDONLY | O_CLOEXEC)), port(port), profile(profile) {
+    // non-blocking, so accept() can drain the backlog until EAGAIN
+#if defined(SOCK_NONBLOCK)
+    fd = ::socket(AF_INET, SOCK_STREAM | SOCK_NONBLOCK | SOCK_CLOEXEC, 0);
+    bool flags_set = true;
+#else
     fd = ::socket(AF_INET, SOCK_STREAM, 0);
+    bool flags_set = false;
+#endif
     if (getfd() == -1)
         throw_error(errno, "socket()");
+    prepare(getfd(), flags_set);
+
+    const int set = 1;
+    if (setsockopt(getfd(), SOL_SOCKET, SO_REUSEADDR, &set, sizeof(set)) == -1) { // restart while old connections are in TIME_WAIT
+        throw_error(errno, "setsockopt()");
+    }
+    if (reuse_port && setsockopt(getfd(), SOL_SOCKET, SO_REUSEPORT, &set, sizeof(set)) == -1) { // kernel shards accepts between listeners
+        throw_error(errno, "setsockopt(SO_REUSEPORT)");
+    }
+    profile.apply(getfd());
+#if defined(TCP_FASTOPEN)
+    if (profile.fast_open_queue && setsockopt(getfd(), IPPROTO_TCP, TCP_FASTOPEN, &profile.fast_open_queue, sizeof(profile.fast_open_queue)) == -1) {
+        throw_error(errno, "setsockopt(TCP_FASTOPEN)");
+    }
+#endif
+}
+
+bool server_socket::accept(io_queue& queue, socket_profile const& accepted_profile, client_socket& accepted)
+{
+    // given up and not reopened the last time, some descriptor may be free now
+    if (reserve.getfd() == -1)
+        reserve.reset(open("/dev/null", O_RDONLY | O_CLOEXEC));
+    for (;;) {
+#if defined(SOCK_NONBLOCK)
+        client_socket socket(queue.completes_io() ? queue.accept(getfd()) : accept4(getfd(), nullptr, nullptr, SOCK_NONBLOCK | SOCK_CLOEXEC));
+        bool flags_set = true;
+#else
+        (void)queue; // never completes_io() here
+        client_socket socket(::accept(getfd(), nullptr, nullptr));
+        bool flags_set = false;
+#endif
+        if (socket.getfd() != -1) {
+            prepare(socket.getfd(), flags_set);
+            accepted_profile.apply(socket.getfd());
+            accepted = std::move(socket);
+            return true;
+        }
+        switch (errno) {
+            case EINTR:
+            case ECONNABORTED: // reset while in the backlog
+                continue;
+            case EMFILE:
+            case ENFILE:
+                // the backlog can't be drained without a descriptor: the one
+                // held in reserve takes the connection, which is closed at once
+                // so the client isn't left waiting for a timeout. Without a
+                // reserve the connection stays in the backlog, see starved()
+                if (reserve.getfd() == -1)
+                    return false;
+                reserve.close();
+                ::close(::accept(getfd(), nullptr, nullptr));
+                reserve.reset(open("/dev/null", O_RDONLY | O_CLOEXEC));
+                std::cout << "out of descriptors, connection dropped\n";
+                return true;
+            case EAGAIN:
+#if EWOULDBLOCK != EAGAIN
+            case EWOULDBLOCK:
+#endif
+                return false;
+            default:
+                throw_error(errno, "accept()");
+        }
+    }
 }
 
 void server_socket::bind_and_listen()
@@ -98,9 +287,15 @@ void server_socket::bind_and_listen()
         throw_error(errno, "bind()");
     }
     
-    if (listen(getfd(), SOMAXCONN) != 0) {
+    if (listen(getfd(), profile.backlog) != 0) {
         throw_error(errno, "listen()");
     }
+#if defined(TCP_DEFER_ACCEPT)
+    // the listener isn't woken up until the client has sent its request
+    if (profile.defer_accept && setsockopt(getfd(), IPPROTO_TCP, TCP_DEFER_ACCEPT, &profile.defer_accept, sizeof(profile.defer_accept)) == -1) {
+        throw_error(errno, "setsockopt(TCP_DEFER_ACCEPT)");
+    }
+#endif
 }
 
 tcp_client::tcp_client()
@@ -118,6 +313,47 @@ tcp_client::tcp_client(client_socket socket, on_ready_t on_read, on_ready_t on_w
     , on_write(on_write)
     , socket(std::move(socket)) {}
 
+tcp_client::tcp_client(tcp_client&& other) noexcept
+    : on_read(std::move(other.on_read))
+    , on_write(std::move(other.on_write))
+    , socket(std::move(other.socket))
+    , msg_queue(std::move(other.msg_queue))
+    , sending(other.sending)
+    , paused(other.paused)
+    , eof(other.eof)
+    , zero_copy(other.zero_copy)
+    , pinned(std::move(other.pinned))
+    , zero_copy_sends(other.zero_copy_sends)
+{
+    other.pinned.clear();
+}
+
+tcp_client& tcp_client::operator=(tcp_client&& rhs) noexcept
+{
+    if (this != &rhs) {
+        thread_buffer_stats().queued -= msg_queue.size();
+        unpin(pinned.size());
+        on_read = std::move(rhs.on_read);
+        on_write = std::move(rhs.on_write);
+        socket = std::move(rhs.socket);
+        msg_queue = std::move(rhs.msg_queue);
+        sending = rhs.sending;
+        paused = rhs.paused;
+        eof = rhs.eof;
+        zero_copy = rhs.zero_copy;
+        pinned = std::move(rhs.pinned);
+        rhs.pinned.clear();
+        zero_copy_sends = rhs.zero_copy_sends;
+    }
+    return *this;
+}
+
+tcp_client::~tcp_client()
+{
+    thread_buffer_stats().queued -= msg_queue.size();
+    unpin(pinned.size());
+}
+
 void tcp_client::set_on_read_write(on_ready_t on_read, on_ready_t on_write)
 {
     this->on_read = on_read;
@@ -129,6 +365,146 @@ int tcp_client::get_socket() const noexcept
     return socket.getfd();
 }
 
+bool tcp_client::flush()
+{
+    if (!pinned.empty())
+        reap_zero_copy();
+    struct iovec iov[max_iov];
+    while (!msg_queue.empty()) {
+        struct msghdr msg = {};
+        msg.msg_iov = iov;
+        msg.msg_iovlen = msg_queue.fill_iovec(iov, max_iov);
+        size_t total = 0;
+        for (size_t i = 0; i < msg.msg_iovlen; i++)
+            total += iov[i].iov_len;
+
+        // below the threshold pinning and the completion cost more than the copy
+        bool zero_copy_send = zero_copy && total >= zero_copy_threshold;
+        ssize_t written = send_chunk(msg, zero_copy_send);
+        if (written == -1) {
+            if (errno == EINTR)
+                continue;
+            if (is_peer_error(errno)) {
+                // none of it can be delivered any more, the reader of the
+                // socket finds out about the error too and closes it
+                thread_buffer_stats().queued -= msg_queue.size();
+                msg_queue = buffer_chain();
+                return pinned.empty();
+            }
+            // ENOTCONN: an upstream connect() is still in progress
+            // EINPROGRESS: a Fast Open connect() waits for the handshake
+            if (errno != EAGAIN && errno != ENOTCONN && errno != EINPROGRESS) {
+                throw_error(errno, "sendmsg()");
+            }
+            return false;
+        }
+        if (zero_copy_send && written > 0) {
+            pinned.push_back(pinned_send{zero_copy_sends++, msg_queue.prefix(written)});
+            thread_buffer_stats().zero_copy_sent += written;
+            thread_buffer_stats().pinned += written;
+        }
+        msg_queue.consume(written);
+        thread_buffer_stats().sent += written;
+        thread_buffer_stats().queued -= written;
+
+        // a short write means the socket buffer is full
+        if (static_cast<size_t>(written) < total)
+            return false;
+    }
+    return pinned.empty();
+}
+
+ssize_t tcp_client::send_chunk(struct msghdr const& msg, bool& zero_copy_send)
+{
+    if (zero_copy_send) {
+#if defined(PROXY_ZERO_COPY)
+        ssize_t written = sendmsg(get_socket(), &msg, MSG_NOSIGNAL | MSG_ZEROCOPY);
+        if (written != -1 || errno != ENOBUFS)
+            return written;
+        // out of the memory the kernel pins pages with: copy this time
+#endif
+        zero_copy_send = false;
+    }
+    return sendmsg(get_socket(), &msg, MSG_NOSIGNAL);
+}
+
+bool tcp_client::enable_zero_copy() noexcept
+{
+#if defined(PROXY_ZERO_COPY)
+    int const set = 1;
+    zero_copy = setsockopt(get_socket(), SOL_SOCKET, SO_ZEROCOPY, &set, sizeof(set)) == 0;
+#endif
+    return zero_copy;
+}
+
+bool tcp_client::reap_zero_copy()
+{
+#if defined(PROXY_ZERO_COPY)
+    char control[CMSG_SPACE(sizeof(struct sock_extended_err)) * 4];
+    for (;;) {
+        struct msghdr msg = {};
+        msg.msg_control = control;
+        msg.msg_controllen = sizeof(control);
+        if (recvmsg(get_socket(), &msg, MSG_ERRQUEUE | MSG_DONTWAIT) == -1)
+            break; // EAGAIN: nothing more reported
+        for (struct cmsghdr* cmsg = CMSG_FIRSTHDR(&msg); cmsg != nullptr; cmsg = CMSG_NXTHDR(&msg, cmsg)) {
+            if (!(cmsg->cmsg_level == SOL_IP && cmsg->cmsg_type == IP_RECVERR)
+                && !(cmsg->cmsg_level == SOL_IPV6 && cmsg->cmsg_type == IPV6_RECVERR))
+                continue;
+            struct sock_extended_err err;
+            memcpy(&err, CMSG_DATA(cmsg), sizeof(err));
+            if (err.ee_origin != SO_EE_ORIGIN_ZEROCOPY || err.ee_errno != 0)
+                continue;
+            // ee_info..ee_data are done; TCP completes its sends in order
+            size_t done = 0;
+            while (done < pinned.size() && static_cast<int32_t>(pinned[done].id - err.ee_data) <= 0)
+                done++;
+            unpin(done);
+            if (err.ee_code & SO_EE_CODE_ZEROCOPY_COPIED) {
+                // e.g. over loopback: pinning only adds to the copy here
+                thread_buffer_stats().zero_copy_copied++;
+                zero_copy = false;
+            }
+        }
+    }
+#endif
+    return pinned.empty();
+}
+
+void tcp_client::unpin(size_t count) noexcept
+{
+    for (size_t i = 0; i < count; i++) {
+        thread_buffer_stats().pinned -= pinned.front().bytes.size();
+        pinned.pop_front();
+    }
+}
+
+void tcp_client::ack_now() noexcept
+{
+#if defined(TCP_QUICKACK)
+    int const on = 1;
+    setsockopt(get_socket(), IPPROTO_TCP, TCP_QUICKACK, &on, sizeof(on));
+#endif
+}
+
+void tcp_client::enqueue(buffer_slice part)
+{
+    buffer_stats& stats = thread_buffer_stats();
+    stats.queued += part.size();
+    if (stats.queued > stats.queued_peak)
+        stats.queued_peak = stats.queued;
+    msg_queue.append(std::move(part));
+}
+
+void tcp_client::enqueue(buffer_chain const& message)
+{
+    buffer_stats& stats = thread_buffer_stats();
+    stats.queued += message.size();
+    if (stats.queued > stats.queued_peak)
+        stats.queued_peak = stats.queued;
+    msg_queue.append(message);
+}
+
 tcp_connection::tcp_connection(io_queue& queue, tcp_client client)
     : queue(queue)
     , client(std::move(client))
@@ -136,41 +512,153 @@ tcp_connection::tcp_connection(io_queue& queue, tcp_client client)
     registrate(this->client);
 }
 
+tcp_connection::~tcp_connection()
+{
+    deregistrate(client);
+    if (get_server_socket() != -1)
+        deregistrate(server);
+    if (!client.pinned.empty())
+        keep_until_sent(queue, std::move(client));
+}
+
 void tcp_connection::set_server(tcp_client server)
 {
     this->server = std::move(server);
     registrate(server);
 }
 
-void tcp_connection::write_to_client(std::string text)
+void tcp_connection::write_to_client(std::string const& text)
+{
+    write_to(client, buffer_slice(text));
+}
+
+void tcp_connection::write_to_server(std::string const& text)
+{
+    write_to(server, buffer_slice(text));
+}
+
+void tcp_connection::write_to_client(buffer_slice part)
+{
+    write_to(client, std::move(part));
+}
+
+void tcp_connection::write_to_server(buffer_slice part)
+{
+    write_to(server, std::move(part));
+}
+
+void tcp_connection::write_to_client(buffer_chain const& message)
+{
+    write_to(client, message);
+}
+
+void tcp_connection::write_to_server(buffer_chain const& message)
 {
-    if (client.msg_queue.empty())
+    write_to(server, message);
+}
+
+void tcp_connection::write_to(tcp_client& dest, buffer_slice part)
+{
+    if (dest.msg_queue.empty() && (queue.completes_io() || (dest.zero_copy && part.size() >= tcp_client::zero_copy_threshold)))
+    {
+        // sent from the queue, which keeps the bytes for as long as the kernel needs them
+        dest.enqueue(std::move(part));
+        if (!flush(dest))
+            queue.add_event_handler(dest.get_socket(), EVFILT_WRITE, EV_CLEAR, dest.on_write);
+        check_watermarks(dest);
+        return;
+    }
+    if (dest.msg_queue.empty())
     {
-        size_t written = send(client.get_socket(), text.data(), text.size(), 0);
-        if (written == -1 && errno != ENOTCONN && errno != EAGAIN)
+        ssize_t written = send(dest.get_socket(), part.data(), part.size(), MSG_NOSIGNAL);
+        if (written == -1 && is_peer_error(errno))
+            return; // dropped, as flush() does
+        if (written == -1 && errno != ENOTCONN && errno != EAGAIN && errno != EINPROGRESS)
             throw_error(errno, "send()");
-        if (written != text.size()) {
-            queue.add_event_handler(client.get_socket(), EVFILT_WRITE, client.on_write);
-            client.msg_queue.push_back({text, written == -1 ? 0 : written});
+        if (written > 0) {
+            thread_buffer_stats().sent += written;
+            part.remove_prefix(written);
         }
-    } else {
-        client.msg_queue.push_back({text, 0});
+        if (part.empty())
+            return;
+        queue.add_event_handler(dest.get_socket(), EVFILT_WRITE, EV_CLEAR, dest.on_write);
     }
+    // the queue keeps a reference to the bytes, nothing is copied
+    dest.enqueue(std::move(part));
+    check_watermarks(dest);
 }
 
-void tcp_connection::write_to_server(std::string text)
+void tcp_connection::write_to(tcp_client& dest, buffer_chain const& message)
 {
-    if (server.msg_queue.empty())
-    {
-        size_t written = send(server.get_socket(), text.data(), text.size(), 0);
-        if (written == -1 && errno != ENOTCONN && errno != EAGAIN)
-            throw_error(errno, "send()");
-        if (written != text.size()) {
-            queue.add_event_handler(server.get_socket(), EVFILT_WRITE, server.on_write);
-            server.msg_queue.push_back({text, written == -1 ? 0 : written});
-        }
-    } else {
-        server.msg_queue.push_back({text, 0});
+    bool idle = dest.msg_queue.empty();
+    dest.enqueue(message);
+    if (idle && !flush(dest))
+        queue.add_event_handler(dest.get_socket(), EVFILT_WRITE, EV_CLEAR, dest.on_write);
+    check_watermarks(dest);
+}
+
+bool tcp_connection::flush(tcp_client& dest)
+{
+    if (!queue.completes_io())
+        return dest.flush();
+    // one send at a time keeps the bytes in order, what is queued meanwhile goes next
+    if (dest.sending == 0 && !dest.msg_queue.empty()) {
+        dest.sending = dest.msg_queue.size();
+        queue.send(dest.get_socket(), dest.msg_queue);
+    }
+    return dest.msg_queue.empty();
+}
+
+void tcp_connection::write_some(tcp_client& dest, struct kevent const& event)
+{
+    // with the ring the write handler runs for its completions only
+    if (dest.sending != 0)
+        sent(dest, event);
+    if (flush(dest))
+        queue.delete_event_handler(dest.get_socket(), EVFILT_WRITE);
+    check_watermarks(dest);
+}
+
+void tcp_connection::sent(tcp_client& dest, struct kevent const& event)
+{
+    size_t written = static_cast<size_t>(event.data);
+    dest.msg_queue.consume(written);
+    dest.sending -= written;
+    thread_buffer_stats().sent += written;
+    thread_buffer_stats().queued -= written;
+    if (!(event.flags & EV_ERROR))
+        return;
+    // the rest of the send is given up, the links behind aren't reported
+    dest.sending = 0;
+    int error = static_cast<int>(event.fflags);
+    if (is_peer_error(error)) {
+        // as flush() does
+        thread_buffer_stats().queued -= dest.msg_queue.size();
+        dest.msg_queue = buffer_chain();
+        return;
+    }
+    // EAGAIN: cut short; EINPROGRESS: a Fast Open connect() waits for the
+    // handshake, which the ring waits for the next time: the rest goes again
+    if (error != EAGAIN && error != ENOTCONN && error != EINPROGRESS) {
+        throw_error(error, "sendmsg()");
+    }
+}
+
+tcp_client& tcp_connection::peer_of(tcp_client& side) noexcept
+{
+    return &side == &client ? server : client;
+}
+
+void tcp_connection::check_watermarks(tcp_client& dest)
+{
+    tcp_client& source = peer_of(dest);
+    if (!source.paused && dest.msg_queue.size() >= high_watermark && source.get_socket() != -1) {
+        source.paused = true;
+        thread_buffer_stats().pauses++;
+        queue.pause_events(source.get_socket(), EVFILT_READ);
+    } else if (source.paused && dest.msg_queue.size() <= low_watermark) {
+        source.paused = false;
+        queue.resume_events(source.get_socket(), EVFILT_READ);
     }
 }
 
@@ -198,19 +686,31 @@ void tcp_connection::set_server_on_read_write(on_ready_t on_read, on_ready_t on_
 
 void tcp_connection::registrate(tcp_client &client)
 {
-    queue.add_event_handler(client.get_socket(), EVFILT_READ, client.on_read);
-    if (!client.msg_queue.empty())
-        queue.add_event_handler(client.get_socket(), EVFILT_WRITE, client.on_write);
+    queue.add_event_handler(client.get_socket(), EVFILT_READ, EV_CLEAR, client.on_read);
+    queue.set_completion(client.get_socket(), completion_kind::stream);
+    queue.set_descriptor_kind(client.get_socket(), &client == &this->client ? descriptor_kind::client : descriptor_kind::server);
+    if (client.paused)
+        queue.pause_events(client.get_socket(), EVFILT_READ);
+    if (!client.msg_queue.empty() || !client.pinned.empty())
+        queue.add_event_handler(client.get_socket(), EVFILT_WRITE, EV_CLEAR, client.on_write);
 }
 
 void tcp_connection::deregistrate(tcp_client &client)
 {
     queue.delete_event_handler(client.get_socket(), EVFILT_READ);
     queue.delete_event_handler(client.get_socket(), EVFILT_WRITE);
+    // whatever was waiting to be written to it is gone
+    tcp_client& source = peer_of(client);
+    if (source.paused) {
+        source.paused = false;
+        queue.resume_events(source.get_socket(), EVFILT_READ);
+    }
 }
 
 void tcp_connection::update_registration(tcp_client &client)
 {
-    deregistrate(client);
+    // handlers are replaced in place, io_queue only tells the kernel what actually changed
     registrate(client);
+    if (client.msg_queue.empty() && client.pinned.empty())
+        queue.delete_event_handler(client.get_socket(), EVFILT_WRITE);
 }
@@ -9,21 +9,50 @@
 #ifndef socket_hpp
 #define socket_hpp
 
+#include <deque>
 #include <list>
+#include <string>
+#include <sys/socket.h>
 
+#include "buffer.hpp"
 #include "file_descriptor.h"
 #include "kqueue.hpp"
+#include "socket_options.hpp"
+
+#ifndef MSG_NOSIGNAL
+#define MSG_NOSIGNAL 0 // SO_NOSIGPIPE is set on the socket instead
+#endif
+
+struct client_socket;
+
+// "1.2.3.4:80" or "[::1]:80"
+std::string format_address(sockaddr_storage const& addr);
+// errors of a send or receive that mean the other end is gone: they close
+// the connection, not the event loop
+bool is_peer_error(int error) noexcept;
 
 struct server_socket
 {
     server_socket(int port);
+    server_socket(int port, bool reuse_port); // reuse_port: several listeners share the port
+    server_socket(int port, bool reuse_port, socket_profile const& profile);
     
     int getfd() const noexcept { return fd.getfd(); };
     void bind_and_listen();
+    // takes the next connection from the backlog, false when it's empty;
+    // from what the ring accepted where the queue completes_io().
+    // Out of descriptors the connection is closed right away and `accepted`
+    // is left empty
+    bool accept(io_queue& queue, socket_profile const& accepted_profile, client_socket& accepted);
+    // out of descriptors with none in reserve: accept() returns false with
+    // the backlog still full, until a later call manages to reopen it
+    bool starved() const noexcept { return reserve.getfd() == -1; }
     
 private:
     file_descriptor fd;
+    file_descriptor reserve; // given up to accept when the process is out of descriptors
     int port;
+    socket_profile profile;
 };
 
 struct client_socket
@@ -32,24 +61,15 @@ struct client_socket
     client_socket(client_socket const& other) = delete;
     client_socket(client_socket&& other) noexcept;
     client_socket& operator=(client_socket&& rhs) noexcept;
-    client_socket(const sockaddr addr); // for connect;
-    client_socket(const server_socket& server); // for accept
+    client_socket(sockaddr_storage const& addr); // for connect, IPv4 or IPv6
+    client_socket(sockaddr_storage const& addr, socket_profile const& profile);
+    explicit client_socket(int fd) noexcept; // takes an open socket, -1 for none
     int getfd() const noexcept { return fd.getfd(); };
     
 private:
     file_descriptor fd;
 };
 
-struct write_part {
-    std::string text;
-    size_t writted = 0;
-    
-    write_part(std::string text) : text(text) {};
-    write_part(std::string text, size_t written) : text(text), writted(written) {};
-    const char* get_part_text() const { return text.data() + writted; };
-    size_t get_part_size() const { return text.size() - writted; }
-};
-
 struct tcp_client
 {
     typedef std::function<void (struct kevent event)> on_ready_t;
@@ -57,28 +77,75 @@ struct tcp_client
     tcp_client();
     tcp_client(client_socket socket);
     tcp_client(client_socket socket, on_ready_t on_read, on_ready_t on_write);
+    tcp_client(tcp_client&& other) noexcept;
+    tcp_client& operator=(tcp_client&& rhs) noexcept;
+    ~tcp_client();
     void set_on_read_write(on_ready_t on_read, on_ready_t on_write);
     int get_socket() const noexcept;
+    // sends msg_queue with scatter-gather writes until it is empty (returns
+    // true) or the socket is full
+    bool flush();
+    void enqueue(buffer_slice part);
+    void enqueue(buffer_chain const& message);
+    // acknowledges what was received right away instead of delaying it
+    void ack_now() noexcept;
+    // sends writes of zero_copy_threshold bytes and more with MSG_ZEROCOPY
+    // from now on; false where the socket or the system can't
+    bool enable_zero_copy() noexcept;
+    // lets go of the bytes of the zero-copy sends the kernel reported done,
+    // true when none is left
+    bool reap_zero_copy();
+    
+    static const size_t zero_copy_threshold = 16 * 1024;
     
     on_ready_t on_read;
     on_ready_t on_write;
     client_socket socket;
-    std::list<write_part> msg_queue;
+    buffer_chain msg_queue; // counted in thread_buffer_stats().queued
+    size_t sending = 0;     // bytes at its front the ring is sending, see tcp_connection::flush()
+    bool paused = false;    // reading stopped until the peer's msg_queue drains
+    bool eof = false;       // the peer sent its FIN, nothing more is read
+    bool zero_copy = false;
+    
+private:
+    // a zero-copy send the kernel isn't done with: its bytes must not change
+    // until then. flush() isn't done while there are any, so the write
+    // handler stays registered for the completions, which come with EPOLLERR
+    struct pinned_send
+    {
+        uint32_t id;          // the kernel numbers zero-copy sends from 0
+        buffer_chain bytes;
+    };
+    
+    std::deque<pinned_send> pinned; // counted in thread_buffer_stats().pinned
+    uint32_t zero_copy_sends = 0;
+    
+    // sendmsg() with MSG_ZEROCOPY when zero_copy_send; that is cleared
+    // when the bytes were copied after all
+    ssize_t send_chunk(struct msghdr const& msg, bool& zero_copy_send);
+    void unpin(size_t count) noexcept;
+    
+    friend struct tcp_connection;
 };
 
 struct tcp_connection
 {
     typedef std::function<void (struct kevent event)> on_ready_t;
     
+    // a msg_queue over high_watermark bytes stops reading from the other
+    // side of the connection, which resumes once it drains below low_watermark
+    static const size_t high_watermark = 1024 * 1024;
+    static const size_t low_watermark = 256 * 1024;
+    
     tcp_connection(io_queue& queue, tcp_client client);
-    ~tcp_connection() {
-        deregistrate(client);
-        if (get_server_socket() != -1)
-            deregistrate(server);
-    };
+    ~tcp_connection();
     void set_server(tcp_client server);
-    void write_to_client(std::string text);
-    void write_to_server(std::string text);
+    void write_to_client(std::string const& text);
+    void write_to_server(std::string const& text);
+    void write_to_client(buffer_slice part);
+    void write_to_server(buffer_slice part);
+    void write_to_client(buffer_chain const& message);
+    void write_to_server(buffer_chain const& message);
     int get_client_socket() const noexcept;
     int get_server_socket() const noexcept;
     void set_client_on_read_write(on_ready_t on_read, on_ready_t on_write);
@@ -86,6 +153,17 @@ struct tcp_connection
     void registrate(tcp_client& client);
     void deregistrate(tcp_client& client);
     void update_registration(tcp_client& client);
+    void write_to(tcp_client& dest, buffer_slice part);
+    void write_to(tcp_client& dest, buffer_chain const& message);
+    // tcp_client::flush(), or where the queue completes_io() hands msg_queue
+    // to the ring unless it has some of it already; true when it is empty
+    bool flush(tcp_client& dest);
+    // flushes dest when it is writable, or once the ring sent some of it,
+    // which event says then
+    void write_some(tcp_client& dest, struct kevent const& event);
+    void sent(tcp_client& dest, struct kevent const& event);
+    tcp_client& peer_of(tcp_client& side) noexcept;
+    void check_watermarks(tcp_client& dest);
     
     io_queue& queue;
 
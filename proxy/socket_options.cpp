@@ -0,0 +1,134 @@
+//
+//  socket_options.cpp
+//  proxy
+//
+
+#include <errno.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+#include <stdexcept>
+
+#include "socket_options.hpp"
+#include "throw_error.h"
+
+namespace
+{
+    void set_option(int fd, int level, int name, int value, char const* action)
+    {
+        if (setsockopt(fd, level, name, &value, sizeof(value)) == -1)
+            throw_error(errno, action);
+    }
+
+    int to_int(std::string const& option, std::string const& value)
+    {
+        size_t end = 0;
+        int result = -1;
+        try {
+            result = std::stoi(value, &end);
+        } catch (std::exception const&) {
+        }
+        if (value.empty() || end != value.size() || result < 0)
+            throw std::invalid_argument("bad value for socket option " + option + ": " + value);
+        return result;
+    }
+}
+
+void socket_profile::parse(std::string const& spec)
+{
+    size_t start = 0;
+    while (start < spec.size()) {
+        size_t comma = spec.find(',', start);
+        if (comma == std::string::npos)
+            comma = spec.size();
+        std::string option = spec.substr(start, comma - start);
+        start = comma + 1;
+        if (option.empty())
+            continue;
+
+        size_t equals = option.find('=');
+        std::string name = option.substr(0, equals);
+        std::string value = equals == std::string::npos ? "" : option.substr(equals + 1);
+
+        if (name == "nodelay") {
+            no_delay = true;
+        } else if (name == "delay") {
+            no_delay = false;
+        } else if (name == "sndbuf") {
+            send_buffer = to_int(name, value);
+        } else if (name == "rcvbuf") {
+            receive_buffer = to_int(name, value);
+        } else if (name == "keepalive") {
+            keep_alive_idle = to_int(name, value);
+        } else if (name == "keepintvl") {
+            keep_alive_interval = to_int(name, value);
+        } else if (name == "keepcnt") {
+            keep_alive_count = to_int(name, value);
+        } else if (name == "backlog") {
+            backlog = to_int(name, value);
+        } else if (name == "defer-accept") {
+            defer_accept = to_int(name, value);
+        } else if (name == "fastopen") {
+            // a queue length on a listener, a flag on an upstream socket
+            fast_open = true;
+            fast_open_queue = value.empty() ? 16 : to_int(name, value);
+        } else if (name == "zerocopy") {
+            zero_copy = true;
+        } else {
+            throw std::invalid_argument("unknown socket option " + name);
+        }
+    }
+}
+
+void socket_profile::apply(int fd) const
+{
+    if (no_delay)
+        set_option(fd, IPPROTO_TCP, TCP_NODELAY, 1, "setsockopt(TCP_NODELAY)");
+    if (send_buffer)
+        set_option(fd, SOL_SOCKET, SO_SNDBUF, send_buffer, "setsockopt(SO_SNDBUF)");
+    if (receive_buffer)
+        set_option(fd, SOL_SOCKET, SO_RCVBUF, receive_buffer, "setsockopt(SO_RCVBUF)");
+    if (keep_alive_idle) {
+        set_option(fd, SOL_SOCKET, SO_KEEPALIVE, 1, "setsockopt(SO_KEEPALIVE)");
+#if defined(TCP_KEEPIDLE)
+        set_option(fd, IPPROTO_TCP, TCP_KEEPIDLE, keep_alive_idle, "setsockopt(TCP_KEEPIDLE)");
+#elif defined(TCP_KEEPALIVE)
+        set_option(fd, IPPROTO_TCP, TCP_KEEPALIVE, keep_alive_idle, "setsockopt(TCP_KEEPALIVE)");
+#endif
+#if defined(TCP_KEEPINTVL)
+        if (keep_alive_interval)
+            set_option(fd, IPPROTO_TCP, TCP_KEEPINTVL, keep_alive_interval, "setsockopt(TCP_KEEPINTVL)");
+#endif
+#if defined(TCP_KEEPCNT)
+        if (keep_alive_count)
+            set_option(fd, IPPROTO_TCP, TCP_KEEPCNT, keep_alive_count, "setsockopt(TCP_KEEPCNT)");
+#endif
+    }
+}
+
+socket_profiles::socket_profiles()
+{
+    // writes are already coalesced by the write queues, Nagle would only
+    // hold back the last small segment of a response
+    client.no_delay = true;
+    upstream.no_delay = true;
+}
+
+void socket_profiles::parse(std::string const& spec)
+{
+    size_t colon = spec.find(':');
+    std::string target = spec.substr(0, colon);
+    std::string options = colon == std::string::npos ? "" : spec.substr(colon + 1);
+    if (target == "listener") {
+        listener.parse(options);
+    } else if (target == "client") {
+        client.parse(options);
+    } else if (target == "upstream") {
+        upstream.parse(options);
+    } else {
+        throw std::invalid_argument("socket options are for listener, client or upstream, not " + target);
+    }
+    // only the client side has large writes, and only its sockets linger
+    // until the kernel is done with them
+    if (listener.zero_copy || upstream.zero_copy)
+        throw std::invalid_argument("zerocopy is an option of client sockets");
+}
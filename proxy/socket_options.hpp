@@ -0,0 +1,57 @@
+//
+//  socket_options.hpp
+//  proxy
+//
+//  TCP tuning, set separately for the listener, the accepted client
+//  connections and the upstream connections. Options the platform doesn't
+//  have are ignored.
+//
+
+#ifndef socket_options_hpp
+#define socket_options_hpp
+
+#include <string>
+#include <sys/socket.h>
+
+struct socket_profile
+{
+    bool no_delay = false;      // TCP_NODELAY
+    int send_buffer = 0;        // SO_SNDBUF in bytes, 0 leaves the system default
+    int receive_buffer = 0;     // SO_RCVBUF
+    int keep_alive_idle = 0;    // seconds of silence before keepalive probes, 0: no keepalive
+    int keep_alive_interval = 0;
+    int keep_alive_count = 0;
+
+    // listener only; accepted sockets inherit the buffer sizes set on it
+    int backlog = SOMAXCONN;
+    int defer_accept = 0;       // seconds accept waits for the first data (TCP_DEFER_ACCEPT)
+    int fast_open_queue = 0;    // pending TCP Fast Open connections, 0: off
+
+    // upstream only: the request rides the SYN to origins that gave a
+    // Fast Open cookie before (TCP_FASTOPEN_CONNECT)
+    bool fast_open = false;
+
+    // client only: large writes are sent with MSG_ZEROCOPY, see tcp_client
+    bool zero_copy = false;
+
+    // comma separated options, e.g. "nodelay,rcvbuf=262144,keepalive=60";
+    // throws std::invalid_argument
+    void parse(std::string const& spec);
+    // the options of any socket: no_delay, buffers and keepalive
+    void apply(int fd) const;
+};
+
+struct socket_profiles
+{
+    socket_profiles(); // TCP_NODELAY on client and upstream sockets, the rest as the system has it
+
+    // "listener:...", "client:..." or "upstream:..." followed by socket_profile options;
+    // zerocopy is only accepted for client
+    void parse(std::string const& spec);
+
+    socket_profile listener;
+    socket_profile client;
+    socket_profile upstream;
+};
+
+#endif /* socket_options_hpp */
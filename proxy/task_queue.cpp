@@ -0,0 +1,65 @@
+//
+//  task_queue.cpp
+//  proxy
+//
+
+#include <iostream>
+#include <memory>
+#include <stdexcept>
+
+#include "task_queue.hpp"
+
+task_queue::~task_queue()
+{
+    node* list = head.exchange(nullptr, std::memory_order_acquire);
+    while (list) {
+        std::unique_ptr<node> n(list);
+        list = list->next;
+    }
+}
+
+bool task_queue::push(task_t task, uint8_t tag)
+{
+    node* n = new node{std::move(task), tag, head.load(std::memory_order_relaxed)};
+    while (!head.compare_exchange_weak(n->next, n, std::memory_order_release, std::memory_order_relaxed))
+        ;
+    return n->next == nullptr;
+}
+
+size_t task_queue::run()
+{
+    return run(observer_t());
+}
+
+size_t task_queue::run(observer_t const& observer)
+{
+    if (head.load(std::memory_order_relaxed) == nullptr)
+        return 0;
+    node* list = head.exchange(nullptr, std::memory_order_acquire);
+
+    // the stack holds the newest task first
+    node* ordered = nullptr;
+    while (list) {
+        node* next = list->next;
+        list->next = ordered;
+        ordered = list;
+        list = next;
+    }
+
+    size_t count = 0;
+    while (ordered) {
+        std::unique_ptr<node> n(ordered);
+        ordered = ordered->next;
+        count++;
+        try {
+            n->task();
+        } catch (std::exception const& e) {
+            std::cerr << "error: " << e.what() << std::endl;
+        } catch (...) {
+            std::cerr << "unknown exception in task_queue::run()" << std::endl;
+        }
+        if (observer)
+            observer(n->tag);
+    }
+    return count;
+}
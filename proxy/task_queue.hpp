@@ -0,0 +1,48 @@
+//
+//  task_queue.hpp
+//  proxy
+//
+//  Lock-free multi-producer single-consumer queue of closures. Producers
+//  push onto an atomic stack; the consumer takes the whole stack with one
+//  exchange and runs it in push order.
+//
+
+#ifndef task_queue_hpp
+#define task_queue_hpp
+
+#include <stdint.h>
+#include <atomic>
+#include <functional>
+
+struct task_queue
+{
+    typedef std::function<void()> task_t;
+    // called after every task with its tag, e.g. to time it
+    typedef std::function<void(uint8_t tag)> observer_t;
+
+    task_queue() = default;
+    task_queue(task_queue const&) = delete;
+    task_queue& operator=(task_queue const&) = delete;
+    ~task_queue();
+
+    // any thread; returns true if the queue was empty, i.e. the consumer
+    // has to be woken up. Pushes until the next run() need no wakeup.
+    // The tag means nothing to the queue, run() hands it to its observer
+    bool push(task_t task, uint8_t tag = 0);
+
+    // consumer thread only; runs the tasks pushed so far, returns their count
+    size_t run();
+    size_t run(observer_t const& observer);
+
+private:
+    struct node
+    {
+        task_t task;
+        uint8_t tag;
+        node* next;
+    };
+
+    std::atomic<node*> head{nullptr};
+};
+
+#endif /* task_queue_hpp */
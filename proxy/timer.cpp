@@ -4,46 +4,163 @@
 #include <iostream>
 
 timer::timer()
-{}
+    : base(clock_t::now())
+{
+    for (unsigned level = 0; level < levels; level++) {
+        for (unsigned index = 0; index < slots; index++)
+            wheel[level][index] = nullptr;
+        occupied[level] = 0;
+    }
+}
+
+uint64_t timer::to_tick(clock_t::time_point t) const
+{
+    if (t <= base)
+        return 0;
+    // round up: an element never fires before its wakeup
+    auto ms = std::chrono::duration_cast<std::chrono::milliseconds>(t - base);
+    return ms.count() + (base + ms < t ? 1 : 0);
+}
+
+timer::clock_t::time_point timer::to_time(uint64_t tick) const
+{
+    return base + std::chrono::milliseconds(tick);
+}
+
+timer_element*& timer::list_head(uint8_t level, uint8_t index)
+{
+    if (level == expired_list)
+        return expired;
+    if (level == overflow_list)
+        return overflow;
+    return wheel[level][index];
+}
+
+void timer::link(timer_element* e, uint8_t level, uint8_t index)
+{
+    timer_element*& head = list_head(level, index);
+    e->level = level;
+    e->index = index;
+    e->prev = nullptr;
+    e->next = head;
+    if (head)
+        head->prev = e;
+    head = e;
+    if (level < levels)
+        occupied[level] |= uint64_t(1) << index;
+}
+
+void timer::place(timer_element* e)
+{
+    if (e->tick <= current) {
+        link(e, expired_list, 0);
+        return;
+    }
+    // the lowest level whose current window contains the tick
+    for (unsigned level = 0; level < levels; level++) {
+        unsigned shift = slot_bits * (level + 1);
+        if ((e->tick >> shift) == (current >> shift)) {
+            link(e, level, (e->tick >> (slot_bits * level)) & (slots - 1));
+            return;
+        }
+    }
+    link(e, overflow_list, 0);
+}
 
 void timer::add(timer_element* e)
 {
-    queue.insert(value_t(e->wakeup, e));
+    e->tick = to_tick(e->wakeup);
+    place(e);
+    count++;
+    operations.added++;
 }
 
 void timer::remove(timer_element *e)
 {
-    auto i = queue.find(value_t(e->wakeup, e));
-    assert(i != queue.end());
-    queue.erase(i);
+    timer_element*& head = list_head(e->level, e->index);
+    if (e->prev) {
+        e->prev->next = e->next;
+    } else {
+        assert(head == e);
+        head = e->next;
+    }
+    if (e->next)
+        e->next->prev = e->prev;
+    e->prev = e->next = nullptr;
+    if (e->level < levels && !head)
+        occupied[e->level] &= ~(uint64_t(1) << e->index);
+    count--;
+    operations.removed++;
 }
 
 bool timer::empty() const
 {
-    return queue.empty();
+    return count == 0;
 }
 
 timer::clock_t::time_point timer::top() const
 {
     assert(!empty());
-    return queue.begin()->first;
+    if (expired)
+        return to_time(current);
+
+    // occupied slots of a level are always ahead of current in its window,
+    // so the first occupied one of the lowest non-empty level comes first
+    for (unsigned level = 0; level < levels; level++) {
+        if (!occupied[level])
+            continue;
+        unsigned shift = slot_bits * level;
+        unsigned index = __builtin_ctzll(occupied[level]);
+        uint64_t window = (current >> (shift + slot_bits)) << (shift + slot_bits);
+        return to_time(window | (uint64_t(index) << shift));
+    }
+
+    // only the overflow list: wake up when the top level wraps around
+    unsigned shift = slot_bits * levels;
+    return to_time(((current >> shift) + 1) << shift);
 }
 
-void timer::notify(clock_t::time_point now)
+void timer::cascade()
 {
-    for (;;)
-    {
-        if (queue.empty())
+    // current just entered a new level 0 window: bring down the slots
+    // of higher levels that map onto it
+    for (unsigned level = 1; level <= levels; level++) {
+        timer_element* list;
+        if (level == levels) {
+            list = overflow;
+            overflow = nullptr;
+        } else {
+            unsigned index = (current >> (slot_bits * level)) & (slots - 1);
+            list = wheel[level][index];
+            wheel[level][index] = nullptr;
+            occupied[level] &= ~(uint64_t(1) << index);
+        }
+        while (list) {
+            timer_element* e = list;
+            list = e->next;
+            place(e);
+        }
+        if (level < levels && ((current >> (slot_bits * level)) & (slots - 1)) != 0)
             break;
+    }
+}
 
-        auto i = queue.begin();
-        if (i->first > now)
+size_t timer::run_list(uint8_t level, uint8_t index, std::function<void()> const& observer)
+{
+    size_t ran = 0;
+    for (;;)
+    {
+        timer_element* e = list_head(level, index);
+        if (!e)
             break;
 
-        i->second->t = nullptr;
+        remove(e);
+        ran++;
+        operations.fired++;
+        e->t = nullptr;
         try
         {
-            i->second->callback();
+            e->callback();
         }
         catch (std::exception const& e)
         {
@@ -53,9 +170,38 @@ void timer::notify(clock_t::time_point now)
         {
             std::cerr << "unknown exception in timer::notify()" << std::endl;
         }
+        if (observer)
+            observer();
+    }
+    return ran;
+}
 
-        queue.erase(i);
+size_t timer::notify(clock_t::time_point now)
+{
+    return notify(now, std::function<void()>());
+}
+
+size_t timer::notify(clock_t::time_point now, std::function<void()> const& observer)
+{
+    uint64_t now_tick = to_tick(now);
+    if (to_time(now_tick) > now)
+        now_tick--;
+
+    size_t ran = run_list(expired_list, 0, observer);
+    while (count != 0) {
+        // jump to the next tick where something fires or cascades down
+        uint64_t next = to_tick(top());
+        if (next > now_tick)
+            break;
+        current = next;
+        if ((current & (slots - 1)) == 0)
+            cascade();
+        ran += run_list(0, current & (slots - 1), observer);
+        ran += run_list(expired_list, 0, observer);
     }
+    if (current < now_tick)
+        current = now_tick;
+    return ran;
 }
 
 timer_element::timer_element()
@@ -96,15 +242,20 @@ void timer_element::set_callback(timer_element::callback_t callback)
 
 void timer_element::restart(timer& t, clock_t::duration interval)
 {
-    this->t->remove(this);
-    this->t = &t;
-    this->wakeup = clock_t::now() + interval;
-    this->t->add(this);
+    restart(t, clock_t::now() + interval);
+}
+
+void timer_element::stop()
+{
+    if (t)
+        t->remove(this);
+    t = nullptr;
 }
 
 void timer_element::restart(timer& t, clock_t::time_point wakeup)
 {
-    this->t->remove(this);
+    if (this->t)
+        this->t->remove(this);
     this->t = &t;
     this->wakeup = wakeup;
     this->t->add(this);
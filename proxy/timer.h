@@ -3,27 +3,64 @@
 
 #include <cstdint>
 #include <functional>
-#include <set>
 #include <chrono>
 
 struct timer_element;
 
+// hierarchical timing wheel with millisecond ticks: 4 levels of 64 slots
+// cover ~4.6 hours, later deadlines wait in an overflow list.
+// add, remove and restart are O(1).
 struct timer
 {
     typedef std::chrono::steady_clock clock_t;
 
+    // operations on the wheel so far, what the timeouts of a loop cost
+    struct counters
+    {
+        uint64_t added = 0;
+        uint64_t removed = 0; // fired elements too
+        uint64_t fired = 0;
+    };
+
     timer();
+    timer(timer const&) = delete;
+    timer& operator=(timer const&) = delete;
 
     void add(timer_element* e);
     void remove(timer_element* e);
 
     bool empty() const;
+    // no element expires before top(), the loop may sleep until then
     clock_t::time_point top() const;
-    void notify(clock_t::time_point now);
+    // runs the elements due by now, returns how many; observer is called
+    // after every callback, e.g. to time it
+    size_t notify(clock_t::time_point now);
+    size_t notify(clock_t::time_point now, std::function<void()> const& observer);
+    counters const& get_counters() const noexcept { return operations; }
 
 private:
-    typedef std::pair<clock_t::time_point, timer_element*> value_t;
-    std::set<value_t> queue;
+    static const unsigned levels = 4;
+    static const unsigned slot_bits = 6;
+    static const unsigned slots = 1u << slot_bits;
+    static const uint8_t expired_list = levels;
+    static const uint8_t overflow_list = levels + 1;
+
+    uint64_t to_tick(clock_t::time_point t) const;
+    clock_t::time_point to_time(uint64_t tick) const;
+    timer_element*& list_head(uint8_t level, uint8_t index);
+    void link(timer_element* e, uint8_t level, uint8_t index);
+    void place(timer_element* e);
+    void cascade();
+    size_t run_list(uint8_t level, uint8_t index, std::function<void()> const& observer);
+
+    clock_t::time_point base;
+    uint64_t current = 0;
+    size_t count = 0;
+    counters operations;
+    timer_element* wheel[levels][slots];
+    uint64_t occupied[levels]; // bit i: wheel[level][i] is not empty
+    timer_element* expired = nullptr;
+    timer_element* overflow = nullptr;
 };
 
 struct timer_element
@@ -42,12 +79,21 @@ struct timer_element
     void set_callback(callback_t callback);
     void restart(timer& t, clock_t::duration interval);
     void restart(timer& t, clock_t::time_point wakeup);
+    // takes it out of the wheel without running the callback
+    void stop();
 
 private:
     timer* t;
     clock_t::time_point wakeup;
     callback_t callback;
 
+    // position in the wheel
+    uint64_t tick = 0;
+    timer_element* prev = nullptr;
+    timer_element* next = nullptr;
+    uint8_t level = 0;
+    uint8_t index = 0;
+
     friend struct timer;
 };
 
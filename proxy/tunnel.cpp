@@ -0,0 +1,68 @@
+//
+//  tunnel.cpp
+//  proxy
+//
+
+#include "tunnel.hpp"
+
+#if defined(__linux__)
+
+#include <fcntl.h>
+#include <errno.h>
+
+#include "throw_error.h"
+
+namespace
+{
+    // bigger than the default 64 KiB so a pump moves more per splice() pair;
+    // the kernel may refuse, then the default size is used
+    int const wanted_pipe_size = 256 * 1024;
+}
+
+splice_relay::splice_relay()
+{
+    int fds[2];
+    if (pipe2(fds, O_NONBLOCK | O_CLOEXEC) == -1) {
+        throw_error(errno, "pipe2()");
+    }
+    read_end = fds[0];
+    write_end = fds[1];
+
+    int size = fcntl(write_end.getfd(), F_SETPIPE_SZ, wanted_pipe_size);
+    if (size == -1)
+        size = fcntl(write_end.getfd(), F_GETPIPE_SZ);
+    capacity = size > 0 ? static_cast<size_t>(size) : 64 * 1024;
+}
+
+splice_relay::result splice_relay::pump(int from, int to)
+{
+    unsigned const flags = SPLICE_F_MOVE | SPLICE_F_NONBLOCK;
+    for (;;) {
+        // the pipe is emptied before reading again, so EAGAIN
+        // from the source always means that the socket is drained
+        while (in_pipe > 0) {
+            ssize_t moved = splice(read_end.getfd(), nullptr, to, nullptr, in_pipe, flags);
+            if (moved == -1) {
+                if (errno == EINTR)
+                    continue;
+                return errno == EAGAIN ? result::blocked : result::failed;
+            }
+            in_pipe -= moved;
+        }
+        if (eof)
+            return result::finished;
+
+        ssize_t moved = splice(from, nullptr, write_end.getfd(), nullptr, capacity, flags);
+        if (moved > 0) {
+            in_pipe += moved;
+        } else if (moved == 0) {
+            eof = true;
+        } else if (errno == EAGAIN) {
+            return result::drained;
+        } else if (errno != EINTR) {
+            return result::failed;
+        }
+    }
+}
+
+#endif
@@ -0,0 +1,47 @@
+//
+//  tunnel.hpp
+//  proxy
+//
+//  One direction of a CONNECT tunnel relayed with splice(): bytes move
+//  from the source socket into a pipe and from the pipe into the
+//  destination socket without being copied to userspace. Linux only.
+//
+
+#ifndef tunnel_hpp
+#define tunnel_hpp
+
+#if defined(__linux__)
+
+#include <stddef.h>
+
+#include "file_descriptor.h"
+
+struct splice_relay
+{
+    enum class result
+    {
+        drained,  // source has nothing more to read, the pipe is empty
+        blocked,  // destination is full, pump again once it's writable
+        finished, // source reached eof and everything was relayed
+        failed    // either socket had an error
+    };
+
+    splice_relay(); // throws if the pipe can't be created
+    splice_relay(splice_relay const&) = delete;
+    splice_relay& operator=(splice_relay const&) = delete;
+
+    // moves as much as possible from `from` to `to`
+    result pump(int from, int to);
+    size_t buffered() const noexcept { return in_pipe; }
+
+private:
+    file_descriptor read_end;
+    file_descriptor write_end;
+    size_t capacity;
+    size_t in_pipe = 0;
+    bool eof = false;
+};
+
+#endif
+
+#endif /* tunnel_hpp */
@@ -0,0 +1,129 @@
+//
+//  upstream_pool.cpp
+//  proxy
+//
+
+#include <iostream>
+#include <stdexcept>
+
+#include "upstream_pool.hpp"
+
+namespace
+{
+    constexpr const timer::clock_t::duration idle_timeout = std::chrono::seconds(30);
+    size_t const max_idle_per_host = 8;
+    size_t const max_idle = 256;
+    // acquires after which a host is prewarmed
+    uint64_t const hot_after = 4;
+    // origins remembered for their acquire counts; past this the ones
+    // without idle connections are forgotten
+    size_t const max_hosts = 4096;
+}
+
+upstream_pool::idle_connection::idle_connection(client_socket socket)
+    : socket(std::move(socket))
+{}
+
+upstream_pool::upstream_pool(io_queue& queue, socket_profile const& profile)
+    : queue(queue)
+    , profile(profile)
+{}
+
+upstream_pool::~upstream_pool()
+{
+    for (auto& entry : hosts) {
+        for (auto& connection : entry.second.idle)
+            queue.delete_event_handler(connection.socket.getfd(), EVFILT_READ);
+    }
+}
+
+client_socket upstream_pool::acquire(std::vector<sockaddr_storage> const& addresses, sockaddr_storage& used)
+{
+    client_socket socket;
+    if (addresses.empty())
+        return socket;
+    std::string key = format_address(addresses.front());
+    if (hosts.size() >= max_hosts && hosts.find(key) == hosts.end()) {
+        for (auto it = hosts.begin(); it != hosts.end();)
+            it = it->second.idle.empty() ? hosts.erase(it) : ++it;
+    }
+    host& h = hosts[key];
+    h.addr = addresses.front();
+    h.acquired++;
+
+    for (auto const& addr : addresses) {
+        auto it = hosts.find(format_address(addr));
+        if (it == hosts.end() || it->second.idle.empty())
+            continue;
+        // the most recently used one is the least likely to be closed by now
+        std::list<idle_connection>& idle = it->second.idle;
+        socket = std::move(idle.back().socket);
+        idle.pop_back();
+        idle_count--;
+        queue.delete_event_handler(socket.getfd(), EVFILT_READ);
+        used = addr;
+        break;
+    }
+    prewarm(key, h);
+    return socket;
+}
+
+void upstream_pool::release(sockaddr_storage const& addr, client_socket socket)
+{
+    std::string key = format_address(addr);
+    host& h = hosts[key];
+    h.addr = addr;
+    if (h.idle.size() >= max_idle_per_host || idle_count >= max_idle)
+        return;
+    keep(key, h, std::move(socket));
+}
+
+void upstream_pool::set_prewarm(size_t spare) noexcept
+{
+    this->spare = spare < max_idle_per_host ? spare : max_idle_per_host;
+}
+
+void upstream_pool::keep(std::string const& key, host& h, client_socket socket)
+{
+    int fd = socket.getfd();
+    h.idle.emplace_back(std::move(socket));
+    idle_count++;
+    timer_element& timer = h.idle.back().timer;
+    timer.set_callback([this, key, fd]() { close(key, fd); });
+    timer.restart(queue.get_timer(), idle_timeout);
+    // nothing is expected from an idle connection: data or eof makes it unusable
+    queue.add_event_handler(fd, EVFILT_READ, [this, key, fd](struct kevent) { close(key, fd); });
+    queue.set_descriptor_kind(fd, descriptor_kind::server);
+}
+
+void upstream_pool::close(std::string const& key, int fd)
+{
+    auto it = hosts.find(key);
+    if (it == hosts.end())
+        return;
+    std::list<idle_connection>& idle = it->second.idle;
+    for (auto connection = idle.begin(); connection != idle.end(); ++connection) {
+        if (connection->socket.getfd() == fd) {
+            queue.delete_event_handler(fd, EVFILT_READ);
+            idle.erase(connection);
+            idle_count--;
+            return;
+        }
+    }
+}
+
+void upstream_pool::prewarm(std::string const& key, host& h)
+{
+    if (spare == 0 || h.acquired < hot_after)
+        return;
+    while (h.idle.size() < spare && idle_count < max_idle) {
+        try {
+            // connects in the background, a request written before it's
+            // established waits in the write queue
+            keep(key, h, client_socket(h.addr, profile));
+        } catch (std::runtime_error const& error) {
+            std::cout << "prewarming " << key << ": " << error.what() << "\n";
+            return;
+        }
+    }
+}
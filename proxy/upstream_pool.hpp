@@ -0,0 +1,70 @@
+//
+//  upstream_pool.hpp
+//  proxy
+//
+//  Idle keep-alive connections to origin servers, shared by all client
+//  connections of one event loop and keyed by the resolved address. A
+//  connection comes back here once its response was read to the end, and
+//  is closed when the origin closes it, sends something unasked, or after
+//  it has been idle for too long.
+//
+
+#ifndef upstream_pool_hpp
+#define upstream_pool_hpp
+
+#include <list>
+#include <map>
+#include <string>
+#include <vector>
+#include <sys/socket.h>
+
+#include "kqueue.hpp"
+#include "socket.hpp"
+#include "timer.h"
+
+struct upstream_pool
+{
+    upstream_pool(io_queue& queue, socket_profile const& profile);
+    upstream_pool(upstream_pool const&) = delete;
+    upstream_pool& operator=(upstream_pool const&) = delete;
+    ~upstream_pool();
+
+    // an idle connection to the first of the addresses that has one, which
+    // is stored in `used`, or a socket without descriptor if there is none.
+    // Hosts are counted and prewarmed by their first address
+    client_socket acquire(std::vector<sockaddr_storage> const& addresses, sockaddr_storage& used);
+    // keeps a connection that is done with its last response for the next
+    // request to addr; closes it when the limits are reached
+    void release(sockaddr_storage const& addr, client_socket socket);
+    // hosts acquired a few times already keep `spare` idle connections
+    // opened in advance; 0, the default, turns it off
+    void set_prewarm(size_t spare) noexcept;
+
+private:
+    struct idle_connection
+    {
+        idle_connection(client_socket socket);
+
+        client_socket socket;
+        timer_element timer;
+    };
+
+    struct host
+    {
+        sockaddr_storage addr;
+        std::list<idle_connection> idle; // most recently released at the back
+        uint64_t acquired = 0;
+    };
+
+    void keep(std::string const& key, host& h, client_socket socket);
+    void close(std::string const& key, int fd);
+    void prewarm(std::string const& key, host& h);
+
+    io_queue& queue;
+    socket_profile profile; // for prewarmed connections
+    std::map<std::string, host> hosts;
+    size_t idle_count = 0;
+    size_t spare = 0;
+};
+
+#endif /* upstream_pool_hpp */
@@ -0,0 +1,318 @@
+//
+//  uring.cpp
+//  proxy
+//
+
+#include <sys/mman.h>
+#include <sys/syscall.h>
+#include <errno.h>
+#include <string.h>
+#include <unistd.h>
+
+#include "uring.hpp"
+#include "throw_error.h"
+
+namespace
+{
+    template <typename T>
+    T* at_offset(void* base, unsigned offset)
+    {
+        return reinterpret_cast<T*>(static_cast<char*>(base) + offset);
+    }
+
+    unsigned load_acquire(unsigned const* p)
+    {
+        return __atomic_load_n(p, __ATOMIC_ACQUIRE);
+    }
+
+    void store_release(unsigned* p, unsigned value)
+    {
+        __atomic_store_n(p, value, __ATOMIC_RELEASE);
+    }
+}
+
+uring::uring(unsigned entries)
+{
+    struct io_uring_params params;
+    memset(&params, 0, sizeof(params));
+
+    fd = static_cast<int>(syscall(__NR_io_uring_setup, entries, &params));
+    if (fd.getfd() == -1) {
+        throw_error(errno, "io_uring_setup()");
+    }
+    if (!(params.features & IORING_FEAT_EXT_ARG)) {
+        throw_error(ENOSYS, "io_uring_setup()");
+    }
+
+    sq_size = params.sq_off.array + params.sq_entries * sizeof(unsigned);
+    cq_size = params.cq_off.cqes + params.cq_entries * sizeof(struct io_uring_cqe);
+    bool single_mmap = params.features & IORING_FEAT_SINGLE_MMAP;
+    if (single_mmap && cq_size > sq_size)
+        sq_size = cq_size;
+
+    sq_ptr = mmap(nullptr, sq_size, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, fd.getfd(), IORING_OFF_SQ_RING);
+    if (sq_ptr == MAP_FAILED) {
+        throw_error(errno, "mmap(IORING_OFF_SQ_RING)");
+    }
+    if (single_mmap) {
+        cq_ptr = sq_ptr;
+        cq_size = 0;
+    } else {
+        cq_ptr = mmap(nullptr, cq_size, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, fd.getfd(), IORING_OFF_CQ_RING);
+        if (cq_ptr == MAP_FAILED) {
+            int err = errno;
+            munmap(sq_ptr, sq_size);
+            throw_error(err, "mmap(IORING_OFF_CQ_RING)");
+        }
+    }
+    sqes_size = params.sq_entries * sizeof(struct io_uring_sqe);
+    sqes = static_cast<struct io_uring_sqe*>(mmap(nullptr, sqes_size, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, fd.getfd(), IORING_OFF_SQES));
+    if (sqes == MAP_FAILED) {
+        int err = errno;
+        if (cq_size)
+            munmap(cq_ptr, cq_size);
+        munmap(sq_ptr, sq_size);
+        throw_error(err, "mmap(IORING_OFF_SQES)");
+    }
+
+    sq_head = at_offset<unsigned>(sq_ptr, params.sq_off.head);
+    sq_tail = at_offset<unsigned>(sq_ptr, params.sq_off.tail);
+    sq_array = at_offset<unsigned>(sq_ptr, params.sq_off.array);
+    sq_mask = *at_offset<unsigned>(sq_ptr, params.sq_off.ring_mask);
+    sq_entries = *at_offset<unsigned>(sq_ptr, params.sq_off.ring_entries);
+    sq_local_tail = *sq_tail;
+
+    cq_head = at_offset<unsigned>(cq_ptr, params.cq_off.head);
+    cq_tail = at_offset<unsigned>(cq_ptr, params.cq_off.tail);
+    cq_mask = *at_offset<unsigned>(cq_ptr, params.cq_off.ring_mask);
+    cqes = at_offset<struct io_uring_cqe>(cq_ptr, params.cq_off.cqes);
+}
+
+uring::~uring()
+{
+    if (buffers)
+        munmap(buffers, buffers_size);
+    munmap(sqes, sqes_size);
+    if (cq_size)
+        munmap(cq_ptr, cq_size);
+    munmap(sq_ptr, sq_size);
+}
+
+struct io_uring_sqe* uring::get_sqe()
+{
+    if (sq_local_tail - load_acquire(sq_head) == sq_entries) {
+        // ring is full: hand what we have to the kernel without waiting
+        if (enter(0, 0, nullptr, 0) == -1) {
+            throw_error(errno, "io_uring_enter()");
+        }
+    }
+    unsigned index = sq_local_tail & sq_mask;
+    struct io_uring_sqe* sqe = &sqes[index];
+    memset(sqe, 0, sizeof(*sqe));
+    sq_array[index] = index;
+    sq_local_tail++;
+    to_submit++;
+    return sqe;
+}
+
+void uring::poll_add(uint64_t user_data, int fd, uint32_t events, bool edge)
+{
+    struct io_uring_sqe* sqe = get_sqe();
+    sqe->opcode = IORING_OP_POLL_ADD;
+    sqe->fd = fd;
+    sqe->poll32_events = events;
+    // multishot polls are edge-triggered; a level-triggered poll is a
+    // oneshot one that the caller re-arms after every completion
+    sqe->len = edge ? IORING_POLL_ADD_MULTI : 0;
+    sqe->user_data = user_data;
+}
+
+void uring::poll_remove(uint64_t user_data)
+{
+    struct io_uring_sqe* sqe = get_sqe();
+    sqe->opcode = IORING_OP_POLL_REMOVE;
+    sqe->fd = -1;
+    sqe->addr = user_data;
+    sqe->user_data = 0;
+}
+
+void uring::accept_multishot(uint64_t user_data, int fd, int flags)
+{
+    struct io_uring_sqe* sqe = get_sqe();
+    sqe->opcode = IORING_OP_ACCEPT;
+    sqe->fd = fd;
+    sqe->accept_flags = static_cast<uint32_t>(flags);
+    sqe->ioprio = IORING_ACCEPT_MULTISHOT;
+    sqe->user_data = user_data;
+}
+
+void uring::recv_multishot(uint64_t user_data, int fd)
+{
+    struct io_uring_sqe* sqe = get_sqe();
+    sqe->opcode = IORING_OP_RECV;
+    sqe->fd = fd;
+    // len 0: as much as the picked buffer holds
+    sqe->flags = IOSQE_BUFFER_SELECT;
+    sqe->buf_group = buffer_group;
+    sqe->ioprio = IORING_RECV_MULTISHOT;
+    sqe->user_data = user_data;
+}
+
+void uring::sendmsg(uint64_t user_data, int fd, struct msghdr const* msg, unsigned flags, bool linked)
+{
+    struct io_uring_sqe* sqe = get_sqe();
+    sqe->opcode = IORING_OP_SENDMSG;
+    sqe->fd = fd;
+    sqe->addr = reinterpret_cast<uint64_t>(msg);
+    sqe->len = 1;
+    sqe->msg_flags = flags;
+    if (linked)
+        sqe->flags = IOSQE_IO_LINK;
+    sqe->user_data = user_data;
+}
+
+void uring::cancel(uint64_t user_data)
+{
+    struct io_uring_sqe* sqe = get_sqe();
+    sqe->opcode = IORING_OP_ASYNC_CANCEL;
+    sqe->fd = -1;
+    sqe->addr = user_data;
+    sqe->cancel_flags = IORING_ASYNC_CANCEL_ALL;
+    sqe->user_data = 0;
+}
+
+bool uring::setup_buffers(unsigned entries)
+{
+    size_t size = entries * sizeof(struct io_uring_buf);
+    void* ring = mmap(nullptr, size, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS | MAP_POPULATE, -1, 0);
+    if (ring == MAP_FAILED) {
+        throw_error(errno, "mmap()");
+    }
+    struct io_uring_buf_reg reg;
+    memset(&reg, 0, sizeof(reg));
+    reg.ring_addr = reinterpret_cast<uint64_t>(ring);
+    reg.ring_entries = entries;
+    reg.bgid = buffer_group;
+    if (syscall(__NR_io_uring_register, fd.getfd(), IORING_REGISTER_PBUF_RING, &reg, 1) == 0) {
+        buffers = static_cast<struct io_uring_buf_ring*>(ring);
+        buffers_size = size;
+        buffers_mask = entries - 1;
+        // some kernels take the ring and then never find a buffer in it
+        if (receives_into_buffers())
+            return true;
+        syscall(__NR_io_uring_register, fd.getfd(), IORING_UNREGISTER_PBUF_RING, &reg, 1);
+        buffers = nullptr;
+    }
+    munmap(ring, size);
+    return receives_into_buffers();
+}
+
+void uring::provide_buffer(uint16_t id, void* addr, unsigned length)
+{
+    if (buffers == nullptr) {
+        struct io_uring_sqe* sqe = get_sqe();
+        sqe->opcode = IORING_OP_PROVIDE_BUFFERS;
+        sqe->fd = 1; // buffers
+        sqe->addr = reinterpret_cast<uint64_t>(addr);
+        sqe->len = length;
+        sqe->off = id;
+        sqe->buf_group = buffer_group;
+        sqe->user_data = 0;
+        return;
+    }
+    struct io_uring_buf* buf = &buffers->bufs[buffers_tail & buffers_mask];
+    buf->addr = reinterpret_cast<uint64_t>(addr);
+    buf->len = length;
+    buf->bid = id;
+    // the tail shares its place with the reserved field of the first buffer
+    buffers_tail++;
+    __atomic_store_n(&buffers->tail, buffers_tail, __ATOMIC_RELEASE);
+}
+
+bool uring::receives_into_buffers()
+{
+    int pair[2];
+    if (socketpair(AF_UNIX, SOCK_STREAM | SOCK_CLOEXEC, 0, pair) == -1) {
+        throw_error(errno, "socketpair()");
+    }
+    file_descriptor reader(pair[0]);
+    file_descriptor writer(pair[1]);
+    char byte = 0;
+    if (write(writer.getfd(), &byte, 1) != 1) {
+        throw_error(errno, "write()");
+    }
+    char received;
+    provide_buffer(0, &received, 1);
+    recv_multishot(probe_tag, reader.getfd());
+    cancel(probe_tag);
+
+    // submitted before anything else, the probe has the ring to itself:
+    // its first completion says whether the byte arrived
+    int result = 0;
+    bool first = true, done = false;
+    while (!done) {
+        if (submit_and_wait(-1) == -1 && errno != EINTR) {
+            throw_error(errno, "io_uring_enter()");
+        }
+        size_t count = ready();
+        for (size_t i = 0; i < count; i++) {
+            struct io_uring_cqe const& cqe = completion(i);
+            if (cqe.user_data != probe_tag)
+                continue;
+            if (first)
+                result = cqe.res;
+            first = false;
+            done = !(cqe.flags & IORING_CQE_F_MORE);
+        }
+        advance(count);
+    }
+    return result == 1;
+}
+
+uint16_t uring::buffer_id(struct io_uring_cqe const& cqe) noexcept
+{
+    return static_cast<uint16_t>(cqe.flags >> IORING_CQE_BUFFER_SHIFT);
+}
+
+int uring::enter(unsigned min_complete, unsigned flags, void* arg, size_t argsz)
+{
+    store_release(sq_tail, sq_local_tail);
+    int submitted = static_cast<int>(syscall(__NR_io_uring_enter, fd.getfd(), to_submit, min_complete, flags, arg, argsz));
+    if (submitted > 0)
+        to_submit -= submitted;
+    return submitted;
+}
+
+int uring::submit_and_wait(int timeout)
+{
+    struct __kernel_timespec ts;
+    struct io_uring_getevents_arg arg;
+    memset(&arg, 0, sizeof(arg));
+    if (timeout != -1) {
+        ts.tv_sec = timeout / 1000;
+        ts.tv_nsec = (timeout % 1000) * 1000000;
+        arg.ts = reinterpret_cast<uint64_t>(&ts);
+    }
+
+    if (enter(1, IORING_ENTER_GETEVENTS | IORING_ENTER_EXT_ARG, &arg, sizeof(arg)) == -1) {
+        if (errno == ETIME)
+            return 0;
+        return -1;
+    }
+    return static_cast<int>(ready());
+}
+
+size_t uring::ready() const noexcept
+{
+    return load_acquire(cq_tail) - *cq_head;
+}
+
+struct io_uring_cqe const& uring::completion(size_t i) const noexcept
+{
+    return cqes[(*cq_head + i) & cq_mask];
+}
+
+void uring::advance(size_t count) noexcept
+{
+    store_release(cq_head, *cq_head + static_cast<unsigned>(count));
+}
@@ -0,0 +1,99 @@
+//
+//  uring.hpp
+//  proxy
+//
+//  Minimal io_uring submission/completion ring for io_queue: the requests
+//  it submits go to the kernel together with the wait, in one io_uring_enter.
+//  Polls for readiness, and the I/O itself: multishot accepts, multishot
+//  receives into a ring of provided buffers and linked sends.
+//
+
+#ifndef uring_hpp
+#define uring_hpp
+
+#include <linux/io_uring.h>
+#include <sys/socket.h>
+#include <stdint.h>
+#include <stddef.h>
+
+#include "file_descriptor.h"
+
+struct uring
+{
+    uring(unsigned entries);
+    uring(uring const&) = delete;
+    uring& operator=(uring const&) = delete;
+    ~uring();
+
+    // edge: multishot poll, a completion with user_data is posted on every wakeup
+    // otherwise oneshot poll, completion without IORING_CQE_F_MORE
+    void poll_add(uint64_t user_data, int fd, uint32_t events, bool edge);
+    void poll_remove(uint64_t user_data);
+    // multishot accept, a completion with the new descriptor per connection
+    void accept_multishot(uint64_t user_data, int fd, int flags);
+    // multishot receive into the provided buffers, a completion per receive
+    // with the id of the buffer in its flags, see buffer_id()
+    void recv_multishot(uint64_t user_data, int fd);
+    // linked: the next request starts once this one is done, and is
+    // cancelled if this one fails. msg is copied when it is submitted,
+    // the bytes it points to must stay until the completion
+    void sendmsg(uint64_t user_data, int fd, struct msghdr const* msg, unsigned flags, bool linked);
+    // every request with user_data, its last completion says -ECANCELED
+    void cancel(uint64_t user_data);
+
+    // buffers for the receives: a registered ring of `entries`, a power of
+    // 2, or where the kernel doesn't take from one, buffers provided one by
+    // one. False where a multishot receive can't have them
+    bool setup_buffers(unsigned entries);
+    // gives the kernel a buffer to receive into, its own or a new one;
+    // without a ring it is a request that goes with the next submission
+    void provide_buffer(uint16_t id, void* addr, unsigned length);
+    static uint16_t buffer_id(struct io_uring_cqe const& cqe) noexcept;
+
+    // submits pending entries and waits for at least one completion,
+    // timeout in milliseconds, -1 for infinite; returns -1 and sets errno on failure
+    int submit_and_wait(int timeout);
+
+    // completions are valid until advance()
+    size_t ready() const noexcept;
+    struct io_uring_cqe const& completion(size_t i) const noexcept;
+    void advance(size_t count) noexcept;
+
+private:
+    static const uint16_t buffer_group = 0;
+    static const uint64_t probe_tag = 1;
+
+    struct io_uring_sqe* get_sqe();
+    // a byte received with the buffers set up; only before anything else is submitted
+    bool receives_into_buffers();
+    int enter(unsigned min_complete, unsigned flags, void* arg, size_t argsz);
+
+    file_descriptor fd;
+
+    void* sq_ptr;
+    size_t sq_size;
+    void* cq_ptr;
+    size_t cq_size;
+    struct io_uring_sqe* sqes;
+    size_t sqes_size;
+
+    unsigned* sq_head;
+    unsigned* sq_tail;
+    unsigned* sq_array;
+    unsigned sq_mask;
+    unsigned sq_entries;
+    unsigned sq_local_tail = 0;
+    unsigned to_submit = 0;
+
+    struct io_uring_buf_ring* buffers = nullptr;
+    size_t buffers_size = 0;
+    unsigned buffers_mask = 0;
+    uint16_t buffers_tail = 0;
+
+    unsigned* cq_head;
+    unsigned* cq_tail;
+    unsigned cq_mask;
+    struct io_uring_cqe* cqes;
+};
+
+#endif /* uring_hpp */
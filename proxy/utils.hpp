@@ -11,6 +11,7 @@
 
 #include <unordered_map>
 #include <list>
+#include <stdexcept>
 
 template<typename key_t, typename val_t>
 struct lru_cache
@@ -31,17 +32,21 @@ struct lru_cache
     }
     
     void put(const key_t& key, const val_t& val) {
+        put(key, val_t(val));
+    }
+    
+    void put(const key_t& key, val_t&& val) {
         auto it = items_map.find(key);
         if (it != items_map.end()) {
             items_list.erase(it->second);
             items_map.erase(it);
         }
         
-        items_list.push_front(std::make_pair(key, val));
+        items_list.push_front(std::make_pair(key, std::move(val)));
         items_map[key] = items_list.begin();
         
         if (size() > max_size) {
-            auto last = items_list.end()--;
+            auto last = --items_list.end();
             items_map.erase(last->first);
             items_list.pop_back();
         }
@@ -0,0 +1,105 @@
+//
+//  worker_pool.cpp
+//  proxy
+//
+
+#include <iostream>
+#include <stdexcept>
+
+#include "worker_pool.hpp"
+
+namespace
+{
+    // the pool and deque of the worker running on this thread
+    thread_local worker_pool* current_pool = nullptr;
+    thread_local size_t current_worker = 0;
+}
+
+worker_pool::worker_pool(size_t thread_count)
+{
+    if (thread_count == 0)
+        thread_count = 1;
+    for (size_t i = 0; i < thread_count; i++)
+        workers.emplace_back(new worker());
+    for (size_t i = 0; i < thread_count; i++)
+        threads.push_back(std::thread(&worker_pool::run, this, i));
+}
+
+worker_pool::~worker_pool()
+{
+    {
+        std::unique_lock<std::mutex> lk(sleep_mutex);
+        finished = true;
+    }
+    condition.notify_all();
+    for (auto& thread : threads)
+        thread.join();
+}
+
+void worker_pool::submit(task_t task)
+{
+    size_t index = current_pool == this
+                 ? current_worker
+                 : next_worker.fetch_add(1, std::memory_order_relaxed) % workers.size();
+    {
+        std::unique_lock<std::mutex> lk(workers[index]->mutex);
+        workers[index]->tasks.push_back(std::move(task));
+    }
+    pending.fetch_add(1);
+    // taking the lock orders the increment with a worker going to sleep
+    std::unique_lock<std::mutex> lk(sleep_mutex);
+    lk.unlock();
+    condition.notify_one();
+}
+
+bool worker_pool::take(size_t index, task_t& task)
+{
+    {
+        worker& own = *workers[index];
+        std::unique_lock<std::mutex> lk(own.mutex);
+        if (!own.tasks.empty()) {
+            task = std::move(own.tasks.back());
+            own.tasks.pop_back();
+            pending.fetch_sub(1);
+            return true;
+        }
+    }
+    for (size_t i = 1; i < workers.size(); i++) {
+        worker& victim = *workers[(index + i) % workers.size()];
+        std::unique_lock<std::mutex> lk(victim.mutex, std::try_to_lock);
+        if (!lk.owns_lock() || victim.tasks.empty())
+            continue;
+        task = std::move(victim.tasks.front());
+        victim.tasks.pop_front();
+        pending.fetch_sub(1);
+        return true;
+    }
+    return false;
+}
+
+void worker_pool::run(size_t index)
+{
+    current_pool = this;
+    current_worker = index;
+
+    for (;;) {
+        task_t task;
+        if (take(index, task)) {
+            try {
+                task();
+            } catch (std::exception const& e) {
+                std::cerr << "error: " << e.what() << std::endl;
+            } catch (...) {
+                std::cerr << "unknown exception in worker_pool::run()" << std::endl;
+            }
+            continue;
+        }
+
+        std::unique_lock<std::mutex> lk(sleep_mutex);
+        if (finished && pending == 0)
+            break;
+        condition.wait(lk, [&]{ return pending != 0 || finished; });
+        if (finished && pending == 0)
+            break;
+    }
+}
@@ -0,0 +1,56 @@
+//
+//  worker_pool.hpp
+//  proxy
+//
+//  Work-stealing thread pool for CPU heavy work that shouldn't stall an
+//  event loop. Every worker has its own deque: it takes the newest task from
+//  the back of its own deque and steals the oldest one from the front of the
+//  others' when it runs dry. Use io_queue::offload() to get the result back
+//  on the loop thread.
+//
+
+#ifndef worker_pool_hpp
+#define worker_pool_hpp
+
+#include <atomic>
+#include <condition_variable>
+#include <deque>
+#include <functional>
+#include <memory>
+#include <mutex>
+#include <thread>
+#include <vector>
+
+struct worker_pool
+{
+    typedef std::function<void()> task_t;
+
+    explicit worker_pool(size_t thread_count);
+    worker_pool(worker_pool const&) = delete;
+    worker_pool& operator=(worker_pool const&) = delete;
+    ~worker_pool(); // runs the tasks that are still queued
+
+    // any thread; a task submitted by a worker goes to that worker's deque
+    void submit(task_t task);
+
+private:
+    struct worker
+    {
+        std::mutex mutex;
+        std::deque<task_t> tasks;
+    };
+
+    void run(size_t index);
+    bool take(size_t index, task_t& task);
+
+    std::vector<std::unique_ptr<worker>> workers;
+    std::vector<std::thread> threads;
+    std::atomic<size_t> next_worker{0};
+
+    std::mutex sleep_mutex;
+    std::condition_variable condition;
+    std::atomic<size_t> pending{0}; // queued in all deques
+    bool finished = false;          // under sleep_mutex
+};
+
+#endif /* worker_pool_hpp */
@@ -0,0 +1,205 @@
+//
+//  chunked_test.cpp
+//  proxy
+//
+//  The chunked decoder wherever the reads split a body, with extensions,
+//  trailers and leading zeros, against malformed framing; and bodies framed
+//  by append_chunk() decoding to what was framed.
+//
+
+#include <stdlib.h>
+#include <algorithm>
+#include <iostream>
+#include <string>
+#include <vector>
+
+#include "chunked.hpp"
+
+namespace
+{
+    int failures = 0;
+
+    void check(bool ok, char const* what)
+    {
+        if (ok)
+            return;
+        std::cout << "FAILED: " << what << "\n";
+        failures++;
+    }
+
+    struct decoded
+    {
+        chunked_decoder::status status;
+        size_t used;      // bytes of the text the decoder took
+        std::string data; // of the chunks
+    };
+
+    // feeds the text in parts cut at the given offsets, until the end of the body
+    decoded decode(std::string const& text, std::vector<size_t> cuts = std::vector<size_t>())
+    {
+        cuts.push_back(text.size());
+        std::sort(cuts.begin(), cuts.end());
+        chunked_decoder decoder;
+        decoded result = {chunked_decoder::status::more, 0, std::string()};
+        size_t from = 0;
+        for (size_t cut : cuts) {
+            if (cut <= from)
+                continue;
+            size_t used = 0;
+            result.status = decoder.feed(buffer_slice(text.substr(from, cut - from)), used, [&result](buffer_slice data) {
+                result.data.append(data.data(), data.size());
+            });
+            result.used += used;
+            from = cut;
+            if (result.status != chunked_decoder::status::more)
+                break;
+        }
+        return result;
+    }
+
+    bool decodes_to(std::string const& text, std::string const& data)
+    {
+        decoded result = decode(text);
+        return result.status == chunked_decoder::status::done && result.used == text.size() && result.data == data;
+    }
+
+    bool is_bad(std::string const& text)
+    {
+        return decode(text).status == chunked_decoder::status::bad;
+    }
+
+    std::string random_bytes(size_t count)
+    {
+        std::string bytes(count, '\0');
+        for (char& c : bytes)
+            c = static_cast<char>(rand());
+        return bytes;
+    }
+
+    void splits()
+    {
+        std::string const body = "5\r\nhello\r\n6;ext=1\r\n world\r\n1a\r\n" + std::string(26, 'z')
+                                 + "\r\n0\r\nX-Trailer: done\r\n\r\n";
+        std::string const data = "hello world" + std::string(26, 'z');
+
+        bool all = true;
+        for (size_t cut = 0; cut <= body.size(); cut++) {
+            decoded result = decode(body, {cut});
+            all = all && result.status == chunked_decoder::status::done && result.used == body.size() && result.data == data;
+        }
+        check(all, "a body cut in two anywhere decodes the same");
+
+        std::vector<size_t> every_byte;
+        for (size_t i = 1; i < body.size(); i++)
+            every_byte.push_back(i);
+        decoded result = decode(body, every_byte);
+        check(result.status == chunked_decoder::status::done && result.used == body.size() && result.data == data,
+              "a body fed a byte at a time decodes the same");
+
+        all = true;
+        for (int round = 0; round < 1000; round++) {
+            std::vector<size_t> cuts;
+            for (int i = rand() % 8; i > 0; i--)
+                cuts.push_back(rand() % (body.size() + 1));
+            decoded random = decode(body, cuts);
+            all = all && random.status == chunked_decoder::status::done && random.used == body.size() && random.data == data;
+        }
+        check(all, "a body cut at random places decodes the same");
+
+        std::string const next = "GET / HTTP/1.1\r\n\r\n";
+        result = decode(body + next, {body.size() / 2});
+        check(result.status == chunked_decoder::status::done && result.used == body.size(),
+              "the bytes after the last chunk aren't taken");
+    }
+
+    void extensions_and_trailers()
+    {
+        check(decodes_to("5;name=value\r\nhello\r\n0\r\n\r\n", "hello"), "a chunk extension is skipped");
+        check(decodes_to("5;a;b=\"q;uoted\"\r\nhello\r\n0;last\r\n\r\n", "hello"), "several extensions are skipped");
+        check(decodes_to("5 ;ext\r\nhello\r\n0\r\n\r\n", "hello"), "whitespace before an extension is allowed");
+        check(decodes_to("5\t \r\nhello\r\n0\r\n\r\n", "hello"), "whitespace after the size is allowed");
+        check(decodes_to("5\r\nhello\r\n0\r\nA: 1\r\nB: 2\r\n\r\n", "hello"), "trailers are skipped");
+        check(decodes_to("0\r\n\r\n", ""), "an empty body is just the last chunk");
+        check(is_bad("5;" + std::string(70 * 1024, 'e') + "\r\nhello\r\n0\r\n\r\n"), "extensions over the limit are bad");
+        check(is_bad("0\r\nX: " + std::string(70 * 1024, 't') + "\r\n\r\n"), "trailers over the limit are bad");
+    }
+
+    void sizes()
+    {
+        check(decodes_to("0005\r\nhello\r\n000\r\n\r\n", "hello"), "leading zeros are allowed");
+        check(decodes_to("000000000000000a\r\n0123456789\r\n0\r\n\r\n", "0123456789"), "a size of 16 digits is allowed");
+        check(decodes_to("A\r\n0123456789\r\n0\r\n\r\n", "0123456789"), "upper case hex digits are allowed");
+        check(is_bad("0000000000000000a\r\n0123456789\r\n0\r\n\r\n"), "a size of 17 digits is bad, even with leading zeros");
+        check(decode("ffffffffffffffff\r\nabc").status == chunked_decoder::status::more, "the largest size waits for its data");
+    }
+
+    void malformed()
+    {
+        check(is_bad("\r\nhello\r\n0\r\n\r\n"), "a size line without digits is bad");
+        check(is_bad("g\r\nhello\r\n0\r\n\r\n"), "a size that isn't hex is bad");
+        check(is_bad("-5\r\nhello\r\n0\r\n\r\n"), "a negative size is bad");
+        check(is_bad("5\nhello\r\n0\r\n\r\n"), "a size line ended by a bare LF is bad");
+        check(is_bad("5\r\rhello\r\n0\r\n\r\n"), "a size line with CR CR is bad");
+        check(is_bad("5 5\r\nhello\r\n0\r\n\r\n"), "digits after whitespace are bad");
+        check(is_bad("5;ext\nhello\r\n0\r\n\r\n"), "a bare LF in an extension is bad");
+        check(is_bad("5\r\nhelloX\r\n0\r\n\r\n"), "data longer than its size is bad");
+        check(is_bad("5\r\nhello\n0\r\n\r\n"), "data ended by a bare LF is bad");
+        check(is_bad("5\r\nhello\r\n0\r\nX: 1\n\r\n"), "a trailer ended by a bare LF is bad");
+        check(is_bad("5\r\nhello\r\n0\r\n\n"), "a body ended by a bare LF is bad");
+        check(is_bad("5\r\nhello\r\n0\r\n\rX"), "a body ended by CR and something else is bad");
+
+        decoded result = decode("5\r\nhelloX\r\n", {1, 4, 8});
+        check(result.status == chunked_decoder::status::bad, "bad framing is found when the body comes in parts");
+        std::string const bad = "5\r\nhelloX";
+        chunked_decoder decoder;
+        size_t used = 0;
+        decoder.feed(buffer_slice(bad), used);
+        decoder.feed(buffer_slice(std::string("\r\n0\r\n\r\n")), used);
+        check(decoder.get_status() == chunked_decoder::status::bad && used == 0, "a bad body stays bad");
+    }
+
+    void round_trips()
+    {
+        bool all = true;
+        for (int round = 0; round < 200; round++) {
+            buffer_chain framed;
+            std::string data;
+            for (int i = rand() % 6; i >= 0; i--) {
+                // a chunk of several slices, as a write queue holds it
+                buffer_chain chunk;
+                for (int j = rand() % 3; j >= 0; j--) {
+                    std::string piece = random_bytes(rand() % (i == 0 ? 70000 : 300));
+                    chunk.append(buffer_slice(piece));
+                    data += piece;
+                }
+                append_chunk(framed, chunk);
+            }
+            append_last_chunk(framed);
+            std::string text = framed.to_string();
+            decoded result = decode(text, {static_cast<size_t>(rand()) % (text.size() + 1)});
+            all = all && result.status == chunked_decoder::status::done && result.used == text.size() && result.data == data;
+        }
+        check(all, "what append_chunk() frames decodes to the same data");
+
+        buffer_chain framed;
+        append_chunk(framed, buffer_chain());
+        check(framed.empty(), "append_chunk() of nothing adds nothing");
+        buffer_chain data;
+        data.append(buffer_slice(std::string(255, 'x')));
+        append_chunk(framed, data);
+        check(framed.to_string().compare(0, 4, "ff\r\n") == 0, "the size of a chunk is in hex");
+        append_last_chunk(framed);
+        check(framed.to_string().compare(framed.size() - 5, 5, "0\r\n\r\n") == 0, "the last chunk ends the body");
+    }
+}
+
+int main()
+{
+    srand(2015);
+    splits();
+    extensions_and_trailers();
+    sizes();
+    malformed();
+    round_trips();
+    return failures == 0 ? 0 : 1;
+}
@@ -0,0 +1,165 @@
+//
+//  connector_test.cpp
+//  proxy
+//
+//  The order in which the addresses of an origin are tried: families
+//  alternated as the resolver hands them over, then the fastest known
+//  address first, the untried ones next and those that failed lately last.
+//
+
+#include <arpa/inet.h>
+#include <netdb.h>
+#include <netinet/in.h>
+#include <string.h>
+#include <iostream>
+#include <string>
+#include <vector>
+
+#include "connector.hpp"
+#include "DNSresolver.hpp"
+
+namespace
+{
+    int failures = 0;
+
+    void check(bool ok, char const* what)
+    {
+        if (ok)
+            return;
+        std::cout << "FAILED: " << what << "\n";
+        failures++;
+    }
+
+    typedef connect_history::clock_t clock_t;
+
+    sockaddr_storage address(std::string const& text, int port = 80)
+    {
+        sockaddr_storage addr;
+        memset(&addr, 0, sizeof(addr));
+        if (text.find(':') != std::string::npos) {
+            sockaddr_in6& in6 = reinterpret_cast<sockaddr_in6&>(addr);
+            in6.sin6_family = AF_INET6;
+            in6.sin6_port = htons(port);
+            inet_pton(AF_INET6, text.c_str(), &in6.sin6_addr);
+        } else {
+            sockaddr_in& in = reinterpret_cast<sockaddr_in&>(addr);
+            in.sin_family = AF_INET;
+            in.sin_port = htons(port);
+            inet_pton(AF_INET, text.c_str(), &in.sin_addr);
+        }
+        return addr;
+    }
+
+    std::string joined(std::vector<sockaddr_storage> const& addresses)
+    {
+        std::string text;
+        for (auto const& addr : addresses)
+            text += (text.empty() ? "" : " ") + format_address(addr);
+        return text;
+    }
+
+    // as getaddrinfo() would return the addresses, in this order
+    struct addrinfo_list
+    {
+        explicit addrinfo_list(std::vector<std::string> const& texts)
+            : addresses(texts.size())
+            , infos(texts.size())
+        {
+            for (size_t i = 0; i < texts.size(); i++) {
+                addresses[i] = address(texts[i]);
+                memset(&infos[i], 0, sizeof(infos[i]));
+                infos[i].ai_family = addresses[i].ss_family;
+                infos[i].ai_socktype = SOCK_STREAM;
+                infos[i].ai_addr = reinterpret_cast<sockaddr*>(&addresses[i]);
+                infos[i].ai_addrlen = addresses[i].ss_family == AF_INET6 ? sizeof(sockaddr_in6) : sizeof(sockaddr_in);
+                infos[i].ai_next = i + 1 < texts.size() ? &infos[i + 1] : nullptr;
+            }
+        }
+
+        addrinfo const* get() const { return infos.empty() ? nullptr : &infos[0]; }
+
+        std::vector<sockaddr_storage> addresses;
+        std::vector<addrinfo> infos;
+    };
+
+    void interleaving()
+    {
+        addrinfo_list six_first({"2001:db8::1", "2001:db8::2", "2001:db8::3", "192.0.2.1"});
+        check(joined(interleave(six_first.get())) == "[2001:db8::1]:80 192.0.2.1:80 [2001:db8::2]:80 [2001:db8::3]:80",
+              "the families alternate, IPv6 first when the resolver prefers it");
+
+        addrinfo_list four_first({"192.0.2.1", "192.0.2.2", "2001:db8::1", "2001:db8::2", "192.0.2.3"});
+        check(joined(interleave(four_first.get())) == "192.0.2.1:80 [2001:db8::1]:80 192.0.2.2:80 [2001:db8::2]:80 192.0.2.3:80",
+              "the families alternate, IPv4 first when the resolver prefers it");
+
+        addrinfo_list one_family({"192.0.2.3", "192.0.2.1", "192.0.2.2"});
+        check(joined(interleave(one_family.get())) == "192.0.2.3:80 192.0.2.1:80 192.0.2.2:80",
+              "a single family keeps the resolver's order");
+
+        std::vector<std::string> many;
+        for (int i = 1; i <= 12; i++) {
+            many.push_back("2001:db8::" + std::to_string(i));
+            many.push_back("192.0.2." + std::to_string(i));
+        }
+        addrinfo_list long_list(many);
+        std::vector<sockaddr_storage> kept = interleave(long_list.get());
+        check(kept.size() == 8 && format_address(kept[7]) == "192.0.2.4:80", "at most 8 addresses are kept");
+
+        check(interleave(nullptr).empty(), "no addresses give none");
+    }
+
+    void ordering()
+    {
+        clock_t::time_point const now = clock_t::now();
+        sockaddr_storage const a = address("192.0.2.1");
+        sockaddr_storage const b = address("2001:db8::1");
+        sockaddr_storage const c = address("192.0.2.2");
+        sockaddr_storage const d = address("2001:db8::2");
+        sockaddr_storage const e = address("192.0.2.3");
+        std::vector<sockaddr_storage> const resolved = {a, b, c, d, e};
+
+        connect_history history;
+        std::vector<sockaddr_storage> addresses = resolved;
+        history.order(addresses, now);
+        check(joined(addresses) == joined(resolved), "without history the resolver's order is kept");
+
+        history.connected(c, std::chrono::milliseconds(30));
+        history.connected(e, std::chrono::milliseconds(10));
+        history.failed(a, now);
+        addresses = resolved;
+        history.order(addresses, now);
+        check(joined(addresses) == joined({e, c, b, d, a}),
+              "the fastest known address first, then the untried ones, then the failed ones");
+
+        // a late failure of a known address puts it behind the untried ones
+        history.failed(e, now);
+        addresses = resolved;
+        history.order(addresses, now);
+        check(joined(addresses) == joined({c, b, d, a, e}), "a known address that failed lately goes last");
+
+        // and a success brings it back
+        history.connected(e, std::chrono::milliseconds(10));
+        addresses = resolved;
+        history.order(addresses, now);
+        check(joined(addresses) == joined({e, c, b, d, a}), "a failed address that connects again is known again");
+
+        // failures are forgotten after a while
+        addresses = resolved;
+        history.order(addresses, now + std::chrono::minutes(6));
+        check(joined(addresses) == joined({e, c, a, b, d}), "an old failure counts as untried");
+
+        check(history.attempt_delay(b) == std::chrono::milliseconds(250), "the delay without history is 250 ms");
+        check(history.attempt_delay(c) == std::chrono::milliseconds(100), "the delay is at least 100 ms");
+        history.connected(d, std::chrono::milliseconds(400));
+        check(history.attempt_delay(d) == std::chrono::milliseconds(800), "the delay is twice the handshake");
+        history.connected(a, std::chrono::seconds(5));
+        check(history.attempt_delay(a) == std::chrono::seconds(2), "the delay is at most 2 s");
+    }
+}
+
+int main()
+{
+    interleaving();
+    ordering();
+    return failures == 0 ? 0 : 1;
+}
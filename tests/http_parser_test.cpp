@@ -0,0 +1,176 @@
+//
+//  http_parser_test.cpp
+//  proxy
+//
+//  The limit on message heads, whether a head comes in one part or in
+//  several; the lookup of methods and header names, and heads with
+//  headers that may only come once.
+//
+
+#include <ctype.h>
+#include <iostream>
+#include <string>
+
+#include "new_http_handler.hpp"
+
+namespace
+{
+    int failures = 0;
+
+    void check(bool ok, char const* what)
+    {
+        if (ok)
+            return;
+        std::cout << "FAILED: " << what << "\n";
+        failures++;
+    }
+
+    // the first line and a header padded to make the head `size` bytes
+    std::string head_of_size(std::string const& first_line, size_t size)
+    {
+        std::string head = first_line + "\r\nX-Pad: ";
+        std::string const end = "\r\n\r\n";
+        head.append(size - head.size() - end.size(), 'a');
+        return head + end;
+    }
+
+    // a part for each piece of text, as reads would hand them over
+    template <typename message>
+    message parse_in_parts(std::string const& text, size_t split)
+    {
+        message parsed(text.substr(0, split));
+        parsed.add_part(text.substr(split));
+        return parsed;
+    }
+
+    header_id header_of(std::string const& name)
+    {
+        return find_header(name.data(), name.size());
+    }
+
+    http_method method_of(std::string const& name)
+    {
+        return find_method(name.data(), name.size());
+    }
+
+    char const* const known_names[] = {
+        "host", "content-length", "transfer-encoding", "connection", "proxy-connection",
+        "keep-alive", "te", "trailer", "upgrade", "expect", "etag", "vary", "cache-control",
+        "if-match", "if-modified-since", "if-none-match", "if-range", "if-unmodified-since",
+        "proxy-authenticate", "proxy-authorization",
+    };
+
+    void header_names()
+    {
+        bool all = true;
+        for (char const* name : known_names) {
+            std::string lower = name;
+            std::string upper = name;
+            std::string mixed = name;
+            for (size_t i = 0; i < upper.size(); i++) {
+                upper[i] = static_cast<char>(toupper(upper[i]));
+                if (i % 2 == 0)
+                    mixed[i] = upper[i];
+            }
+            header_id id = header_of(lower);
+            all = all && id != header_id::other && header_of(upper) == id && header_of(mixed) == id;
+        }
+        check(all, "known header names are found whatever their case");
+        check(sizeof(known_names) / sizeof(known_names[0]) == known_header_count - 1,
+              "the test knows every known header");
+
+        // the same length and last character hash to the same slot
+        all = true;
+        for (char const* name : known_names) {
+            std::string other = name;
+            other[0] = other[0] == 'x' ? 'y' : 'x';
+            all = all && header_of(other) == header_id::other;
+        }
+        check(all, "names in the slot of a known header aren't taken for it");
+        check(header_of("post") == header_id::other, "post isn't host");
+        check(header_of("transfer_encoding") == header_id::other, "transfer_encoding isn't transfer-encoding");
+        check(header_of("hos") == header_id::other && header_of("hostt") == header_id::other,
+              "a prefix or an extension of a known name isn't it");
+        check(header_of("") == header_id::other, "an empty name isn't known");
+        check(header_of("x-forwarded-for") == header_id::other, "other names aren't known");
+
+        response message("HTTP/1.1 204 No Content\r\nX-Custom: yes\r\nETag: \"v1\"\r\n\r\n");
+        check(message.get_header(text_view("x-CUSTOM")).equals_nocase("yes"), "unknown headers are found whatever their case");
+        check(message.get_header(text_view("etag")).equals_nocase("\"v1\""), "known headers are found by their name too");
+    }
+
+    void methods()
+    {
+        check(method_of("GET") == http_method::GET && method_of("HEAD") == http_method::HEAD
+              && method_of("POST") == http_method::POST && method_of("PUT") == http_method::PUT
+              && method_of("DELETE") == http_method::DELETE && method_of("CONNECT") == http_method::CONNECT
+              && method_of("OPTIONS") == http_method::OPTIONS && method_of("TRACE") == http_method::TRACE
+              && method_of("PATCH") == http_method::PATCH, "the standard methods are found");
+        // RFC 9110 9.1
+        check(method_of("get") == http_method::other && method_of("Post") == http_method::other,
+              "methods are case-sensitive");
+        check(method_of("GETS") == http_method::other && method_of("GE") == http_method::other
+              && method_of("PROPFIND") == http_method::other && method_of("") == http_method::other,
+              "other methods are other");
+        check(request("PROPFIND http://example.com/ HTTP/1.1\r\nHost: example.com\r\n\r\n").get_state() == FULL_BODY,
+              "a request with another method is parsed");
+    }
+
+    void duplicate_headers()
+    {
+        std::string const request_line = "POST http://example.com/ HTTP/1.1\r\n";
+        check(request(request_line + "Host: example.com\r\nHost: example.org\r\n\r\n").get_state() == BAD,
+              "two Host headers are BAD");
+        check(request(request_line + "Host: example.com\r\nHOST: example.com\r\n\r\n").get_state() == BAD,
+              "two Host headers are BAD whatever their case and value");
+        check(request(request_line + "Host: a\r\nTransfer-Encoding: chunked\r\nTransfer-Encoding: chunked\r\n\r\n0\r\n\r\n").get_state() == BAD,
+              "two Transfer-Encoding headers are BAD");
+        check(request(request_line + "Host: a\r\nContent-Length: 5\r\nContent-Length: 6\r\n\r\nhello!").get_state() == BAD,
+              "two different Content-Length headers are BAD");
+        check(request(request_line + "Host: a\r\nContent-Length: 5\r\ncontent-length: 5\r\n\r\nhello").get_state() == FULL_BODY,
+              "the same Content-Length twice is parsed");
+        check(request(request_line + "Host: a\r\nContent-Length: 5\r\nTransfer-Encoding: chunked\r\n\r\n").get_state() == BAD,
+              "Content-Length with Transfer-Encoding is BAD");
+        check(response("HTTP/1.1 200 OK\r\nContent-Length: 1\r\nContent-Length: 2\r\n\r\nab").get_state() == BAD,
+              "a response with two different Content-Length headers is BAD");
+        check(request(request_line + "Host: a\r\nContent-Length: 0\r\nVary: a\r\nVary: b\r\n\r\n").get_state() == FULL_BODY,
+              "other headers may come more than once");
+    }
+}
+
+int main()
+{
+    std::string const request_line = "GET http://example.com/ HTTP/1.1";
+    std::string const status_line = "HTTP/1.1 204 No Content";
+    size_t const limit = http::max_head;
+
+    check(request(head_of_size(request_line, limit)).get_state() == FULL_BODY,
+          "a request head of max_head in one part is parsed");
+    check(request(head_of_size(request_line, limit + 1)).get_state() == BAD,
+          "a request head over max_head in one part is BAD");
+    check(request(head_of_size(request_line, 4 * limit)).get_state() == BAD,
+          "a request head of four times max_head in one part is BAD");
+    check(response(head_of_size(status_line, limit + 1)).get_state() == BAD,
+          "a response head over max_head in one part is BAD");
+
+    check(parse_in_parts<request>(head_of_size(request_line, limit), limit / 2).get_state() == FULL_BODY,
+          "a request head of max_head in two parts is parsed");
+    check(parse_in_parts<request>(head_of_size(request_line, limit + 1), limit / 2).get_state() == BAD,
+          "a request head over max_head in two parts is BAD");
+    check(parse_in_parts<request>(head_of_size(request_line, limit + 1), limit).get_state() == BAD,
+          "a request head over max_head whose end comes alone is BAD");
+
+    // the body doesn't count, however much of it comes with the head
+    std::string body(4 * limit, 'b');
+    response with_body("HTTP/1.1 200 OK\r\nContent-Length: " + std::to_string(body.size()) + "\r\n\r\n" + body);
+    check(with_body.get_state() == FULL_BODY, "a small head with a large body in one part is parsed");
+
+    header_names();
+    methods();
+    duplicate_headers();
+
+    if (failures != 0)
+        return 1;
+    std::cout << "http parser: all passed\n";
+    return 0;
+}
@@ -0,0 +1,201 @@
+//
+//  http_scan_test.cpp
+//  proxy
+//
+//  The vectorized scan kernels against the scalar ones: random and
+//  adversarial input at every alignment and tail length, delimiters on
+//  the block boundaries, and heads split between calls.
+//
+
+#include <algorithm>
+#include <cstdint>
+#include <iostream>
+#include <random>
+#include <string>
+#include <vector>
+
+#include "http_scan.hpp"
+
+namespace
+{
+    // lengths past two avx2 blocks and a tail, at every alignment in a block
+    size_t const max_length = 100;
+    size_t const max_offset = 32;
+    // bytes around the input that the kernels must not look at
+    size_t const guard = 64;
+
+    int failures = 0;
+
+    void fail(scan_kernels const& kernels, char const* function, std::string const& input, size_t offset, std::string const& detail)
+    {
+        // the first few are enough to go by
+        if (failures++ < 10) {
+            std::cout << "FAILED: " << kernels.name << " " << function << " at offset " << offset
+                      << ", length " << input.size() << ": " << detail << "\n";
+        }
+    }
+
+    // the input at offset from a 64 byte boundary, between bytes the
+    // kernels would take for delimiters and the end of a head
+    struct placed
+    {
+        placed(std::string const& input, size_t offset)
+            : storage(guard + max_offset + input.size() + guard + 64)
+        {
+            char* base = storage.data();
+            base += (64 - reinterpret_cast<uintptr_t>(base) % 64) % 64;
+            data = base + guard + offset;
+            for (char* p = storage.data(); p != storage.data() + storage.size(); p++)
+                *p = "\r\n\r\n:"[(p - storage.data()) % 5];
+            input.copy(data, input.size());
+        }
+
+        std::vector<char> storage;
+        char* data;
+    };
+
+    // delimiters and tchars, with the other bytes the kernels tell apart
+    char random_byte(std::mt19937& random)
+    {
+        static std::string const alphabet = std::string("\r\n: \t-_.!~aZz09AG\"(),/;=?@[]{}\x7f\x80\xff") + '\0';
+        return alphabet[random() % alphabet.size()];
+    }
+
+    // token characters with delimiters at the block boundaries
+    std::vector<std::string> adversarial_inputs()
+    {
+        std::vector<std::string> inputs;
+        size_t const positions[] = {0, 1, 14, 15, 16, 17, 30, 31, 32, 33, 47, 48, 63, 64, 65};
+        char const delimiters[] = {'\r', '\n', ':', ' ', '"', '\x80', '~'};
+        for (size_t length = 0; length <= max_length; length++) {
+            for (size_t position : positions) {
+                if (position >= length)
+                    continue;
+                for (char delimiter : delimiters) {
+                    std::string input(length, 'a');
+                    input[position] = delimiter;
+                    inputs.push_back(input);
+                }
+                // the end of a head ending at, and straddling, the boundary
+                for (size_t back = 0; back < 4 && back <= position; back++) {
+                    std::string input(length, 'x');
+                    input.replace(position - back, std::min<size_t>(4, length - position + back), std::string("\r\n\r\n", std::min<size_t>(4, length - position + back)));
+                    inputs.push_back(input);
+                }
+            }
+        }
+        return inputs;
+    }
+
+    std::vector<std::string> random_inputs(std::mt19937& random)
+    {
+        std::vector<std::string> inputs;
+        for (size_t length = 0; length <= max_length; length++) {
+            for (int round = 0; round < 10; round++) {
+                std::string input(length, '\0');
+                for (char& c : input)
+                    c = random_byte(random);
+                inputs.push_back(input);
+            }
+        }
+        return inputs;
+    }
+
+    void compare(scan_kernels const& tested, std::string const& input, size_t offset)
+    {
+        scan_kernels const& scalar = scalar_scan_kernels();
+        placed expected(input, offset);
+        placed actual(input, offset);
+
+        // tails a head may have left, from nothing to all but the last byte
+        uint32_t const tails[] = {0, 0x0d, 0x0d0a, 0x0d0a0d, 0x61626364, 0x0a0d0a0d};
+        for (uint32_t tail : tails) {
+            uint32_t expected_tail = tail;
+            uint32_t actual_tail = tail;
+            size_t expected_end = scalar.find_head_end(expected.data, input.size(), expected_tail);
+            size_t actual_end = tested.find_head_end(actual.data, input.size(), actual_tail);
+            if (expected_end != actual_end || expected_tail != actual_tail) {
+                fail(tested, "find_head_end", input, offset, "tail " + std::to_string(tail) + ": "
+                     + std::to_string(actual_end) + " instead of " + std::to_string(expected_end));
+            }
+        }
+
+        char const pairs[][2] = {{'\r', '\n'}, {' ', ' '}, {'\n', '\n'}, {':', ':'}, {'\x80', '\xff'}};
+        for (auto const& pair : pairs) {
+            size_t expected_at = scalar.find_either(expected.data, input.size(), pair[0], pair[1]);
+            size_t actual_at = tested.find_either(actual.data, input.size(), pair[0], pair[1]);
+            if (expected_at != actual_at) {
+                fail(tested, "find_either", input, offset, std::to_string(actual_at) + " instead of " + std::to_string(expected_at));
+            }
+        }
+
+        size_t expected_length = scalar.token_length(expected.data, input.size());
+        size_t actual_length = tested.token_length(actual.data, input.size());
+        if (expected_length != actual_length) {
+            fail(tested, "token_length", input, offset, std::to_string(actual_length) + " instead of " + std::to_string(expected_length));
+        }
+    }
+
+    // a head whose end is split between two parts at every point, the
+    // second call goes on with the tail of the first
+    void compare_split_heads(scan_kernels const& tested)
+    {
+        for (size_t end = 4; end <= max_length; end++) {
+            std::string head(end - 4, 'h');
+            for (size_t i = 0; i < head.size(); i += 7)
+                head[i] = i % 2 ? '\n' : '\r';
+            head += "\r\n\r\nbody";
+            for (size_t split = 0; split <= head.size(); split++) {
+                std::string first = head.substr(0, split);
+                std::string second = head.substr(split);
+                placed first_part(first, split % 32);
+                placed second_part(second, (split + 5) % 32);
+                uint32_t tail = 0;
+                size_t found = tested.find_head_end(first_part.data, first.size(), tail);
+                if (found == 0) {
+                    size_t rest = tested.find_head_end(second_part.data, second.size(), tail);
+                    found = rest == 0 ? 0 : split + rest;
+                }
+                if (found != end) {
+                    fail(tested, "find_head_end", head, split, "split head ends at " + std::to_string(found)
+                         + " instead of " + std::to_string(end));
+                }
+            }
+        }
+    }
+}
+
+int main()
+{
+    std::vector<scan_kernels const*> vectorized;
+    if (sse42_scan_kernels())
+        vectorized.push_back(sse42_scan_kernels());
+    if (avx2_scan_kernels())
+        vectorized.push_back(avx2_scan_kernels());
+
+    // the scalar kernels on their own, the split heads are checked by position
+    compare_split_heads(scalar_scan_kernels());
+
+    std::mt19937 random(2540);
+    std::vector<std::string> inputs = adversarial_inputs();
+    std::vector<std::string> more = random_inputs(random);
+    inputs.insert(inputs.end(), more.begin(), more.end());
+
+    for (scan_kernels const* kernels : vectorized) {
+        for (std::string const& input : inputs) {
+            for (size_t offset = 0; offset < max_offset; offset++)
+                compare(*kernels, input, offset);
+        }
+        compare_split_heads(*kernels);
+        std::cout << kernels->name << ": " << inputs.size() << " inputs at " << max_offset << " offsets\n";
+    }
+    if (vectorized.empty())
+        std::cout << "no vectorized kernels on this CPU, only the scalar ones checked\n";
+
+    if (failures != 0) {
+        std::cout << failures << " failed\n";
+        return 1;
+    }
+    std::cout << "http scan: all passed, best kernels " << http_scan().name << "\n";
+    return 0;
+}
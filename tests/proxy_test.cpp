@@ -0,0 +1,250 @@
+//
+//  proxy_test.cpp
+//  proxy
+//
+//  The proxy on an event loop of its own, between a client and an origin
+//  on this host: an upstream connection is only reused for a new request
+//  once the previous one was sent in full.
+//
+
+#include <arpa/inet.h>
+#include <netinet/in.h>
+#include <sys/socket.h>
+#include <sys/time.h>
+#include <unistd.h>
+#include <stdlib.h>
+#include <string.h>
+#include <chrono>
+#include <future>
+#include <iostream>
+#include <mutex>
+#include <stdexcept>
+#include <string>
+#include <thread>
+#include <vector>
+
+#include "kqueue.hpp"
+#include "proxy.hpp"
+#include "DNSresolver.hpp"
+#include "worker_pool.hpp"
+
+namespace
+{
+    int const proxy_port = 25400;
+
+    int failures = 0;
+
+    void check(bool ok, char const* what)
+    {
+        if (ok)
+            return;
+        std::cout << "FAILED: " << what << "\n";
+        failures++;
+    }
+
+    // reads give up after a while, a test that goes wrong fails instead of hanging
+    void set_timeout(int fd)
+    {
+        struct timeval timeout = {3, 0};
+        setsockopt(fd, SOL_SOCKET, SO_RCVTIMEO, &timeout, sizeof(timeout));
+    }
+
+    int connect_to(int port)
+    {
+        int fd = ::socket(AF_INET, SOCK_STREAM, 0);
+        struct sockaddr_in addr = {};
+        addr.sin_family = AF_INET;
+        addr.sin_port = htons(port);
+        addr.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+        if (fd == -1 || ::connect(fd, reinterpret_cast<sockaddr*>(&addr), sizeof(addr)) == -1) {
+            std::cout << "can't connect to port " << port << ": " << strerror(errno) << "\n";
+            exit(1);
+        }
+        set_timeout(fd);
+        return fd;
+    }
+
+    void send_all(int fd, std::string const& text)
+    {
+        size_t sent = 0;
+        while (sent < text.size()) {
+            ssize_t n = ::send(fd, text.data() + sent, text.size() - sent, MSG_NOSIGNAL);
+            if (n <= 0)
+                return;
+            sent += n;
+        }
+    }
+
+    // a head, and the bytes read past it stay in `buffer`; empty on eof or timeout
+    std::string read_head(int fd, std::string& buffer)
+    {
+        size_t end;
+        while ((end = buffer.find("\r\n\r\n")) == std::string::npos) {
+            char bytes[4096];
+            ssize_t n = ::recv(fd, bytes, sizeof(bytes), 0);
+            if (n <= 0)
+                return std::string();
+            buffer.append(bytes, n);
+        }
+        std::string head = buffer.substr(0, end + 4);
+        buffer.erase(0, end + 4);
+        return head;
+    }
+
+    // false on eof or timeout
+    bool read_body(int fd, std::string& buffer, size_t length, std::string& body)
+    {
+        while (buffer.size() < length) {
+            char bytes[65536];
+            ssize_t n = ::recv(fd, bytes, sizeof(bytes), 0);
+            if (n <= 0)
+                return false;
+            buffer.append(bytes, n);
+        }
+        body = buffer.substr(0, length);
+        buffer.erase(0, length);
+        return true;
+    }
+
+    size_t content_length(std::string const& head)
+    {
+        size_t at = head.find("Content-Length: ");
+        return at == std::string::npos ? 0 : strtoul(head.c_str() + at + 16, nullptr, 10);
+    }
+
+    // answers a POST with a 413 as soon as its head is in, then reads the
+    // body and keeps the connection, as origins do; a GET gets its path back
+    struct origin
+    {
+        origin()
+        {
+            listener = ::socket(AF_INET, SOCK_STREAM, 0);
+            struct sockaddr_in addr = {};
+            addr.sin_family = AF_INET;
+            addr.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+            socklen_t length = sizeof(addr);
+            if (::bind(listener, reinterpret_cast<sockaddr*>(&addr), sizeof(addr)) == -1
+                || ::listen(listener, 16) == -1
+                || getsockname(listener, reinterpret_cast<sockaddr*>(&addr), &length) == -1) {
+                std::cout << "can't start the origin: " << strerror(errno) << "\n";
+                exit(1);
+            }
+            port = ntohs(addr.sin_port);
+            acceptor = std::thread([this]() { accept_loop(); });
+        }
+
+        ~origin()
+        {
+            // wakes up the accept()
+            ::shutdown(listener, SHUT_RDWR);
+            acceptor.join();
+            ::close(listener);
+            for (auto& thread : connections)
+                thread.join();
+        }
+
+        void accept_loop()
+        {
+            for (;;) {
+                int fd = ::accept(listener, nullptr, nullptr);
+                if (fd == -1)
+                    return;
+                set_timeout(fd);
+                std::lock_guard<std::mutex> lock(mutex);
+                connections.push_back(std::thread([fd]() { serve(fd); }));
+            }
+        }
+
+        static void serve(int fd)
+        {
+            std::string buffer;
+            for (;;) {
+                std::string head = read_head(fd, buffer);
+                if (head.empty())
+                    break;
+                std::string body;
+                if (head.compare(0, 5, "POST ") == 0) {
+                    send_all(fd, "HTTP/1.1 413 Payload Too Large\r\nContent-Length: 0\r\n\r\n");
+                    if (!read_body(fd, buffer, content_length(head), body))
+                        break;
+                } else {
+                    std::string path = head.substr(4, head.find(' ', 4) - 4);
+                    send_all(fd, "HTTP/1.1 200 OK\r\nContent-Length: " + std::to_string(path.size()) + "\r\n\r\n" + path);
+                }
+            }
+            ::close(fd);
+        }
+
+        int listener;
+        int port;
+        std::thread acceptor;
+        std::mutex mutex;
+        std::vector<std::thread> connections;
+    };
+
+    // the response's head and body, empty on eof or timeout
+    std::string read_response(int fd, std::string& buffer)
+    {
+        std::string head = read_head(fd, buffer);
+        std::string body;
+        if (head.empty() || !read_body(fd, buffer, content_length(head), body))
+            return std::string();
+        return head + body;
+    }
+
+    void answered_before_the_body_is_sent(int origin_port)
+    {
+        std::string const host = "127.0.0.1:" + std::to_string(origin_port);
+        size_t const body_size = 200000;
+        int client = connect_to(proxy_port);
+        std::string buffer;
+
+        send_all(client, "POST http://" + host + "/upload HTTP/1.1\r\nHost: " + host
+                 + "\r\nContent-Length: " + std::to_string(body_size) + "\r\n\r\n" + std::string(1000, 'b'));
+        std::string rejected = read_response(client, buffer);
+        check(rejected.compare(0, 12, "HTTP/1.1 413") == 0, "the early answer reaches the client");
+
+        // the rest of the body, then a request on the same connection. Requests
+        // aren't pipelined by the proxy, the next one waits for the body to be read
+        send_all(client, std::string(body_size - 1000, 'b'));
+        std::this_thread::sleep_for(std::chrono::milliseconds(200));
+        send_all(client, "GET http://" + host + "/second HTTP/1.1\r\nHost: " + host + "\r\n\r\n");
+        std::string second = read_response(client, buffer);
+        check(second.compare(0, 12, "HTTP/1.1 200") == 0, "the next request gets its own response");
+        check(second.size() >= 7 && second.compare(second.size() - 7, 7, "/second") == 0,
+              "the next request isn't read as the rest of the body");
+        ::close(client);
+    }
+}
+
+int main()
+{
+    origin origin;
+    DNSresolver resolver(1);
+    worker_pool pool(1);
+    std::promise<io_queue*> started;
+    std::thread loop([&]() {
+        try {
+            io_queue queue(io_backend::native);
+            proxy_server proxy(queue, proxy_port, resolver, pool);
+            started.set_value(&queue);
+            queue.watch_loop();
+        } catch (std::runtime_error const&) {
+            started.set_exception(std::current_exception());
+        }
+    });
+    io_queue* queue;
+    try {
+        queue = started.get_future().get();
+    } catch (std::runtime_error const& error) {
+        std::cout << "can't start the proxy: " << error.what() << "\n";
+        loop.join();
+        return 1;
+    }
+
+    answered_before_the_body_is_sent(origin.port);
+
+    queue->post([queue]() { queue->hard_stop(); });
+    loop.join();
+    return failures == 0 ? 0 : 1;
+}